@@ -1,179 +1,93 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 // Hashes
 #include "xxhash.h"
 #include "crc32.h"
+#include "parity.h"
+#include "scrub.h"
+#include "policy.h"
+#include "repair.h"
+#include "fixed.h"
+#include "huge.h"
+#include "arena.h"
+#include "metrics.h"
+#include "cdc.h"
+#include "dedup.h"
+#include "merkle.h"
+#include "pool.h"
 
-/**
- * fparity32 - use several registres for computing data 32-bit parity
- * @data - input data stream
- * @byte_len - input data lengh in bytes
- * @seed - for altering parity value
- */
-
-static uint32_t fparity32(const void *data, uint64_t byte_len, uint64_t seed) {
-        uint32_t p1 = 0, p2 = 0, p3 = 0, p4 = 0;
-        uint32_t *ptr = (uint32_t *) data;
-        uint64_t index, index_end;
-        uint32_t ret = 0;
-
-        if (byte_len%sizeof(ret)) {
-                printf("Data size must be aligned to: %lu\n", sizeof(ret));
-                return -1;
-        }
-
-        index_end = byte_len/sizeof(ret);
-
-        for (index = 0; index < index_end;) {
-                switch ((index - index_end)%4) {
-                        case 0:
-                                p1 ^= ptr[index++];
-                                p2 ^= ptr[index++];
-                                p3 ^= ptr[index++];
-                                p4 ^= ptr[index++];
-                        break;
-                        case 1:
-                                p1 ^= ptr[index++];
-                        break;
-                        case 2:
-                                p1 ^= ptr[index++];
-                                p2 ^= ptr[index++];
-                        break;
-                        case 3:
-                                p1 ^= ptr[index++];
-                                p2 ^= ptr[index++];
-                                p3 ^= ptr[index++];
-                        break;
-                }
+static void corrupt_random_bit(void *ptr, size_t size) {
+        uint8_t *memory = (uint8_t *) ptr;
+        uint32_t rand_offset = rand() % size;
+        uint8_t old, new;
+        old = memory[rand_offset];
+        while (memory[rand_offset] == old) {
+                memory[rand_offset] |= 1 << rand() % 7;
         }
-
-        ret = p1 ^ p2 ^ p3 ^ p4 ^ seed;
-
-        return ret;
+        new = memory[rand_offset];
+        printf("Byte at 0x%" PRIx32  ": 0x%" PRIx32 " -> 0x%" PRIx32 "\n", rand_offset, old, new);
 }
 
-/**
- * fparity64 - use several registres for computing data 64-bit parity
- * @data - input data stream
- * @byte_len - input data lengh in bytes
- * @seed - for altering parity value
- */
-
-static uint64_t fparity64(const void *data, uint64_t byte_len, uint64_t seed) {
-        uint64_t p1 = 0, p2 = 0, p3 = 0, p4 = 0;
-        uint64_t *ptr = (uint64_t *) data;
-        uint64_t index, index_end;
-        uint64_t ret = 0;
-
-        if (byte_len%sizeof(ret)) {
-                printf("Data size must be aligned to: %lu\n", sizeof(ret));
-                return -1;
-        }
+/* One thread of the concurrent dedup example, its own copies of shared contents */
+struct dedup_worker {
+        pthread_t thread;
+        struct dedup_index *idx;
+        pthread_barrier_t *barrier;
+        const void **pages;
+        size_t n;
+        unsigned seed;
+        /* Entries this thread inserted and did not remove */
+        long owned;
+        long removes;
+        long errors;
+};
 
-        index_end = byte_len/sizeof(ret);
-
-        for (index = 0; index < index_end;) {
-                switch ((index - index_end)%4) {
-                        case 0:
-                                p1 ^= ptr[index++];
-                                p2 ^= ptr[index++];
-                                p3 ^= ptr[index++];
-                                p4 ^= ptr[index++];
-                        break;
-                        case 1:
-                                p1 ^= ptr[index++];
-                        break;
-                        case 2:
-                                p1 ^= ptr[index++];
-                                p2 ^= ptr[index++];
-                        break;
-                        case 3:
-                                p1 ^= ptr[index++];
-                                p2 ^= ptr[index++];
-                                p3 ^= ptr[index++];
-                        break;
+static void dedup_worker_page(struct dedup_worker *w, size_t k, int churn) {
+        const void *page = w->pages[k], *other = w->pages[rand_r(&w->seed) % w->n];
+        uint64_t digest = page_xxh64(page), loc;
+        int ret;
+
+        ret = dedup_insert(w->idx, digest, page, (uintptr_t) page, &loc);
+        if (ret < 0 || (ret == 1 && memcmp((const void *) (uintptr_t) loc, page, PAGE_SIZE))) {
+                w->errors++;
+        } else if (!ret) {
+                w->owned++;
+                if (churn && rand_r(&w->seed) & 1) {
+                        if (dedup_remove(w->idx, digest, (uintptr_t) page))
+                                w->errors++;
+                        w->owned--;
+                        w->removes++;
                 }
         }
 
-        ret = p1 ^ p2 ^ p3 ^ p4 ^ seed;
-
-        return ret;
+        /* Whatever is found has the content looked for */
+        if (dedup_lookup(w->idx, page_xxh64(other), other, &loc) &&
+            memcmp((const void *) (uintptr_t) loc, other, PAGE_SIZE))
+                w->errors++;
 }
 
-#define PAGE_SIZE (4*1024)
+static void *dedup_worker_fn(void *arg) {
+        struct dedup_worker *w = arg;
+        size_t k, round;
 
-#define ALIGN(x, y) ((x - x % y)/y)
+        /* Inserts racing removes of the same content, then inserts alone */
+        for (round = 0; round < 3; round++)
+                for (k = 0; k < w->n; k++)
+                        dedup_worker_page(w, k, 1);
+        pthread_barrier_wait(w->barrier);
+        for (k = 0; k < w->n; k++)
+                dedup_worker_page(w, k, 0);
 
-static inline uint8_t bitshift(int shift) {
-        static const uint8_t jump_table[8] = {
-                1 << 0, 1 << 1, 1 << 2, 1 << 3,
-                1 << 4, 1 << 5, 1 << 6, 1 << 7
-        };
-        return jump_table[shift % 8];
-}
-
-struct crc32_correction {
-        /* Memory with crc32 missmatch */
-        void *memory;
-        size_t size;
-        /* CRC32 to match */
-        unsigned orig_crc;
-        /* Byte offset with fixed error */
-        size_t error_offset;
-        int fixed:1;
-};
-
-static void crc32_bitflip_corrector(struct crc32_correction *data) {
-        const size_t size = data->size;
-        const size_t bits_to_flip = data->size * 8;
-
-        char *ptr = (char *)data->memory;
-        unsigned i, j = 0;
-
-        /* Brute force 1-bit error */
-        for (i = 0; i < bits_to_flip; i++) {
-                ptr[ALIGN(i, 8)] ^= bitshift(i);
-                if (data->orig_crc == crc32c(0, data->memory, size))
-                        goto out;
-                ptr[ALIGN(i, 8)] ^= bitshift(i);
-        }
-
-        printf("lol");
-
-        /* Brute force err 2-bits error */
-        for (i = 0; i < bits_to_flip; i++) {
-                ptr[ALIGN(i, 8)] ^= bitshift(i);
-                for (j = i + 1; j < bits_to_flip; j++) {
-                        ptr[ALIGN(j, 8)] ^= bitshift(j);
-                        if (data->orig_crc == crc32c(0, data->memory, size))
-                                goto out;
-                        ptr[ALIGN(j, 8)] ^= bitshift(j);
-                }
-                ptr[ALIGN(i, 8)] ^= bitshift(i);
-        }
-
-        return;
-
-        out:
-                printf("ERR OFFSET: 0x%" PRIx32 " 0x%" PRIx32 "\n", ALIGN(i, 8), ALIGN(j, 8));
-                data->error_offset = ALIGN(i, 8);
-                data->fixed = 1;
-}
-
-static void corrupt_random_bit(void *ptr, size_t size) {
-        uint8_t *memory = (uint8_t *) ptr;
-        uint32_t rand_offset = rand() % size;
-        uint8_t old, new;
-        old = memory[rand_offset];
-        while (memory[rand_offset] == old) {
-                memory[rand_offset] |= 1 << rand() % 7;
-        }
-        new = memory[rand_offset];
-        printf("Byte at 0x%" PRIx32  ": 0x%" PRIx32 " -> 0x%" PRIx32 "\n", rand_offset, old, new);
+        return NULL;
 }
 
 int main() {
@@ -183,6 +97,10 @@ int main() {
         clock_t start, end;
         srand(time(NULL));
 
+        /* Only a METRICS build counts, read the counters with mstat */
+        if (!metrics_open("/dev/shm/8byte_parity.metrics"))
+                printf("Kernel counters: /dev/shm/8byte_parity.metrics\n");
+
 
         iter *= 1024*1024*4/PAGE_SIZE;
         iter += rand()%4096;
@@ -236,6 +154,32 @@ int main() {
                 printf("xxhash64:\t0x%" PRIx64 "\t\t\tperf: %lu µs,\tth: %.2f MiB/s\n", hash64, (end - start), PAGE_SIZE*iter*1.0/(end - start));
         }
 
+        printf("--- Test speed of fixed size kernels ---\n");
+
+        {
+                volatile uint64_t parity64;
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                for (i = 0; i < iter; i++) { parity64 = fparity64_fixed((uint8_t *) &PAGE, PAGE_SIZE, i); }
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("fparity64_%u:\t0x%" PRIx64 "\t\tperf: %lu µs,\tth: %.2f MiB/s\n", PAGE_SIZE, parity64, (end - start), PAGE_SIZE*iter*1.0/(end - start));
+        }
+
+        {
+                volatile uint32_t crc;
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                for (i = 0; i < iter; i++) { crc = crc32c_fixed(0, &PAGE, PAGE_SIZE); }
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("crc32c_%u:\t0x%" PRIx32 "\t\t\t\tperf: %lu µs,\tth: %.2f MiB/s\n", PAGE_SIZE, crc, (end - start), PAGE_SIZE*iter*1.0/(end - start));
+        }
+
+        {
+                volatile uint64_t hash64;
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                for (i = 0; i < iter; i++) { hash64 = xxh64_fixed(&PAGE, PAGE_SIZE, 0); }
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("xxh64_%u:\t0x%" PRIx64 "\t\t\tperf: %lu µs,\tth: %.2f MiB/s\n", PAGE_SIZE, hash64, (end - start), PAGE_SIZE*iter*1.0/(end - start));
+        }
+
         /* Try add error and fix it */
         printf("--- Example of error injection and fixup ---\n");
 
@@ -277,6 +221,582 @@ int main() {
                 }
         }
 
+        printf("--- Example of erasure repair at known offset ---\n");
+
+        {
+                static uint8_t group[5][PAGE_SIZE] __attribute__((aligned(8)));
+                const void *pages[4] = { group[0], group[1], group[2], group[3] };
+                const void *peers[4] = { group[1], group[2], group[3], group[4] };
+                uint64_t orig_xxhash64, bad_stripe;
+                struct page_meta meta = { 0 };
+                uint32_t sector;
+                int ret;
+
+                for (i = 0; i < sizeof(group); i += sizeof(uint64_t))
+                        *(uint64_t *) (group[0] + i) = ((uint64_t) rand() << 32) ^ rand() ^ i;
+                page_group_parity(group[4], pages, 4);
+                page_meta_init(&meta, group[0]);
+                orig_xxhash64 = xxh64(group[0], PAGE_SIZE, 0);
+
+                /* Device reports the stripe, parity rebuilds it without a search */
+                bad_stripe = rand() % (PAGE_SIZE / sizeof(uint64_t));
+                *(uint64_t *) (group[0] + bad_stripe * sizeof(uint64_t)) ^= (uint64_t) rand() << 17 | 1;
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                ret = parity_repair_erasure(group[0], &meta, bad_stripe * sizeof(uint64_t), sizeof(uint64_t), NULL, 0);
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("stripe 0x%" PRIx64 ": %s, xxhash64: %s, perf: %lu µs\n", bad_stripe * sizeof(uint64_t),
+                       ret == PAGE_REPAIRED ? "repaired" : "bad",
+                       xxh64(group[0], PAGE_SIZE, 0) == orig_xxhash64 ? "match" : "not match", (end - start));
+
+                /* Lost 512 byte sector is beyond one stripe, group parity rebuilds it */
+                sector = rand() % (PAGE_SIZE / 512) * 512;
+                memset(group[0] + sector, 0xff, 512);
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                ret = parity_repair_erasure(group[0], &meta, sector, 512, peers, 4);
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("sector 0x%" PRIx32 ": %s, xxhash64: %s, perf: %lu µs\n", sector,
+                       ret == PAGE_REPAIRED ? "repaired" : "bad",
+                       xxh64(group[0], PAGE_SIZE, 0) == orig_xxhash64 ? "match" : "not match", (end - start));
+        }
+
+        printf("--- Tiered verification policies ---\n");
+
+        {
+                static const struct verify_policy policies[] = {
+                        { .sample = 0, .period = 0, .strong = VERIFY_STRONG_CRC },
+                        { .sample = 655, .period = 0, .strong = VERIFY_STRONG_CRC },
+                        { .sample = 0, .period = 16, .strong = VERIFY_STRONG_CRC|VERIFY_STRONG_XXH },
+                        { .sample = 65536, .period = 0, .strong = VERIFY_STRONG_CRC },
+                };
+
+                for (i = 0; i < sizeof(policies)/sizeof(policies[0]); i++)
+                        verify_policy_report(&policies[i], stdout);
+        }
+
+        printf("--- Example of incremental scrub by written page tracking ---\n");
+
+        {
+                static struct scrub_region region;
+                size_t len = 64*PAGE_SIZE;
+                int fd = memfd_create("scrub", MFD_CLOEXEC);
+                uint8_t *mem, *alias;
+                int ret;
+
+                /* Bit flips bypass the page tables, alias mapping writes behind the tracker's back */
+                ftruncate(fd, len);
+                mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+                alias = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+
+                for (i = 0; i < len; i++)
+                        mem[i] = rand()%255;
+
+                ret = scrub_init(&region, mem, len, 4);
+                if (ret) {
+                        printf("scrub_init: %s\n", strerror(-ret));
+                } else {
+                        /* Application writes 3 pages, memory silently flips a bit in a clean one */
+                        mem[5*PAGE_SIZE] ^= 0xff;
+                        mem[17*PAGE_SIZE + 100] ^= 0xff;
+                        mem[40*PAGE_SIZE + 4000] ^= 0xff;
+                        corrupt_random_bit(alias + 2*PAGE_SIZE, PAGE_SIZE);
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        for (i = 0; i < region.clean_interval; i++)
+                                scrub_pass(&region);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+
+                        printf("passes: %lu, dirty: %lu, verified: %lu, repaired: %lu, bad: %lu, unrepaired: %lu\n",
+                               region.stats.passes, region.stats.dirty, region.stats.verified,
+                               region.stats.repaired, region.stats.bad, region.stats.unrepaired);
+                        printf("perf: %lu µs\n", (end - start));
+                        scrub_free(&region);
+                }
+                munmap(alias, len);
+                munmap(mem, len);
+        }
+
+        printf("--- Example of burst repair by wide parity ---\n");
+
+        {
+                static const unsigned widths[] = { 8, 16, 32, 64 };
+                static uint8_t page[PAGE_SIZE] __attribute__((aligned(64)));
+                uint8_t parity[64];
+                uint32_t crc, offset;
+                int64_t fixed;
+                unsigned w;
+
+                memcpy(page, PAGE, PAGE_SIZE);
+                crc = crc32c(0, page, PAGE_SIZE);
+                /* 16 byte burst crossing 8 byte stripes */
+                offset = (rand() % (PAGE_SIZE/64 - 1)) * 64 + 44;
+
+                for (w = 0; w < sizeof(widths)/sizeof(widths[0]); w++) {
+                        fparity_wide(page, PAGE_SIZE, widths[w], parity);
+                        for (i = 0; i < 16; i++)
+                                page[offset + i] ^= 0xa5;
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        fixed = fparity_wide_repair(page, PAGE_SIZE, widths[w], parity, crc);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        if (fixed < 0) {
+                                for (i = 0; i < 16; i++)
+                                        page[offset + i] ^= 0xa5;
+                                printf("width %u: burst at 0x%" PRIx32 " out of reach\n", widths[w], offset);
+                        } else {
+                                printf("width %u: burst at 0x%" PRIx32 " fixed at 0x%" PRIx64 ", perf: %lu µs\n",
+                                       widths[w], offset, fixed, (end - start));
+                        }
+                }
+        }
+
+        printf("--- Example of multi stripe repair by interleaved parity ---\n");
+
+        {
+                static uint64_t page[PAGE_SIZE/sizeof(uint64_t)];
+                uint64_t parity[PARITY_MAX_LANES];
+                unsigned lanes = 4;
+                uint32_t crc;
+                int fixed;
+
+                memcpy(page, PAGE, PAGE_SIZE);
+                fparity64_lanes(page, PAGE_SIZE, lanes, parity);
+                crc = crc32c(0, page, PAGE_SIZE);
+
+                /* One damaged stripe in each of three lanes */
+                for (i = 0; i < 3; i++)
+                        page[(rand() % (PAGE_SIZE/sizeof(uint64_t)/lanes)) * lanes + i] ^= 1ULL << (rand() % 64);
+
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                fixed = fparity64_lanes_repair(page, PAGE_SIZE, lanes, parity, crc, NULL);
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("lanes %u: %d stripes rebuilt, perf: %lu µs\n", lanes, fixed, (end - start));
+                printf("crc32c: %s\n", crc32c(0, page, PAGE_SIZE) == crc ? "match" : "not match");
+        }
+
+        printf("--- Example of two level huge page protection ---\n");
+
+        {
+                static struct huge_meta hm;
+                uint8_t *huge = huge_alloc();
+                size_t bad;
+                int ret;
+
+                if (!huge) {
+                        printf("huge_alloc: failed\n");
+                } else {
+                        for (i = 0; i < HUGE_PAGE_SIZE; i++)
+                                huge[i] = rand()%255;
+                        huge_meta_init(&hm, huge);
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        ret = huge_verify(&hm, huge);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("clean: %s, perf: %lu µs\n", ret == PAGE_OK ? "ok" : "bad", (end - start));
+
+                        corrupt_random_bit(huge, HUGE_PAGE_SIZE);
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        ret = huge_verify(&hm, huge);
+                        if (ret != PAGE_OK)
+                                ret = huge_repair(&hm, huge, &bad);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("damaged: %s, perf: %lu µs\n", ret == PAGE_REPAIRED ? "repaired" : "bad", (end - start));
+                        huge_free(huge);
+                }
+        }
+
+        printf("--- Example of protected arena ---\n");
+
+        {
+                static struct arena arena;
+                static uint8_t *pages[1024];
+                size_t n = sizeof(pages)/sizeof(pages[0]), bad = 0, repaired = 0;
+
+                arena_init(&arena);
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                for (i = 0; i < n; i++) {
+                        pages[i] = arena_alloc(&arena);
+                        if (!pages[i])
+                                break;
+                        memcpy(pages[i], PAGE, PAGE_SIZE);
+                        pages[i][i % PAGE_SIZE] ^= i;
+                        arena_seal(pages[i]);
+                }
+                n = i;
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("%lu pages in %lu slabs, alloc and seal perf: %lu µs\n", n, arena.nr_slabs, (end - start));
+
+                corrupt_random_bit(pages[rand() % n], PAGE_SIZE);
+
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                for (i = 0; i < n; i++) {
+                        if (arena_verify(pages[i]) == PAGE_OK)
+                                continue;
+                        if (arena_repair(pages[i]) == PAGE_REPAIRED)
+                                repaired++;
+                        else
+                                bad++;
+                }
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("verified: %lu, repaired: %lu, bad: %lu, perf: %lu µs\n", n, repaired, bad, (end - start));
+
+                for (i = 0; i < n; i++)
+                        arena_free(pages[i]);
+                arena_destroy(&arena);
+        }
+
+        printf("--- Example of batched verify with prefetch ---\n");
+
+        {
+                size_t n = 16384, len = n*PAGE_SIZE, bad;
+                static const unsigned distances[] = { 0, 1, 2, 4, 8 };
+                uint8_t *mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                const void **pages = malloc(n * sizeof(*pages));
+                struct page_meta *meta = calloc(n, sizeof(*meta));
+                uint64_t *bitmap = malloc((n + 63) / 64 * sizeof(*bitmap));
+
+                for (i = 0; i < len; i += sizeof(uint64_t))
+                        *(uint64_t *) (mem + i) = ((uint64_t) rand() << 32) ^ rand() ^ i;
+                /* Scattered order, hardware prefetch can't guess the next page */
+                for (i = 0; i < n; i++)
+                        pages[i] = mem + i*PAGE_SIZE;
+                for (i = n - 1; i > 0; i--) {
+                        size_t j = rand() % (i + 1);
+                        const void *tmp = pages[i];
+                        pages[i] = pages[j];
+                        pages[j] = tmp;
+                }
+                for (i = 0; i < n; i++)
+                        page_meta_init(&meta[i], pages[i]);
+                corrupt_random_bit(mem + (rand() % n)*PAGE_SIZE, PAGE_SIZE);
+
+                start = clock()*1000000/CLOCKS_PER_SEC;
+                for (bad = 0, i = 0; i < n; i++)
+                        bad += page_verify(&meta[i], pages[i]) != PAGE_OK;
+                end = clock()*1000000/CLOCKS_PER_SEC;
+                printf("page_verify loop:\tbad: %lu\tperf: %lu µs,\tth: %.2f MiB/s\n", bad, (end - start), len*1.0/(end - start));
+
+                for (i = 0; i < sizeof(distances)/sizeof(distances[0]); i++) {
+                        verify_pages_set_prefetch(distances[i]);
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        bad = verify_pages(pages, meta, n, bitmap);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("verify_pages, prefetch %u:\tbad: %lu\tperf: %lu µs,\tth: %.2f MiB/s\n",
+                               distances[i], bad, (end - start), len*1.0/(end - start));
+                }
+                verify_pages_set_prefetch(VERIFY_PREFETCH);
+
+                free(bitmap);
+                free(meta);
+                free(pages);
+                munmap(mem, len);
+        }
+
+        printf("--- Example of repeated fault repair with fault map ---\n");
+
+        {
+                static struct fault_map map;
+                static uint8_t page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+                uint64_t region, parity;
+                uint32_t crc, offset;
+                int64_t fixed;
+                int ret;
+
+                ret = fault_map_open(&map, "/tmp/8byte_parity.hints", 1024);
+                if (ret) {
+                        printf("fault_map_open: %s\n", strerror(-ret));
+                } else {
+                        memcpy(page, PAGE, PAGE_SIZE);
+                        region = hint_region(page);
+                        parity = fparity64(page, PAGE_SIZE, 0);
+                        crc = crc32c(0, page, PAGE_SIZE);
+                        /* Same weak cell flips again and again */
+                        offset = PAGE_SIZE - 1 - rand() % 64;
+
+                        for (i = 0; i < 3; i++) {
+                                page[offset] ^= 1 << 3;
+                                start = clock()*1000000/CLOCKS_PER_SEC;
+                                fixed = fparity64_repair_hinted(&map, region, page, PAGE_SIZE, parity, crc);
+                                end = clock()*1000000/CLOCKS_PER_SEC;
+                                printf("repair %lu: stripe 0x%" PRIx64 ", perf: %lu µs\n", i, fixed, (end - start));
+                        }
+                        printf("fault map: %" PRIu64 " places\n", map.hdr->count);
+                        fault_map_close(&map);
+                }
+        }
+
+        printf("--- Example of content defined chunking ---\n");
+
+        {
+                size_t len = 64 << 20, max_out = len / 2048 + 2, na, nb, nc, got, done, part, same, j;
+                uint8_t *a = malloc(len), *b = malloc(len + 1);
+                struct cdc_chunk *ca = malloc(max_out * sizeof(*ca));
+                struct cdc_chunk *cb = malloc(max_out * sizeof(*cb));
+                struct cdc c;
+                int ret;
+
+                ret = cdc_init(&c, 2048, 8192, 65536);
+                if (ret || !a || !b || !ca || !cb) {
+                        printf("cdc_init: %s\n", strerror(ret ? -ret : ENOMEM));
+                } else {
+                        for (i = 0; i < len; i += sizeof(uint64_t))
+                                *(uint64_t *) (a + i) = ((uint64_t) rand() << 32) ^ rand() ^ i;
+
+                        /* Cut points alone first, the rolling hash without chunk hashes */
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        na = cdc_cut(&c, a, len, 1, ca, max_out, &done);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("cut only: %lu chunks, perf: %lu µs,\tth: %.2f MiB/s\n",
+                               na, (end - start), len*1.0/(end - start));
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        na = cdc_split(&c, a, len, 1, ca, max_out, &done);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("chunks: %lu, avg: %lu B, perf: %lu µs,\tth: %.2f MiB/s\n",
+                               na, done / na, (end - start), len*1.0/(end - start));
+
+                        /* Fed in pieces the cut points must not move */
+                        for (nb = 0, done = 0, part = 1 << 20; done < len; done += got) {
+                                part = len - done < part ? len - done : part;
+                                nc = cdc_split(&c, a + done, part, done + part == len, cb + nb, max_out - nb, &got);
+                                for (j = nb; j < nb + nc; j++)
+                                        cb[j].offset += done;
+                                nb += nc;
+                                part = got ? 1 << 20 : part * 2;
+                        }
+                        for (same = 0, j = 0; j < na && j < nb; j++)
+                                same += ca[j].offset == cb[j].offset && ca[j].xxh == cb[j].xxh;
+                        printf("streamed in 1 MiB pieces: %lu of %lu chunks same\n", same, na);
+
+                        /* One byte inserted only changes the chunks around it */
+                        memcpy(b, a, len / 2);
+                        b[len / 2] = 0x5a;
+                        memcpy(b + len / 2 + 1, a + len / 2, len - len / 2);
+                        nb = cdc_split(&c, b, len + 1, 1, cb, max_out, &done);
+                        for (same = 0, i = 0, j = 0; i < na && j < nb; ) {
+                                uint64_t off = cb[j].offset - (cb[j].offset > len / 2);
+
+                                if (ca[i].offset < off) {
+                                        i++;
+                                } else if (ca[i].offset > off) {
+                                        j++;
+                                } else {
+                                        same += ca[i].xxh == cb[j].xxh;
+                                        i++;
+                                        j++;
+                                }
+                        }
+                        printf("1 byte inserted: %lu of %lu chunks unchanged\n", same, nb);
+                }
+
+                cdc_free(&c);
+                free(cb);
+                free(ca);
+                free(b);
+                free(a);
+        }
+
+        printf("--- Example of page deduplication by xxh64 index ---\n");
+
+        {
+                size_t n = 16384, len = n*PAGE_SIZE, copies = 0, found;
+                uint8_t *mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                const void **pages = malloc(n * sizeof(*pages));
+                uint64_t *dup = malloc(n * sizeof(*dup)), loc;
+                struct dedup_index idx;
+                long dups;
+                int ret;
+
+                ret = dedup_init(&idx, n, NULL, NULL);
+                if (ret || mem == MAP_FAILED || !pages || !dup) {
+                        printf("dedup_init: %s\n", strerror(ret ? -ret : ENOMEM));
+                } else {
+                        for (i = 0; i < len; i += sizeof(uint64_t))
+                                *(uint64_t *) (mem + i) = ((uint64_t) rand() << 32) ^ rand() ^ i;
+                        /* Every fourth page repeats an earlier one */
+                        for (i = 0; i < n; i++) {
+                                pages[i] = mem + i*PAGE_SIZE;
+                                if (i % 4 == 3) {
+                                        memcpy(mem + i*PAGE_SIZE, pages[rand() % i], PAGE_SIZE);
+                                        copies++;
+                                }
+                        }
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        dups = dedup_insert_pages(&idx, pages, NULL, n, dup);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("inserted: %lu, duplicates: %ld of %lu, perf: %lu µs,\tth: %.2f MiB/s\n",
+                               idx.count, dups, copies, (end - start), len*1.0/(end - start));
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        for (found = 0, i = 0; i < n; i++)
+                                found += dedup_lookup(&idx, page_xxh64(pages[i]), pages[i], &loc);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("lookups: %lu, found: %lu, perf: %lu µs\n", n, found, (end - start));
+                }
+
+                dedup_destroy(&idx);
+                free(dup);
+                free(pages);
+                if (mem != MAP_FAILED)
+                        munmap(mem, len);
+        }
+
+        {
+                /* Every thread holds copies of each content, in its own order */
+                size_t nr_threads = 4, distinct = 512, n = 2048, len = nr_threads*n*PAGE_SIZE, found, k, t;
+                uint8_t *mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                const void **pages = malloc(nr_threads * n * sizeof(*pages));
+                struct dedup_worker workers[4];
+                struct dedup_index idx;
+                pthread_barrier_t barrier;
+                long owned = 0, removes = 0, errors = 0;
+                uint64_t loc;
+                int ret;
+
+                ret = dedup_init(&idx, distinct, NULL, NULL);
+                if (ret || mem == MAP_FAILED || !pages) {
+                        printf("dedup_init: %s\n", strerror(ret ? -ret : ENOMEM));
+                } else {
+                        for (i = 0; i < distinct*PAGE_SIZE; i += sizeof(uint64_t))
+                                *(uint64_t *) (mem + i) = ((uint64_t) rand() << 32) ^ rand() ^ i;
+                        for (t = 0; t < nr_threads; t++) {
+                                for (k = 0; k < n; k++) {
+                                        pages[t*n + k] = mem + (t*n + k)*PAGE_SIZE;
+                                        if (t || k >= distinct)
+                                                memcpy(mem + (t*n + k)*PAGE_SIZE,
+                                                       mem + (k < distinct ? k : rand() % distinct)*PAGE_SIZE, PAGE_SIZE);
+                                }
+                                for (k = n - 1; k > 0; k--) {
+                                        const void *tmp = pages[t*n + k];
+
+                                        i = rand() % (k + 1);
+                                        pages[t*n + k] = pages[t*n + i];
+                                        pages[t*n + i] = tmp;
+                                }
+                        }
+
+                        pthread_barrier_init(&barrier, NULL, nr_threads);
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        for (t = 0; t < nr_threads; t++) {
+                                workers[t] = (struct dedup_worker) {
+                                        .idx = &idx, .barrier = &barrier, .pages = pages + t*n, .n = n,
+                                        .seed = rand(),
+                                };
+                                pthread_create(&workers[t].thread, NULL, dedup_worker_fn, &workers[t]);
+                        }
+                        for (t = 0; t < nr_threads; t++) {
+                                pthread_join(workers[t].thread, NULL);
+                                owned += workers[t].owned;
+                                removes += workers[t].removes;
+                                errors += workers[t].errors;
+                        }
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        pthread_barrier_destroy(&barrier);
+
+                        /* Found for every content and no more entries: one each */
+                        for (found = 0, k = 0; k < distinct; k++)
+                                found += dedup_lookup(&idx, page_xxh64(mem + k*PAGE_SIZE), mem + k*PAGE_SIZE, &loc);
+                        printf("%lu threads, %lu pages, %ld removes: entries %lu, owned %ld, found %lu of %lu contents, "
+                               "errors %ld, %s, perf: %lu µs\n", nr_threads, nr_threads*n, removes, idx.count,
+                               owned, found, distinct, errors,
+                               idx.count == distinct && owned == (long) distinct && found == distinct && !errors ?
+                               "one entry per content" : "WRONG", (end - start));
+                }
+
+                dedup_destroy(&idx);
+                free(pages);
+                if (mem != MAP_FAILED)
+                        munmap(mem, len);
+        }
+
+        printf("--- Example of merkle tree with incremental update ---\n");
+
+        {
+                size_t n = 16384, len = n*PAGE_SIZE, changed[3], bad[4];
+                uint8_t *mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                struct merkle tree;
+                struct pool pool;
+                uint64_t root;
+                long nr_bad;
+                int ret;
+
+                ret = merkle_init(&tree, len);
+                if (!ret)
+                        ret = pool_init(&pool, 4);
+                if (ret || mem == MAP_FAILED) {
+                        printf("merkle_init: %s\n", strerror(ret ? -ret : ENOMEM));
+                } else {
+                        for (i = 0; i < len; i += sizeof(uint64_t))
+                                *(uint64_t *) (mem + i) = ((uint64_t) rand() << 32) ^ rand() ^ i;
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        merkle_build(&tree, mem, NULL);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        root = merkle_root(&tree);
+                        printf("build: levels %u, root 0x%016" PRIx64 ", perf: %lu µs,\tth: %.2f MiB/s\n",
+                               tree.levels, root, (end - start), len*1.0/(end - start));
+                        merkle_build(&tree, mem, &pool);
+                        printf("parallel build: root %s\n", merkle_root(&tree) == root ? "same" : "differs");
+
+                        /* Three pages written, only their paths are rehashed */
+                        for (i = 0; i < 3; i++) {
+                                changed[i] = (i + 1) * n / 4 + rand() % 64;
+                                mem[changed[i]*PAGE_SIZE + rand() % PAGE_SIZE] ^= 0x10;
+                        }
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        merkle_update_pages(&tree, mem, changed, 3);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("update of 3 pages: perf: %lu µs, check of page %lu: %s\n", (end - start),
+                               changed[1], merkle_check_page(&tree, mem, changed[1]) == PAGE_OK ? "ok" : "bad");
+
+                        /* Corruption behind the tree's back is found by descending */
+                        corrupt_random_bit(mem + (rand() % n)*PAGE_SIZE, PAGE_SIZE);
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        nr_bad = merkle_verify(&tree, mem, &pool, bad, 4);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("verify: %ld bad", nr_bad);
+                        for (i = 0; i < (size_t) nr_bad && i < 4; i++)
+                                printf(", page %lu at 0x%lx", bad[i], bad[i]*PAGE_SIZE);
+                        printf(", perf: %lu µs\n", (end - start));
+                        pool_destroy(&pool);
+                }
+
+                merkle_free(&tree);
+                if (mem != MAP_FAILED)
+                        munmap(mem, len);
+        }
+
+        printf("--- Example of burst repair by CRC32C syndrome ---\n");
+
+        {
+                static uint8_t page[PAGE_SIZE] __attribute__((aligned(8)));
+                static const unsigned lens[] = { 6, 20, 32 };
+                uint64_t parity, bit, k;
+                uint32_t crc;
+                int64_t offset;
+
+                memcpy(page, PAGE, PAGE_SIZE);
+                parity = fparity64(page, PAGE_SIZE, 0);
+                crc = crc32c(0, page, PAGE_SIZE);
+
+                for (i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+                        /* Burst across a stripe boundary, first and last bit flipped */
+                        bit = (1 + rand() % (PAGE_SIZE / 8 - 1)) * 64 - lens[i] / 2;
+                        for (k = 0; k < lens[i]; k++)
+                                if (!k || k == lens[i] - 1 || rand() & 1)
+                                        page[(bit + k) / 8] ^= 1 << (bit + k) % 8;
+
+                        start = clock()*1000000/CLOCKS_PER_SEC;
+                        offset = crc32c_burst_repair(page, PAGE_SIZE, crc, lens[i] <= BURST_CRC_BITS ? BURST_CRC_BITS : 32,
+                                                     lens[i] <= BURST_CRC_BITS ? NULL : &parity);
+                        end = clock()*1000000/CLOCKS_PER_SEC;
+                        printf("%u bit burst at 0x%" PRIx64 "%s: offset %" PRId64 ", %s, perf: %lu µs\n",
+                               lens[i], bit / 8, lens[i] <= BURST_CRC_BITS ? "" : " with parity", offset,
+                               memcmp(page, PAGE, PAGE_SIZE) ? "not fixed" : "fixed", (end - start));
+                        memcpy(page, PAGE, PAGE_SIZE);
+                }
+        }
+
         /* Try add error and fix it */
         printf("--- Example of stupid fix on 1 bit flip injection and fixup by CRC32C ---\n");
 
@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "arena.h"
+
+/* End of a slab free list */
+#define ARENA_NIL 0
+
+int arena_init(struct arena *arena) {
+        memset(arena, 0, sizeof(*arena));
+        return -pthread_mutex_init(&arena->lock, NULL);
+}
+
+/* Slow path, maps a huge page and chains all its data pages */
+static struct arena_slab *arena_grow(struct arena *arena) {
+        struct arena_slab *slab;
+        uint32_t i;
+
+        slab = huge_alloc();
+        if (!slab)
+                return NULL;
+
+        slab->arena = arena;
+        slab->free_head = ARENA_META_PAGES;
+        slab->nr_free = ARENA_SLAB_PAGES;
+        for (i = ARENA_META_PAGES; i < HUGE_SUBPAGES; i++)
+                slab->meta[i].crc = i + 1 < HUGE_SUBPAGES ? i + 1 : ARENA_NIL;
+
+        slab->next_all = arena->slabs;
+        arena->slabs = slab;
+        arena->nr_slabs++;
+        return slab;
+}
+
+/**
+ * arena_alloc - take one protected page
+ * @arena - arena
+ *
+ * Page has no valid protection values until arena_seal().
+ * Returns PAGE_SIZE aligned page or NULL.
+ */
+
+void *arena_alloc(struct arena *arena) {
+        struct arena_slab *slab;
+        struct page_meta *meta;
+        uint32_t idx;
+
+        pthread_mutex_lock(&arena->lock);
+        slab = arena->partial;
+        if (!slab) {
+                slab = arena_grow(arena);
+                if (!slab) {
+                        pthread_mutex_unlock(&arena->lock);
+                        return NULL;
+                }
+                arena->partial = slab;
+        }
+
+        idx = slab->free_head;
+        meta = &slab->meta[idx];
+        slab->free_head = meta->crc;
+        /* Slab leaves partial list only from its head */
+        if (!--slab->nr_free)
+                arena->partial = slab->next;
+        arena->nr_used++;
+        pthread_mutex_unlock(&arena->lock);
+
+        meta->parity = 0;
+        meta->crc = 0;
+        meta->flags = 0;
+        return (uint8_t *) slab + (size_t) idx * PAGE_SIZE;
+}
+
+/**
+ * arena_free - return page taken by arena_alloc()
+ * @page - page
+ */
+
+void arena_free(void *page) {
+        struct arena_slab *slab = arena_slab_of(page);
+        struct arena *arena = slab->arena;
+        struct page_meta *meta = arena_meta(page);
+
+        pthread_mutex_lock(&arena->lock);
+        meta->flags = 0;
+        meta->crc = slab->free_head;
+        slab->free_head = meta - slab->meta;
+        if (!slab->nr_free++) {
+                slab->next = arena->partial;
+                arena->partial = slab;
+        }
+        arena->nr_used--;
+        pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * arena_seal - compute protection values after page was written
+ * @page - page taken by arena_alloc()
+ */
+
+void arena_seal(void *page) {
+        page_meta_init(arena_meta(page), page);
+}
+
+/* page_verify() with the record found from the pointer */
+int arena_verify(const void *page) {
+        return page_verify(arena_meta(page), page);
+}
+
+/* page_repair() with the record found from the pointer */
+int arena_repair(void *page) {
+        return page_repair(arena_meta(page), page);
+}
+
+/**
+ * arena_destroy - unmap all slabs
+ * @arena - arena, pages handed out become invalid
+ */
+
+void arena_destroy(struct arena *arena) {
+        struct arena_slab *slab, *next;
+
+        for (slab = arena->slabs; slab; slab = next) {
+                next = slab->next_all;
+                huge_free(slab);
+        }
+        pthread_mutex_destroy(&arena->lock);
+        memset(arena, 0, sizeof(*arena));
+}
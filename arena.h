@@ -0,0 +1,60 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "verify.h"
+#include "huge.h"
+
+/**
+ * struct arena_slab - one huge page of protected memory
+ *
+ * Slab header and page_meta side table take the first pages, record i
+ * belongs to page i of the slab. Free pages are chained through @crc
+ * of their records, so allocation never touches page data.
+ */
+struct arena_slab {
+        struct arena *arena;
+        /* Slabs with free pages */
+        struct arena_slab *next;
+        struct arena_slab *next_all;
+        uint32_t free_head;
+        uint32_t nr_free;
+        struct page_meta meta[HUGE_SUBPAGES] __attribute__((aligned(64)));
+};
+
+/* Slab pages taken by struct arena_slab */
+#define ARENA_META_PAGES ((sizeof(struct arena_slab) + PAGE_SIZE - 1) / PAGE_SIZE)
+#define ARENA_SLAB_PAGES (HUGE_SUBPAGES - ARENA_META_PAGES)
+
+struct arena {
+        pthread_mutex_t lock;
+        struct arena_slab *partial;
+        struct arena_slab *slabs;
+        size_t nr_slabs;
+        size_t nr_used;
+};
+
+static inline struct arena_slab *arena_slab_of(const void *page) {
+        return (struct arena_slab *) ((uintptr_t) page & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+}
+
+/* Record of a page handed out by arena_alloc() */
+static inline struct page_meta *arena_meta(const void *page) {
+        struct arena_slab *slab = arena_slab_of(page);
+
+        return &slab->meta[((uintptr_t) page - (uintptr_t) slab) / PAGE_SIZE];
+}
+
+int arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena);
+void arena_free(void *page);
+void arena_seal(void *page);
+int arena_verify(const void *page);
+int arena_repair(void *page);
+void arena_destroy(struct arena *arena);
+
+#endif /* ARENA_H */
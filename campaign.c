@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "parity.h"
+#include "crc32.h"
+#include "xxhash.h"
+
+/*
+ * Fault injection campaign: inject faults of a model into random pages,
+ * run every corrector on its own copy and compare the result with the
+ * original page. A corrector claiming success on a page which differs
+ * from the original is a miscorrection.
+ */
+
+enum fault_model {
+        FAULT_BIT,
+        FAULT_KBITS,
+        FAULT_BURST,
+        FAULT_STUCK,
+        FAULT_STRIPE,
+        FAULT_PAGE,
+        FAULT_MODELS,
+};
+
+static const char *const model_names[FAULT_MODELS] = {
+        "bit", "kbits", "burst", "stuck", "stripe", "page",
+};
+
+/* Protection values of the original page, each corrector uses some */
+struct trial_meta {
+        uint64_t parity;
+        uint8_t wide16[16];
+        uint8_t wide32[32];
+        uint8_t wide64[64];
+        uint64_t lanes4[4];
+        uint64_t lanes8[8];
+        uint32_t crc;
+        uint64_t xxh;
+};
+
+struct corrector {
+        const char *name;
+        /* Returns 0 if the corrector claims the page is fixed */
+        int (*repair)(const struct trial_meta *m, uint8_t *page);
+};
+
+static int repair_parity64(const struct trial_meta *m, uint8_t *page) {
+        return fparity64_repair(page, PAGE_SIZE, m->parity, m->crc) < 0 ? -1 : 0;
+}
+
+static int repair_wide16(const struct trial_meta *m, uint8_t *page) {
+        return fparity_wide_repair(page, PAGE_SIZE, 16, m->wide16, m->crc) < 0 ? -1 : 0;
+}
+
+static int repair_wide32(const struct trial_meta *m, uint8_t *page) {
+        return fparity_wide_repair(page, PAGE_SIZE, 32, m->wide32, m->crc) < 0 ? -1 : 0;
+}
+
+static int repair_wide64(const struct trial_meta *m, uint8_t *page) {
+        return fparity_wide_repair(page, PAGE_SIZE, 64, m->wide64, m->crc) < 0 ? -1 : 0;
+}
+
+static int repair_lanes4(const struct trial_meta *m, uint8_t *page) {
+        return fparity64_lanes_repair(page, PAGE_SIZE, 4, m->lanes4, m->crc, NULL) < 0 ? -1 : 0;
+}
+
+static int repair_lanes8(const struct trial_meta *m, uint8_t *page) {
+        return fparity64_lanes_repair(page, PAGE_SIZE, 8, m->lanes8, m->crc, &m->xxh) < 0 ? -1 : 0;
+}
+
+static int repair_burst(const struct trial_meta *m, uint8_t *page) {
+        return crc32c_burst_repair(page, PAGE_SIZE, m->crc, BURST_CRC_BITS, NULL) < 0 ? -1 : 0;
+}
+
+static int repair_burst_parity(const struct trial_meta *m, uint8_t *page) {
+        return crc32c_burst_repair(page, PAGE_SIZE, m->crc, 32, &m->parity) < 0 ? -1 : 0;
+}
+
+/*
+ * crc32_bitflip_corrector() is left out: its 2 bit search costs ~10^8
+ * CRCs of the page per trial.
+ */
+static const struct corrector correctors[] = {
+        { "parity64", repair_parity64 },
+        { "wide16", repair_wide16 },
+        { "wide32", repair_wide32 },
+        { "wide64", repair_wide64 },
+        { "lanes4", repair_lanes4 },
+        { "lanes8+xxh", repair_lanes8 },
+        { "burst8", repair_burst },
+        { "burst32+par", repair_burst_parity },
+};
+
+#define NR_CORRECTORS (sizeof(correctors)/sizeof(correctors[0]))
+
+/* Latency histogram buckets, bucket i holds [2^i, 2^(i+1)) ns */
+#define LAT_BUCKETS 40
+
+struct corrector_stats {
+        uint64_t fixed;
+        uint64_t miscorrected;
+        uint64_t failed;
+        uint64_t lat[LAT_BUCKETS];
+        uint64_t lat_max;
+};
+
+struct campaign {
+        enum fault_model model;
+        unsigned kbits;
+        unsigned burst;
+        uint64_t trials;
+        uint64_t seed;
+        unsigned nr_threads;
+        pthread_mutex_t lock;
+        struct corrector_stats stats[NR_CORRECTORS];
+};
+
+struct worker {
+        struct campaign *c;
+        pthread_t thread;
+        uint64_t trials;
+        uint64_t rng;
+        struct corrector_stats stats[NR_CORRECTORS];
+};
+
+static inline uint64_t xorshift64(uint64_t *state) {
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void flip_bit(uint8_t *page, uint64_t bit) {
+        page[bit / 8 % PAGE_SIZE] ^= 1 << (bit % 8);
+}
+
+/* Damage @page per model, never leaves it unchanged */
+static void inject(struct worker *w, uint8_t *page, const uint8_t *orig) {
+        const struct campaign *c = w->c;
+        uint64_t r, off, len, i, word;
+
+        do {
+                r = xorshift64(&w->rng);
+                switch (c->model) {
+                case FAULT_BIT:
+                        flip_bit(page, r);
+                        break;
+                case FAULT_KBITS:
+                        for (i = 0; i < c->kbits; i++)
+                                flip_bit(page, xorshift64(&w->rng));
+                        break;
+                case FAULT_BURST:
+                        /* First and last byte always damaged, so burst is exactly @len */
+                        len = 1 + r % c->burst;
+                        off = (r >> 32) % (PAGE_SIZE - len + 1);
+                        for (i = 0; i < len; i++) {
+                                word = xorshift64(&w->rng) & 0xff;
+                                if (!word && (i == 0 || i == len - 1))
+                                        word = 1;
+                                page[off + i] ^= word;
+                        }
+                        break;
+                case FAULT_STUCK:
+                        /* Up to 8 bits of one word stuck at 0 or 1 */
+                        off = r % (PAGE_SIZE / 8) * 8;
+                        word = xorshift64(&w->rng) & xorshift64(&w->rng) & xorshift64(&w->rng);
+                        for (i = 0; i < 8; i++) {
+                                if (r >> (32 + i) & 1)
+                                        page[off + i] |= word >> (i * 8);
+                                else
+                                        page[off + i] &= ~(word >> (i * 8));
+                        }
+                        break;
+                case FAULT_STRIPE:
+                        off = r % (PAGE_SIZE / 8) * 8;
+                        word = xorshift64(&w->rng);
+                        memcpy(page + off, &word, sizeof(word));
+                        break;
+                case FAULT_PAGE:
+                        for (i = 0; i < PAGE_SIZE; i += 8) {
+                                word = xorshift64(&w->rng);
+                                memcpy(page + i, &word, sizeof(word));
+                        }
+                        break;
+                default:
+                        break;
+                }
+        } while (!memcmp(page, orig, PAGE_SIZE));
+}
+
+static void meta_init(struct trial_meta *m, const uint8_t *page) {
+        m->parity = fparity64(page, PAGE_SIZE, 0);
+        fparity_wide(page, PAGE_SIZE, 16, m->wide16);
+        fparity_wide(page, PAGE_SIZE, 32, m->wide32);
+        fparity_wide(page, PAGE_SIZE, 64, m->wide64);
+        fparity64_lanes(page, PAGE_SIZE, 4, m->lanes4);
+        fparity64_lanes(page, PAGE_SIZE, 8, m->lanes8);
+        m->crc = crc32c(0, page, PAGE_SIZE);
+        m->xxh = xxh64(page, PAGE_SIZE, 0);
+}
+
+static void *worker_fn(void *arg) {
+        struct worker *w = arg;
+        static __thread uint8_t orig[PAGE_SIZE] __attribute__((aligned(64)));
+        static __thread uint8_t damaged[PAGE_SIZE] __attribute__((aligned(64)));
+        static __thread uint8_t work[PAGE_SIZE] __attribute__((aligned(64)));
+        struct trial_meta m;
+        uint64_t t, i, word, start, ns;
+        size_t k;
+        int ret;
+
+        for (t = 0; t < w->trials; t++) {
+                for (i = 0; i < PAGE_SIZE; i += 8) {
+                        word = xorshift64(&w->rng);
+                        memcpy(orig + i, &word, sizeof(word));
+                }
+                meta_init(&m, orig);
+                memcpy(damaged, orig, PAGE_SIZE);
+                inject(w, damaged, orig);
+
+                for (k = 0; k < NR_CORRECTORS; k++) {
+                        struct corrector_stats *s = &w->stats[k];
+
+                        memcpy(work, damaged, PAGE_SIZE);
+                        start = now_ns();
+                        ret = correctors[k].repair(&m, work);
+                        ns = now_ns() - start;
+
+                        if (ret)
+                                s->failed++;
+                        else if (memcmp(work, orig, PAGE_SIZE))
+                                s->miscorrected++;
+                        else
+                                s->fixed++;
+                        s->lat[ns ? 63 - __builtin_clzll(ns) : 0]++;
+                        if (ns > s->lat_max)
+                                s->lat_max = ns;
+                }
+        }
+
+        pthread_mutex_lock(&w->c->lock);
+        for (k = 0; k < NR_CORRECTORS; k++) {
+                struct corrector_stats *dst = &w->c->stats[k], *src = &w->stats[k];
+
+                dst->fixed += src->fixed;
+                dst->miscorrected += src->miscorrected;
+                dst->failed += src->failed;
+                for (i = 0; i < LAT_BUCKETS; i++)
+                        dst->lat[i] += src->lat[i];
+                if (src->lat_max > dst->lat_max)
+                        dst->lat_max = src->lat_max;
+        }
+        pthread_mutex_unlock(&w->c->lock);
+
+        return NULL;
+}
+
+/* Upper bound of the bucket holding @q quantile, in ns */
+static uint64_t lat_quantile(const struct corrector_stats *s, uint64_t total, double q) {
+        uint64_t seen = 0, want = total * q;
+        int i;
+
+        for (i = 0; i < LAT_BUCKETS; i++) {
+                seen += s->lat[i];
+                if (seen > want)
+                        return (2ULL << i) < s->lat_max ? 2ULL << i : s->lat_max;
+        }
+        return s->lat_max;
+}
+
+static int campaign_run(struct campaign *c) {
+        struct worker *workers;
+        unsigned i;
+        int ret = 0;
+
+        workers = calloc(c->nr_threads, sizeof(*workers));
+        if (!workers)
+                return -ENOMEM;
+
+        memset(c->stats, 0, sizeof(c->stats));
+        for (i = 0; i < c->nr_threads; i++) {
+                workers[i].c = c;
+                workers[i].trials = c->trials / c->nr_threads + (i < c->trials % c->nr_threads);
+                workers[i].rng = c->seed * 0x9e3779b97f4a7c15ULL + i + 1;
+                ret = -pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+                if (ret)
+                        break;
+        }
+        while (i--)
+                pthread_join(workers[i].thread, NULL);
+
+        free(workers);
+        return ret;
+}
+
+static void campaign_report(const struct campaign *c) {
+        uint64_t total;
+        size_t k;
+
+        printf("--- Model: %s", model_names[c->model]);
+        if (c->model == FAULT_KBITS)
+                printf(", k = %u", c->kbits);
+        if (c->model == FAULT_BURST)
+                printf(", up to %u bytes", c->burst);
+        printf(", %" PRIu64 " trials ---\n", c->trials);
+        printf("%-12s %10s %10s %10s %10s %10s %10s %14s\n",
+               "corrector", "fixed %", "failed %", "miscorr %", "p50 µs", "p99 µs", "max µs",
+               "miscorrected");
+
+        for (k = 0; k < NR_CORRECTORS; k++) {
+                const struct corrector_stats *s = &c->stats[k];
+
+                total = s->fixed + s->failed + s->miscorrected;
+                if (!total)
+                        continue;
+                printf("%-12s %10.4f %10.4f %10.4f %10.2f %10.2f %10.2f %14" PRIu64 "\n",
+                       correctors[k].name, s->fixed * 100.0 / total, s->failed * 100.0 / total,
+                       s->miscorrected * 100.0 / total, lat_quantile(s, total, 0.5) / 1000.0,
+                       lat_quantile(s, total, 0.99) / 1000.0, s->lat_max / 1000.0, s->miscorrected);
+        }
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-n trials] [-t threads] [-m models] [-k bits] [-b burst] [-s seed]\n"
+                "  -m  comma separated list of: bit,kbits,burst,stuck,stripe,page (default all)\n"
+                "  -k  bits flipped by kbits model (default 2)\n"
+                "  -b  longest burst in bytes (default 16)\n",
+                prog);
+}
+
+static int parse_models(char *list, int *enabled) {
+        char *tok, *save = NULL;
+        int i;
+
+        memset(enabled, 0, FAULT_MODELS * sizeof(*enabled));
+        for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                for (i = 0; i < FAULT_MODELS; i++)
+                        if (!strcmp(tok, model_names[i]))
+                                break;
+                if (i == FAULT_MODELS) {
+                        fprintf(stderr, "Unknown fault model: %s\n", tok);
+                        return -EINVAL;
+                }
+                enabled[i] = 1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv) {
+        static struct campaign c;
+        int enabled[FAULT_MODELS];
+        int opt, i, ret;
+
+        c.trials = 10000;
+        c.kbits = 2;
+        c.burst = 16;
+        c.seed = time(NULL);
+        c.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        for (i = 0; i < FAULT_MODELS; i++)
+                enabled[i] = 1;
+
+        while ((opt = getopt(argc, argv, "n:t:m:k:b:s:h")) != -1) {
+                switch (opt) {
+                case 'n':
+                        c.trials = strtoull(optarg, NULL, 0);
+                        break;
+                case 't':
+                        c.nr_threads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        if (parse_models(optarg, enabled))
+                                return 1;
+                        break;
+                case 'k':
+                        c.kbits = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        c.burst = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        c.seed = strtoull(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+        if (!c.nr_threads || !c.kbits || !c.burst || c.burst > PAGE_SIZE) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        pthread_mutex_init(&c.lock, NULL);
+        printf("Seed: %" PRIu64 ", threads: %u\n", c.seed, c.nr_threads);
+        for (i = 0; i < FAULT_MODELS; i++) {
+                if (!enabled[i])
+                        continue;
+                c.model = i;
+                ret = campaign_run(&c);
+                if (ret) {
+                        fprintf(stderr, "campaign: %s\n", strerror(-ret));
+                        return 1;
+                }
+                campaign_report(&c);
+        }
+
+        return 0;
+}
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cdc.h"
+#include "crc32.h"
+#include "xxhash.h"
+#include "fixed.h"
+
+/* CRC-32C polynomial, reversed, as in crc32.c */
+#define CDC_POLY 0x82f63b78
+
+/* Interleaved rolling hashes, each over its own part of a block */
+#define CDC_LANES 4
+
+/* Candidate cut point passing the strict mask as well */
+#define CDC_STRICT (1U << 31)
+
+#define CDC_MAX_CHUNK (64U << 20)
+
+#define CDC_INLINE static inline __attribute__((always_inline))
+
+/*
+ * Rolling CRC: the raw CRC32C register over a window, no pre or post
+ * inversion. Shifting a byte in is one crc32b, the byte leaving the
+ * window is cancelled by XOR of its CRC followed by CDC_WINDOW zeros,
+ * CRC being linear. Hardware and table updates give the same values,
+ * so cut points do not depend on the machine.
+ */
+static uint32_t cdc_byte[256];
+static uint32_t cdc_out[256];
+static pthread_once_t cdc_once = PTHREAD_ONCE_INIT;
+
+static void cdc_init_tables(void) {
+        uint32_t c;
+        int n, k;
+
+        for (n = 0; n < 256; n++) {
+                c = n;
+                for (k = 0; k < 8; k++)
+                        c = c & 1 ? (c >> 1) ^ CDC_POLY : c >> 1;
+                cdc_byte[n] = c;
+        }
+        for (n = 0; n < 256; n++) {
+                c = cdc_byte[n];
+                for (k = 0; k < CDC_WINDOW; k++)
+                        c = cdc_byte[c & 0xff] ^ (c >> 8);
+                cdc_out[n] = c;
+        }
+}
+
+CDC_INLINE uint32_t roll_in(int hw, uint32_t r, uint8_t in) {
+#if defined(__x86_64__)
+        if (hw) {
+                __asm__("crc32b\t%1, %0" : "+r"(r) : "rm"(in));
+                return r;
+        }
+#endif
+        return cdc_byte[(r ^ in) & 0xff] ^ (r >> 8);
+}
+
+/* Window ending at byte @p, @p >= CDC_WINDOW - 1 */
+CDC_INLINE uint32_t window_at(int hw, const uint8_t *buf, size_t p) {
+        uint32_t r = 0;
+        size_t i;
+
+        for (i = p + 1 - CDC_WINDOW; i <= p; i++)
+                r = roll_in(hw, r, buf[i]);
+        return r;
+}
+
+/**
+ * cdc_scan - find cut point candidates
+ * @hw - use crc32b
+ * @c - chunker
+ * @buf - data
+ * @base - candidates are stored as chunk end offset from @base
+ * @from - first byte to end a chunk with, at least CDC_WINDOW
+ * @to - end of data to scan
+ *
+ * Every byte gets a rolling hash, where the loose mask matches the
+ * end after it is recorded, flagged if the strict mask matches too.
+ * The range is cut into CDC_LANES parts hashed in one loop: four
+ * independent crc32b chains hide the instruction latency a single
+ * rolling hash is bound by. That chain, crc32b and the XOR of the
+ * byte leaving, lasts about as long as four crc32b take to issue on
+ * their single port, so more lanes only spill registers. Returns number
+ * of candidates, in order.
+ */
+
+CDC_INLINE size_t cdc_scan(int hw, const struct cdc *c, const uint8_t *buf, size_t base,
+                           size_t from, size_t to) {
+        size_t part = (to - from) / CDC_LANES, cap = part + CDC_LANES;
+        size_t nr[CDC_LANES], start[CDC_LANES], i, l, p, total;
+        /* Locals, stores to the candidates could alias the masks */
+        const uint32_t loose = c->mask_loose, strict = c->mask_strict;
+        uint32_t *cand = c->cand, r[CDC_LANES], h;
+
+        for (l = 0; l < CDC_LANES; l++) {
+                start[l] = from + l * part;
+                nr[l] = 0;
+                r[l] = window_at(hw, buf, start[l] - 1);
+        }
+
+#define CDC_STEP(l, p) do { \
+                r[l] = roll_in(hw, r[l], buf[p]) ^ cdc_out[buf[(p) - CDC_WINDOW]]; \
+                h = r[l]; \
+                if (__builtin_expect(!(h & loose), 0)) \
+                        cand[(l) * cap + nr[l]++] = ((p) + 1 - base) | \
+                                (h & strict ? 0 : CDC_STRICT); \
+        } while (0)
+
+        /* Two bytes per lane and turn, loop control is a large share otherwise */
+        for (i = 0; i + 1 < part; i += 2) {
+                CDC_STEP(0, start[0] + i);
+                CDC_STEP(1, start[1] + i);
+                CDC_STEP(2, start[2] + i);
+                CDC_STEP(3, start[3] + i);
+                CDC_STEP(0, start[0] + i + 1);
+                CDC_STEP(1, start[1] + i + 1);
+                CDC_STEP(2, start[2] + i + 1);
+                CDC_STEP(3, start[3] + i + 1);
+        }
+        for (; i < part; i++) {
+                CDC_STEP(0, start[0] + i);
+                CDC_STEP(1, start[1] + i);
+                CDC_STEP(2, start[2] + i);
+                CDC_STEP(3, start[3] + i);
+        }
+        /* Remainder of the range goes to the last lane */
+        for (p = start[CDC_LANES - 1] + part; p < to; p++)
+                CDC_STEP(CDC_LANES - 1, p);
+#undef CDC_STEP
+
+        total = nr[0];
+        for (l = 1; l < CDC_LANES; l++) {
+                memmove(cand + total, cand + l * cap, nr[l] * sizeof(*cand));
+                total += nr[l];
+        }
+        return total;
+}
+
+static size_t cdc_scan_hw(const struct cdc *c, const uint8_t *buf, size_t base, size_t from, size_t to) {
+        return cdc_scan(1, c, buf, base, from, to);
+}
+
+static size_t cdc_scan_sw(const struct cdc *c, const uint8_t *buf, size_t base, size_t from, size_t to) {
+        return cdc_scan(0, c, buf, base, from, to);
+}
+
+/**
+ * cdc_init - set up chunker
+ * @c - chunker
+ * @min - smallest chunk, more than CDC_WINDOW
+ * @avg - expected chunk size, power of two, between @min and @max
+ * @max - largest chunk, up to 64 MiB
+ */
+
+int cdc_init(struct cdc *c, uint32_t min, uint32_t avg, uint32_t max) {
+        memset(c, 0, sizeof(*c));
+        if (min <= CDC_WINDOW || avg & (avg - 1) || min >= avg || avg >= max || max > CDC_MAX_CHUNK)
+                return -EINVAL;
+
+        pthread_once(&cdc_once, cdc_init_tables);
+        c->min = min;
+        c->avg = avg;
+        c->max = max;
+        c->mask_strict = (avg << 1) - 1;
+        c->mask_loose = (avg >> 1) - 1;
+        /* Rescans after a block cover at most max bytes, 1/8 of a block */
+        c->block = (size_t) max * 8 < (64 << 10) ? 64 << 10 : (size_t) max * 8;
+        c->cand = malloc((c->block + CDC_LANES * CDC_LANES) * sizeof(*c->cand));
+        if (!c->cand)
+                return -ENOMEM;
+        return 0;
+}
+
+/* Chunks of cdc_split(), hashes left 0 unless @hash */
+static size_t cdc_chunks(struct cdc *c, const void *data, size_t len, int final,
+                         struct cdc_chunk *out, size_t max_out, size_t *consumed, int hash) {
+        size_t (*scan)(const struct cdc *, const uint8_t *, size_t, size_t, size_t) =
+                crc32c_hw_available() ? cdc_scan_hw : cdc_scan_sw;
+        const uint8_t *buf = data;
+        size_t s = 0, n = 0, base = 0, end = 0, nc = 0, ci = 0, e, from;
+        uint32_t cand;
+
+        while (n < max_out && s < len) {
+                /* Candidates up to s + max are needed, scan a new block from s */
+                if (s + c->max > end && end < len) {
+                        base = s;
+                        end = len - s < c->block ? len : s + c->block;
+                        from = s + c->min;
+                        nc = from < end ? scan(c, buf, base, from - 1, end) : 0;
+                        ci = 0;
+                }
+
+                e = 0;
+                for (; ci < nc; ci++) {
+                        cand = c->cand[ci];
+                        e = base + (cand & ~CDC_STRICT);
+                        if (e < s + c->min)
+                                continue;
+                        if (e > s + c->max)
+                                break;
+                        if (e >= s + c->avg || cand & CDC_STRICT)
+                                break;
+                }
+                if (ci < nc && e <= s + c->max) {
+                        ci++;
+                } else if (s + c->max <= len) {
+                        e = s + c->max;
+                } else if (final) {
+                        e = len;
+                } else {
+                        break;
+                }
+
+                out[n].offset = s;
+                out[n].len = e - s;
+                out[n].crc = hash ? crc32c(0, buf + s, e - s) : 0;
+                out[n].xxh = hash ? xxh64_fixed(buf + s, e - s, 0) : 0;
+                n++;
+                s = e;
+        }
+
+        *consumed = s;
+        return n;
+}
+
+/**
+ * cdc_split - cut data into chunks and hash them
+ * @c - chunker
+ * @data - data
+ * @len - length of @data
+ * @final - @data ends the stream, else the tail which may still grow is left
+ * @out - output chunks
+ * @max_out - size of @out
+ * @consumed - output, bytes covered by the returned chunks
+ *
+ * Cut points depend only on chunk content, so a stream is split the
+ * same way whatever its buffers are: call again with the data from
+ * @consumed on, followed by more of the stream. Chunks are hashed right
+ * after their block was scanned, while it is still in cache.
+ * Returns number of chunks stored to @out.
+ */
+
+size_t cdc_split(struct cdc *c, const void *data, size_t len, int final,
+                 struct cdc_chunk *out, size_t max_out, size_t *consumed) {
+        return cdc_chunks(c, data, len, final, out, max_out, consumed, 1);
+}
+
+/**
+ * cdc_cut - cut data into chunks, without hashing
+ *
+ * As cdc_split(), @crc and @xxh of the chunks are left 0, for callers
+ * hashing chunks on their own.
+ */
+
+size_t cdc_cut(struct cdc *c, const void *data, size_t len, int final,
+               struct cdc_chunk *out, size_t max_out, size_t *consumed) {
+        return cdc_chunks(c, data, len, final, out, max_out, consumed, 0);
+}
+
+void cdc_free(struct cdc *c) {
+        free(c->cand);
+        c->cand = NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* Bytes covered by the rolling hash */
+#define CDC_WINDOW 64
+
+/**
+ * struct cdc_chunk - one content defined chunk
+ * @offset - chunk start, relative to the data given to cdc_split()
+ * @len - chunk length in bytes
+ * @crc - crc32c() of the chunk, seed 0
+ * @xxh - xxh64() of the chunk, seed 0
+ */
+struct cdc_chunk {
+        uint64_t offset;
+        uint32_t len;
+        uint32_t crc;
+        uint64_t xxh;
+};
+
+/**
+ * struct cdc - content defined chunker
+ * @min - smallest chunk, at least CDC_WINDOW
+ * @avg - expected chunk size, power of two
+ * @max - largest chunk
+ *
+ * Cut points are where the CRC32C of the last CDC_WINDOW bytes has its
+ * low bits clear. Chunks are normalized: before @avg more bits must be
+ * clear than after it, so sizes cluster around @avg.
+ *
+ * Throughput is capped by the rolling hash: every byte takes one
+ * crc32b, and a core issues at most one per cycle however the lanes
+ * hide its latency, so cdc_cut() stays near 1 byte per cycle, about
+ * 1.5 GiB/s on a 3 GHz core. cdc_split() walks each chunk twice more
+ * for its CRC32C and xxh64, from cache but not fused with the scan, as
+ * cut points are only known after it; it runs at roughly half of
+ * cdc_cut(). Neither reaches multi-GiB/s per core, more streams need
+ * more cores.
+ */
+struct cdc {
+        uint32_t min;
+        uint32_t avg;
+        uint32_t max;
+        /* Bits clear before and after @avg */
+        uint32_t mask_strict;
+        uint32_t mask_loose;
+        /* Bytes scanned at once and candidate cut points found there */
+        size_t block;
+        uint32_t *cand;
+};
+
+int cdc_init(struct cdc *c, uint32_t min, uint32_t avg, uint32_t max);
+size_t cdc_split(struct cdc *c, const void *data, size_t len, int final,
+                 struct cdc_chunk *out, size_t max_out, size_t *consumed);
+size_t cdc_cut(struct cdc *c, const void *data, size_t len, int final,
+               struct cdc_chunk *out, size_t max_out, size_t *consumed);
+void cdc_free(struct cdc *c);
+
+#endif /* CDC_H */
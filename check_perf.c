@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "parity.h"
+#include "crc32.h"
+#include "xxhash.h"
+#include "fixed.h"
+
+/*
+ * Differential fuzzer of all kernel tiers against plain scalar
+ * reference code, followed by a throughput gate against a baseline.
+ */
+
+#define FUZZ_MAX_LEN (64*1024)
+/* Misaligned starts up to a cache line */
+#define FUZZ_BUF_LEN (FUZZ_MAX_LEN + 64)
+
+#define BENCH_LEN PAGE_SIZE
+/* Each kernel is timed this many times, best run counts */
+#define BENCH_RUNS 7
+#define BENCH_RUN_NS 20000000ULL
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static inline uint64_t xorshift64(uint64_t *state) {
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Byte at a time CRC-32C, Sarwate table built from the polynomial */
+static uint32_t ref_crc32c(uint32_t crc, const uint8_t *buf, size_t len) {
+        static uint32_t table[256];
+        uint32_t c;
+        int n, k;
+
+        if (!table[1]) {
+                for (n = 0; n < 256; n++) {
+                        c = n;
+                        for (k = 0; k < 8; k++)
+                                c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+                        table[n] = c;
+                }
+        }
+
+        crc = ~crc;
+        while (len--)
+                crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        return ~crc;
+}
+
+/* Word at a time XOR, words read byte by byte */
+static uint64_t ref_parity(const uint8_t *buf, size_t len, size_t word, uint64_t seed) {
+        uint64_t p = 0, w;
+        size_t i, b;
+
+        for (i = 0; i + word <= len; i += word) {
+                for (w = 0, b = 0; b < word; b++)
+                        w |= (uint64_t) buf[i + b] << (b * 8);
+                p ^= w;
+        }
+        return p ^ seed;
+}
+
+/* XOR of 8 byte words at each offset within @stride byte stripes, as ref_parity() */
+static void ref_stripes(const uint8_t *buf, size_t len, size_t stride, uint64_t *out) {
+        size_t j;
+
+        for (j = 0; j < stride / 8; j++)
+                out[j] = 0;
+        for (; len >= stride; buf += stride, len -= stride)
+                for (j = 0; j < stride / 8; j++)
+                        out[j] ^= ref_parity(buf + j * 8, 8, 8, 0);
+}
+
+static unsigned failures;
+
+#define CHECK(cond, fmt, ...) do { \
+        if (!(cond)) { \
+                failures++; \
+                if (failures < 20) \
+                        fprintf(stderr, "FAIL %s: " fmt "\n", #cond, __VA_ARGS__); \
+        } \
+} while (0)
+
+static const size_t fixed_sizes[] = { 512, 4096, 16384, 65536 };
+
+static size_t fuzz_len(void) {
+        uint64_t r = xorshift64(&rng);
+
+        switch (r % 4) {
+        case 0:
+                return fixed_sizes[(r >> 8) % 4];
+        case 1:
+                return (r >> 8) % 300;
+        default:
+                return (r >> 8) % (FUZZ_MAX_LEN + 1);
+        }
+}
+
+static void fuzz_crc(const uint8_t *p, size_t len, uint32_t seed) {
+        uint32_t ref = ref_crc32c(seed, p, len);
+        size_t split = len ? xorshift64(&rng) % (len + 1) : 0;
+        uint32_t a;
+
+        CHECK(crc32c(seed, p, len) == ref, "len %zu seed %08x", len, seed);
+        CHECK(crc32c_sw(seed, p, len) == ref, "len %zu seed %08x", len, seed);
+        CHECK(crc32c_fixed(seed, p, len) == ref, "len %zu seed %08x", len, seed);
+
+        /* Streaming by continuation and by combination */
+        a = crc32c(seed, p, split);
+        CHECK(crc32c(a, p + split, len - split) == ref, "len %zu split %zu", len, split);
+        CHECK(crc32c_combine(a, crc32c(0, p + split, len - split), len - split) == ref,
+              "len %zu split %zu", len, split);
+}
+
+static void fuzz_parity(const uint8_t *p, size_t len, uint64_t seed) {
+        size_t len8 = len & ~(size_t) 7, len4 = len & ~(size_t) 3;
+        uint64_t ref = ref_parity(p, len8, 8, seed), ref0 = ref ^ seed;
+        uint64_t got, fill;
+
+        CHECK(fparity32(p, len4, (uint32_t) seed) == (uint32_t) ref_parity(p, len4, 4, (uint32_t) seed),
+              "len %zu", len4);
+        CHECK(fparity64(p, len8, seed) == ref, "len %zu", len8);
+        CHECK(fparity64_fixed(p, len8, seed) == ref, "len %zu", len8);
+
+        got = ~ref;
+        fparity64_fill(p, len8, seed, &got, &fill);
+        CHECK(got == ref, "len %zu", len8);
+
+        if (!len8)
+                return;
+        CHECK(!fparity_wide(p, len8, 8, &got) && got == ref0, "len %zu", len8);
+        CHECK(!fparity64_lanes(p, len8, 1, &got) && got == ref0, "len %zu", len8);
+}
+
+static const unsigned wide_widths[] = { 16, 32, 64 };
+static const unsigned lane_counts[] = { 2, 4, 8 };
+
+/* Wider stripes, lengths rounded down to whole stripes */
+static void fuzz_stripes(const uint8_t *p, size_t len) {
+        uint64_t ref[8], got[8];
+        size_t k, n;
+
+        for (k = 0; k < 3; k++) {
+                n = len - len % wide_widths[k];
+                if (!n)
+                        continue;
+                ref_stripes(p, n, wide_widths[k], ref);
+                CHECK(!fparity_wide(p, n, wide_widths[k], got) &&
+                      !memcmp(got, ref, wide_widths[k]),
+                      "width %u len %zu misalign %zu", wide_widths[k], n, (uintptr_t) p % 64);
+        }
+        for (k = 0; k < 3; k++) {
+                n = len - len % (8 * lane_counts[k]);
+                if (!n)
+                        continue;
+                ref_stripes(p, n, 8 * lane_counts[k], ref);
+                CHECK(!fparity64_lanes(p, n, lane_counts[k], got) &&
+                      !memcmp(got, ref, lane_counts[k] * 8),
+                      "lanes %u len %zu misalign %zu", lane_counts[k], n, (uintptr_t) p % 64);
+        }
+}
+
+static void fuzz_xxh64(const uint8_t *p, size_t len, uint64_t seed) {
+        uint64_t ref = xxh64(p, len, seed);
+        struct xxh64_state state;
+        size_t off, chunk;
+
+        CHECK(xxh64_fixed(p, len, seed) == ref, "len %zu", len);
+
+        /* Random chunks, some shorter than the 32 byte internal buffer */
+        xxh64_reset(&state, seed);
+        for (off = 0; off < len; off += chunk) {
+                chunk = xorshift64(&rng) % (xorshift64(&rng) & 1 ? 40 : 5000) + 1;
+                if (chunk > len - off)
+                        chunk = len - off;
+                xxh64_update(&state, p + off, chunk);
+        }
+        CHECK(xxh64_digest(&state) == ref, "len %zu", len);
+}
+
+static int fuzz(unsigned long iterations) {
+        static uint8_t buf[FUZZ_BUF_LEN] __attribute__((aligned(64)));
+        unsigned long it;
+        size_t i, len, off;
+        uint64_t seed;
+
+        for (i = 0; i < FUZZ_BUF_LEN; i++)
+                buf[i] = xorshift64(&rng);
+
+        /* Published check values */
+        CHECK(crc32c(0, "123456789", 9) == 0xe3069283, "%s", "crc32c check value");
+        CHECK(crc32c_sw(0, "123456789", 9) == 0xe3069283, "%s", "crc32c_sw check value");
+        CHECK(xxh64("", 0, 0) == 0xef46db3751d8e999ULL, "%s", "xxh64 empty");
+
+        for (it = 0; it < iterations; it++) {
+                len = fuzz_len();
+                off = xorshift64(&rng) % 64;
+                seed = it % 3 ? xorshift64(&rng) : 0;
+                /* Sparse data now and then, zero runs hit fill paths */
+                if (it % 64 == 0)
+                        memset(buf + off, it % 128 ? 0 : 0x5a, len);
+
+                fuzz_crc(buf + off, len, (uint32_t) seed);
+                fuzz_parity(buf + off, len, seed);
+                fuzz_stripes(buf + off, len);
+                fuzz_xxh64(buf + off, len, seed);
+
+                if (it % 64 == 0)
+                        for (i = 0; i < len; i++)
+                                buf[off + i] = xorshift64(&rng);
+        }
+
+        printf("Fuzz: %lu iterations, %u failures\n", iterations, failures);
+        return failures ? -1 : 0;
+}
+
+struct bench {
+        const char *name;
+        uint64_t (*fn)(const void *buf, uint64_t i);
+};
+
+static uint64_t b_crc32c(const void *buf, uint64_t i) { return crc32c(i, buf, BENCH_LEN); }
+static uint64_t b_crc32c_sw(const void *buf, uint64_t i) { return crc32c_sw(i, buf, BENCH_LEN); }
+static uint64_t b_crc32c_fixed(const void *buf, uint64_t i) { return crc32c_fixed(i, buf, BENCH_LEN); }
+static uint64_t b_fparity32(const void *buf, uint64_t i) { return fparity32(buf, BENCH_LEN, i); }
+static uint64_t b_fparity64(const void *buf, uint64_t i) { return fparity64(buf, BENCH_LEN, i); }
+static uint64_t b_fparity64_fixed(const void *buf, uint64_t i) { return fparity64_fixed(buf, BENCH_LEN, i); }
+static uint64_t b_xxh64(const void *buf, uint64_t i) { return xxh64(buf, BENCH_LEN, i); }
+static uint64_t b_xxh64_fixed(const void *buf, uint64_t i) { return xxh64_fixed(buf, BENCH_LEN, i); }
+
+static uint64_t b_wide32(const void *buf, uint64_t i) {
+        uint64_t p[4];
+
+        fparity_wide(buf, BENCH_LEN, 32, p);
+        return p[0] ^ p[3] ^ i;
+}
+
+static uint64_t b_lanes4(const void *buf, uint64_t i) {
+        uint64_t p[4];
+
+        fparity64_lanes(buf, BENCH_LEN, 4, p);
+        return p[0] ^ p[3] ^ i;
+}
+
+static const struct bench benches[] = {
+        { "crc32c", b_crc32c },
+        { "crc32c_sw", b_crc32c_sw },
+        { "crc32c_fixed", b_crc32c_fixed },
+        { "fparity32", b_fparity32 },
+        { "fparity64", b_fparity64 },
+        { "fparity64_fixed", b_fparity64_fixed },
+        { "fparity_wide32", b_wide32 },
+        { "fparity64_lanes4", b_lanes4 },
+        { "xxh64", b_xxh64 },
+        { "xxh64_fixed", b_xxh64_fixed },
+};
+
+#define NR_BENCHES (sizeof(benches)/sizeof(benches[0]))
+
+/* Best of BENCH_RUNS, MiB/s */
+static double bench_run(const struct bench *b, const void *buf) {
+        volatile uint64_t sink;
+        uint64_t start, ns, i, n;
+        double best = 0, mibs;
+        int run;
+
+        for (run = 0; run < BENCH_RUNS; run++) {
+                start = now_ns();
+                n = 0;
+                do {
+                        for (i = 0; i < 256; i++)
+                                sink = b->fn(buf, n + i);
+                        n += 256;
+                        ns = now_ns() - start;
+                } while (ns < BENCH_RUN_NS);
+                mibs = n * BENCH_LEN * 1000000000.0 / ns / (1024*1024);
+                if (mibs > best)
+                        best = mibs;
+        }
+        (void) sink;
+
+        return best;
+}
+
+static int baseline_read(const char *path, double base[]) {
+        char line[256], name[128];
+        double mibs;
+        size_t k;
+        FILE *f;
+
+        f = fopen(path, "r");
+        if (!f)
+                return -1;
+        while (fgets(line, sizeof(line), f)) {
+                if (line[0] == '#' || sscanf(line, "%127s %lf", name, &mibs) != 2)
+                        continue;
+                for (k = 0; k < NR_BENCHES; k++)
+                        if (!strcmp(name, benches[k].name))
+                                base[k] = mibs;
+        }
+        fclose(f);
+        return 0;
+}
+
+static int baseline_write(const char *path, const double cur[]) {
+        size_t k;
+        FILE *f;
+
+        f = fopen(path, "w");
+        if (!f)
+                return -1;
+        fprintf(f, "# Throughput baseline in MiB/s on %u byte blocks, regenerate with make perf-baseline\n",
+                BENCH_LEN);
+        for (k = 0; k < NR_BENCHES; k++)
+                fprintf(f, "%s %.0f\n", benches[k].name, cur[k]);
+        return fclose(f);
+}
+
+static int gate(const char *path, int update, double tolerance) {
+        static uint8_t buf[BENCH_LEN] __attribute__((aligned(64)));
+        double base[NR_BENCHES] = { 0 }, cur[NR_BENCHES];
+        const char *verdict;
+        int slow = 0, missing = 0, have;
+        size_t k;
+
+        for (k = 0; k < BENCH_LEN; k++)
+                buf[k] = xorshift64(&rng);
+
+        have = path && !update && !baseline_read(path, base);
+        printf("%-18s %12s %12s %8s\n", "kernel", "MiB/s", "baseline", "ratio");
+        for (k = 0; k < NR_BENCHES; k++) {
+                cur[k] = bench_run(&benches[k], buf);
+                verdict = "";
+                if (have && base[k] > 0 && cur[k] < base[k] * (1.0 - tolerance)) {
+                        verdict = "  SLOWER";
+                        slow++;
+                }
+                if (have && base[k] > 0) {
+                        printf("%-18s %12.0f %12.0f %8.2f%s\n", benches[k].name, cur[k], base[k],
+                               cur[k] / base[k], verdict);
+                } else {
+                        printf("%-18s %12.0f %12s %8s\n", benches[k].name, cur[k], "-", "-");
+                        missing++;
+                }
+        }
+
+        if (path && update) {
+                if (baseline_write(path, cur)) {
+                        perror(path);
+                        return -1;
+                }
+                printf("Baseline written to %s\n", path);
+                return 0;
+        }
+        /* A gate with nothing to compare against must not pass */
+        if (path && !have) {
+                fprintf(stderr, "No baseline in %s, record one with make perf-baseline\n", path);
+                return -1;
+        }
+        if (path && missing)
+                fprintf(stderr, "%d kernels missing from %s, record it again with make perf-baseline\n",
+                        missing, path);
+        if (slow)
+                printf("%d kernels slower than baseline by more than %.0f%%\n", slow, tolerance * 100);
+
+        return slow || (path && missing) ? -1 : 0;
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-f iterations] [-b baseline] [-u] [-t tolerance]\n"
+                "  -f  differential fuzz iterations, 0 to skip (default 20000)\n"
+                "  -b  baseline file, the gate fails if it is missing\n"
+                "  -u  write baseline with current numbers\n"
+                "  -t  allowed throughput drop in percent (default 20)\n",
+                prog);
+}
+
+int main(int argc, char **argv) {
+        unsigned long iterations = 20000;
+        const char *baseline = NULL;
+        double tolerance = 0.20;
+        int opt, update = 0, ret = 0;
+
+        while ((opt = getopt(argc, argv, "f:b:ut:h")) != -1) {
+                switch (opt) {
+                case 'f':
+                        iterations = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        baseline = optarg;
+                        break;
+                case 'u':
+                        update = 1;
+                        break;
+                case 't':
+                        tolerance = strtod(optarg, NULL) / 100;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+
+        printf("crc32c tier: %s\n", crc32c_hw_available() ? "hw" : "sw");
+        if (iterations && fuzz(iterations))
+                ret = 1;
+        if (gate(baseline, update, tolerance))
+                ret = 1;
+
+        return ret;
+}
@@ -42,6 +42,9 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include "metrics.h"
+#include "fixed.h"
+
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
@@ -202,6 +205,148 @@ static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
            zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
 }
 
+/* Operators for 2^n zero bytes, n = 0..63, built on first use. */
+static pthread_once_t crc32c_once_ops = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_ops[64][32];
+
+static void crc32c_init_ops(void)
+{
+    int n;
+
+    crc32c_zeros_op(crc32c_ops[0], 1);
+    for (n = 1; n < 64; n++)
+        gf2_matrix_square(crc32c_ops[n], crc32c_ops[n - 1]);
+}
+
+/* Return crc register after feeding it len zero bytes.  This works on the
+   raw register, pre- and post-conditioning are left to the caller. */
+uint32_t crc32c_shift_zeros(uint32_t crc, uint64_t len)
+{
+    int n;
+
+    pthread_once(&crc32c_once_ops, crc32c_init_ops);
+    for (n = 0; len; n++, len >>= 1)
+        if (len & 1)
+            crc = gf2_matrix_times(crc32c_ops[n], crc);
+    return crc;
+}
+
+/* Build four lookup tables for shifting a crc register by len zero bytes, as
+   crc32c_zeros() does, but for any len.  Columns of the operator are the
+   shifted single bit registers. */
+void crc32c_zeros_table(uint32_t zeros[][256], uint64_t len)
+{
+    uint32_t n;
+    uint32_t op[32];
+
+    for (n = 0; n < 32; n++)
+        op[n] = crc32c_shift_zeros((uint32_t)1 << n, len);
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+#if defined(__x86_64__)
+
+/* Lane shift tables of the fixed size kernels in fixed.h.  One copy for the
+   whole program, so a single crc32c_fixed_init() warms every user. */
+#define FIXED_CRC32C_TABLE(N) uint32_t crc32c_lane_##N[4][256];
+FIXED_SIZES(FIXED_CRC32C_TABLE)
+pthread_once_t crc32c_fixed_once = PTHREAD_ONCE_INIT;
+
+#define FIXED_CRC32C_INIT(N) \
+    crc32c_zeros_table(crc32c_lane_##N, FIXED_CRC32C_LANE(N));
+
+void crc32c_fixed_init(void)
+{
+    FIXED_SIZES(FIXED_CRC32C_INIT)
+}
+
+#endif
+
+/* Return the CRC-32C of A followed by B, given crc1 of A, crc2 of B and
+   length of B.  The conditioning of both cancels out, so this works on the
+   values returned by crc32c() as is. */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return crc32c_shift_zeros(crc1, len2) ^ crc2;
+}
+
+/* Multiply two matrices over GF(2), both must have 32 rows.  prod must not
+   be either of the operands. */
+static void gf2_matrix_mult(uint32_t *prod, uint32_t *a, uint32_t *b)
+{
+    int n;
+
+    for (n = 0; n < 32; n++)
+        prod[n] = gf2_matrix_times(a, b[n]);
+}
+
+/* Prepare op for crc32c_fill_apply() on len bytes, len must be a multiple of
+   eight.  Filling len bytes with a pattern is linear in the pattern: the crc
+   is sum(Z^k, k < len/8) applied to the raw crc of the pattern, plus the crc
+   of len zeros.  The sum is built by doubling, so this costs a few dozen
+   matrix products once, and each fill after that a single matrix times. */
+void crc32c_fill_init(struct crc32c_fill_op *op, uint64_t len)
+{
+    uint32_t sum[32], pow[32], tmp[32];
+    uint64_t count = len / 8;
+    int n, k;
+
+    pthread_once(&crc32c_once_ops, crc32c_init_ops);
+
+    /* start from the empty sum and the identity power */
+    for (k = 0; k < 32; k++) {
+        sum[k] = 0;
+        pow[k] = (uint32_t)1 << k;
+    }
+    for (n = 63; n >= 0; n--) {
+        /* sum(2a) = sum(a) + Z^a sum(a), Z^2a = Z^a Z^a */
+        gf2_matrix_mult(tmp, pow, sum);
+        for (k = 0; k < 32; k++)
+            sum[k] ^= tmp[k];
+        gf2_matrix_mult(tmp, pow, pow);
+        for (k = 0; k < 32; k++)
+            pow[k] = tmp[k];
+        if (count >> n & 1) {
+            /* sum(a + 1) = sum(a) + Z^a, Z^(a + 1) = Z^a Z */
+            for (k = 0; k < 32; k++)
+                sum[k] ^= pow[k];
+            gf2_matrix_mult(tmp, crc32c_ops[3], pow);
+            for (k = 0; k < 32; k++)
+                pow[k] = tmp[k];
+        }
+    }
+
+    for (k = 0; k < 32; k++)
+        op->sum[k] = sum[k];
+    op->zeros = crc32c_shift_zeros(0xffffffff, len) ^ 0xffffffff;
+    op->len = len;
+}
+
+/* Return the CRC-32C of op->len bytes filled with the eight-byte pattern. */
+uint32_t crc32c_fill_apply(const struct crc32c_fill_op *op, uint64_t pattern)
+{
+    uint32_t raw;
+
+    /* crc register of the pattern alone, without conditioning */
+    raw = crc32c_sw(0xffffffff, &pattern, 8) ^ 0xffffffff;
+    return gf2_matrix_times((uint32_t *)op->sum, raw) ^ op->zeros;
+}
+
+/* Return the CRC-32C of len bytes filled with the eight-byte pattern, len must
+   be a multiple of eight.  For many fills of one length keep the op around. */
+uint32_t crc32c_fill(uint64_t pattern, uint64_t len)
+{
+    struct crc32c_fill_op op;
+
+    crc32c_fill_init(&op, len);
+    return crc32c_fill_apply(&op, pattern);
+}
+
 /* Block sizes for three-way parallel crc computation.  LONG and SHORT must
    both be powers of two.  The associated string constants must be set
    accordingly, for use in constructing the assembler instructions. */
@@ -329,14 +474,32 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, uint64_t len)
         (have) = (ecx >> 20) & 1; \
     } while (0)
 
+/* cpuid is slow under virtualization, so check once. */
+static pthread_once_t crc32c_once_cpu = PTHREAD_ONCE_INIT;
+static int crc32c_sse42;
+
+static void crc32c_init_cpu(void)
+{
+    SSE42(crc32c_sse42);
+}
+
+/* Return true if the crc32 instruction is available. */
+int crc32c_hw_available(void)
+{
+    pthread_once(&crc32c_once_cpu, crc32c_init_cpu);
+    return crc32c_sse42;
+}
+
 /* Compute a CRC-32C.  If the crc32 instruction is available, use the hardware
    version.  Otherwise, use the software version. */
 uint32_t crc32c(uint32_t crc, const void *buf, uint64_t len)
 {
-    int sse42;
+    METRIC_START(start);
 
-    SSE42(sse42);
-    return sse42 ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+    crc = crc32c_hw_available() ? crc32c_hw(crc, buf, len) :
+                                  crc32c_sw(crc, buf, len);
+    METRIC_RECORD(METRIC_CRC32C, len, start, 0);
+    return crc;
 }
 
 #ifdef TEST
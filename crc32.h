@@ -1,4 +1,24 @@
+#ifndef CRC32_H
+#define CRC32_H
+
 #include <inttypes.h>
 
 uint32_t crc32c(uint32_t crc, const void *buf, uint64_t len);
 uint32_t crc32c_sw(uint32_t crci, const void *buf, uint64_t len);
+uint32_t crc32c_shift_zeros(uint32_t crc, uint64_t len);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+void crc32c_zeros_table(uint32_t zeros[][256], uint64_t len);
+int crc32c_hw_available(void);
+
+/* Precomputed operator for CRC-32C of constant filled buffers */
+struct crc32c_fill_op {
+    uint32_t sum[32];
+    uint32_t zeros;
+    uint64_t len;
+};
+
+void crc32c_fill_init(struct crc32c_fill_op *op, uint64_t len);
+uint32_t crc32c_fill_apply(const struct crc32c_fill_op *op, uint64_t pattern);
+uint32_t crc32c_fill(uint64_t pattern, uint64_t len);
+
+#endif /* CRC32_H */
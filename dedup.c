@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dedup.h"
+#include "verify.h"
+
+/* Pages hashed before their digests are inserted, see dedup_insert_pages() */
+#define DEDUP_GRAIN 16
+
+#define DEDUP_FULL ((1U << DEDUP_SLOTS) - 1)
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+}
+
+/* Overflow count sticks here, entries past it can no longer be told apart */
+#define DEDUP_OVERFLOW_MAX UINT16_MAX
+
+/* xxh64 is well mixed already, low bits pick the bucket */
+static inline size_t dedup_home(const struct dedup_index *idx, uint64_t digest) {
+        return digest & idx->mask;
+}
+
+/**
+ * dedup_init - allocate empty index
+ * @idx - index
+ * @capacity - pages to index
+ * @resolve - page content of a location, NULL if locations are page addresses
+ * @arg - passed to @resolve
+ */
+
+int dedup_init(struct dedup_index *idx, size_t capacity, dedup_resolve_fn resolve, void *arg) {
+        size_t nr = 1, i;
+
+        memset(idx, 0, sizeof(*idx));
+        while (nr * DEDUP_SLOTS / 4 * 3 < capacity)
+                nr <<= 1;
+
+        idx->buckets = aligned_alloc(64, nr * sizeof(*idx->buckets));
+        idx->locs = malloc(nr * DEDUP_SLOTS * sizeof(*idx->locs));
+        if (!idx->buckets || !idx->locs) {
+                free(idx->buckets);
+                free(idx->locs);
+                idx->buckets = NULL;
+                idx->locs = NULL;
+                return -ENOMEM;
+        }
+        memset(idx->buckets, 0, nr * sizeof(*idx->buckets));
+        for (i = 0; i < nr; i++)
+                pthread_spin_init(&idx->buckets[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+        idx->mask = nr - 1;
+        idx->limit = nr * DEDUP_SLOTS / 4 * 3;
+        idx->resolve = resolve;
+        idx->arg = arg;
+        return 0;
+}
+
+static inline void bucket_write_begin(struct dedup_bucket *b) {
+        uint32_t seq;
+
+        for (;;) {
+                seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+                if (!(seq & 1) && __atomic_compare_exchange_n(&b->seq, &seq, seq + 1, 1,
+                                                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        break;
+                cpu_relax();
+        }
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void bucket_write_end(struct dedup_bucket *b) {
+        __atomic_add_fetch(&b->seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Locations of digest matches in bucket @i, consistent snapshot */
+static unsigned bucket_match(const struct dedup_index *idx, size_t i, uint64_t digest,
+                             uint64_t out[DEDUP_SLOTS]) {
+        const struct dedup_bucket *b = &idx->buckets[i];
+        const uint64_t *locs = &idx->locs[i * DEDUP_SLOTS];
+        unsigned used, slot, n;
+        uint32_t seq;
+
+        for (;;) {
+                seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1) {
+                        cpu_relax();
+                        continue;
+                }
+                used = __atomic_load_n(&b->used, __ATOMIC_RELAXED);
+                for (n = 0, slot = 0; slot < DEDUP_SLOTS; slot++)
+                        if (used & 1U << slot &&
+                            __atomic_load_n(&b->digest[slot], __ATOMIC_RELAXED) == digest)
+                                out[n++] = __atomic_load_n(&locs[slot], __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == seq)
+                        return n;
+        }
+}
+
+static inline int dedup_same(const struct dedup_index *idx, uint64_t loc, const void *page) {
+        const void *other = idx->resolve ? idx->resolve(idx->arg, loc) : (const void *) (uintptr_t) loc;
+
+        return other && !memcmp(other, page, PAGE_SIZE);
+}
+
+/**
+ * dedup_lookup - find a page with the same content
+ * @idx - index
+ * @digest - page_xxh64() of @page
+ * @page - PAGE_SIZE bytes of data
+ * @loc - output, location of the indexed page
+ *
+ * Lock free, safe against concurrent inserts and removes.
+ * Returns 1 if found, 0 if not.
+ */
+
+int dedup_lookup(struct dedup_index *idx, uint64_t digest, const void *page, uint64_t *loc) {
+        uint64_t cand[DEDUP_SLOTS];
+        size_t i = dedup_home(idx, digest), probes;
+        unsigned n, j;
+
+        for (probes = 0; probes <= idx->mask; probes++, i = (i + 1) & idx->mask) {
+                n = bucket_match(idx, i, digest, cand);
+                for (j = 0; j < n; j++) {
+                        if (dedup_same(idx, cand[j], page)) {
+                                *loc = cand[j];
+                                return 1;
+                        }
+                }
+                if (!__atomic_load_n(&idx->buckets[i].overflow, __ATOMIC_ACQUIRE))
+                        break;
+        }
+
+        return 0;
+}
+
+/*
+ * Overflow count of a bucket is the number of entries homed before it
+ * and stored past it. Inserts of different homes pass a bucket
+ * concurrently, so it is atomic. Once saturated it is never decremented.
+ */
+static inline void overflow_inc(struct dedup_bucket *b) {
+        uint16_t cnt = __atomic_load_n(&b->overflow, __ATOMIC_RELAXED);
+
+        while (cnt != DEDUP_OVERFLOW_MAX &&
+               !__atomic_compare_exchange_n(&b->overflow, &cnt, cnt + 1, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+}
+
+static inline void overflow_dec(struct dedup_bucket *b) {
+        uint16_t cnt = __atomic_load_n(&b->overflow, __ATOMIC_RELAXED);
+
+        while (cnt != DEDUP_OVERFLOW_MAX &&
+               !__atomic_compare_exchange_n(&b->overflow, &cnt, cnt - 1, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+}
+
+/**
+ * dedup_insert - index a page unless same content is indexed already
+ * @idx - index
+ * @digest - page_xxh64() of @page
+ * @page - PAGE_SIZE bytes of data
+ * @loc - location of @page, returned by later lookups
+ * @dup - output, location of the page with the same content
+ *
+ * Inserts of one digest are serialized by the lock of its home bucket,
+ * so concurrent inserts of the same content leave exactly one entry.
+ * Returns 0 if inserted, 1 if a duplicate was found or -ENOSPC.
+ */
+
+int dedup_insert(struct dedup_index *idx, uint64_t digest, const void *page, uint64_t loc,
+                 uint64_t *dup) {
+        size_t home = dedup_home(idx, digest), i, probes;
+        struct dedup_bucket *b;
+        unsigned slot;
+        int ret = 0;
+
+        pthread_spin_lock(&idx->buckets[home].lock);
+        if (dedup_lookup(idx, digest, page, dup)) {
+                ret = 1;
+                goto out;
+        }
+        if (__atomic_load_n(&idx->count, __ATOMIC_RELAXED) >= idx->limit) {
+                ret = -ENOSPC;
+                goto out;
+        }
+
+        for (probes = 0, i = home; probes <= idx->mask; probes++, i = (i + 1) & idx->mask) {
+                b = &idx->buckets[i];
+                if (__atomic_load_n(&b->used, __ATOMIC_RELAXED) != DEDUP_FULL) {
+                        bucket_write_begin(b);
+                        /* Other homes may have taken the slot meanwhile */
+                        if (b->used != DEDUP_FULL) {
+                                slot = __builtin_ctz(~b->used);
+                                __atomic_store_n(&b->digest[slot], digest, __ATOMIC_RELAXED);
+                                __atomic_store_n(&idx->locs[i * DEDUP_SLOTS + slot], loc, __ATOMIC_RELAXED);
+                                __atomic_store_n(&b->used, b->used | 1U << slot, __ATOMIC_RELAXED);
+                                bucket_write_end(b);
+                                __atomic_add_fetch(&idx->count, 1, __ATOMIC_RELAXED);
+                                goto out;
+                        }
+                        bucket_write_end(b);
+                }
+                /* Counted before the entry shows up further on */
+                overflow_inc(b);
+        }
+        /* Every bucket was passed */
+        for (i = 0; i <= idx->mask; i++)
+                overflow_dec(&idx->buckets[i]);
+        ret = -ENOSPC;
+
+out:
+        pthread_spin_unlock(&idx->buckets[home].lock);
+        return ret;
+}
+
+/**
+ * dedup_remove - drop page from index
+ * @idx - index
+ * @digest - digest the page was inserted with
+ * @loc - location the page was inserted with
+ *
+ * Buckets the entry was probed past drop it from their overflow count,
+ * so lookups stop early again once no entry lives beyond them.
+ */
+
+int dedup_remove(struct dedup_index *idx, uint64_t digest, uint64_t loc) {
+        size_t home = dedup_home(idx, digest), i, probes;
+        struct dedup_bucket *b;
+        unsigned slot;
+        int ret = -ENOENT;
+
+        pthread_spin_lock(&idx->buckets[home].lock);
+        for (probes = 0, i = home; probes <= idx->mask; probes++, i = (i + 1) & idx->mask) {
+                b = &idx->buckets[i];
+                for (slot = 0; slot < DEDUP_SLOTS; slot++) {
+                        if (!(__atomic_load_n(&b->used, __ATOMIC_RELAXED) & 1U << slot) ||
+                            __atomic_load_n(&b->digest[slot], __ATOMIC_RELAXED) != digest ||
+                            idx->locs[i * DEDUP_SLOTS + slot] != loc)
+                                continue;
+                        bucket_write_begin(b);
+                        __atomic_store_n(&b->used, b->used & ~(1U << slot), __ATOMIC_RELAXED);
+                        bucket_write_end(b);
+                        __atomic_sub_fetch(&idx->count, 1, __ATOMIC_RELAXED);
+                        /* Entry is gone, lookups may stop short of it now */
+                        for (; i != home; i = (i - 1) & idx->mask)
+                                overflow_dec(&idx->buckets[(i - 1) & idx->mask]);
+                        ret = 0;
+                        goto out;
+                }
+                if (!__atomic_load_n(&b->overflow, __ATOMIC_RELAXED))
+                        break;
+        }
+
+out:
+        pthread_spin_unlock(&idx->buckets[home].lock);
+        return ret;
+}
+
+/**
+ * dedup_insert_digests - dedup_insert() of many pages with known digests
+ * @idx - index
+ * @digests - page_xxh64() of each page
+ * @pages - page pointers
+ * @locs - location of each page, NULL if locations are page addresses
+ * @n - number of pages
+ * @dup - output, location of a page with the same content or DEDUP_NONE
+ *
+ * Home buckets of the batch are prefetched before the first insert, so
+ * their misses overlap. Returns number of duplicates or -ENOSPC, pages
+ * after the one not fitting are left out.
+ */
+
+long dedup_insert_digests(struct dedup_index *idx, const uint64_t digests[],
+                          const void *const pages[], const uint64_t locs[], size_t n, uint64_t dup[]) {
+        size_t i;
+        long dups = 0;
+        int ret;
+
+        for (i = 0; i < n; i++)
+                __builtin_prefetch(&idx->buckets[dedup_home(idx, digests[i])], 0, 3);
+
+        for (i = 0; i < n; i++) {
+                ret = dedup_insert(idx, digests[i], pages[i], locs ? locs[i] : (uintptr_t) pages[i], &dup[i]);
+                if (ret < 0)
+                        return ret;
+                if (!ret)
+                        dup[i] = DEDUP_NONE;
+                dups += ret;
+        }
+
+        return dups;
+}
+
+/**
+ * dedup_insert_pages - hash pages and index them
+ * @idx - index
+ * @pages - page pointers
+ * @locs - location of each page, NULL if locations are page addresses
+ * @n - number of pages
+ * @dup - output, location of a page with the same content or DEDUP_NONE
+ *
+ * Pages are hashed by page_xxh64() in groups of DEDUP_GRAIN, then the
+ * group is inserted while its pages are still in cache for memcmp.
+ * Returns number of duplicates or -ENOSPC.
+ */
+
+long dedup_insert_pages(struct dedup_index *idx, const void *const pages[], const uint64_t locs[],
+                        size_t n, uint64_t dup[]) {
+        uint64_t digests[DEDUP_GRAIN];
+        size_t base, cnt, i;
+        long ret, dups = 0;
+
+        for (base = 0; base < n; base += cnt) {
+                cnt = n - base < DEDUP_GRAIN ? n - base : DEDUP_GRAIN;
+                for (i = 0; i < cnt; i++)
+                        digests[i] = page_xxh64(pages[base + i]);
+                ret = dedup_insert_digests(idx, digests, pages + base, locs ? locs + base : NULL,
+                                           cnt, dup + base);
+                if (ret < 0)
+                        return ret;
+                dups += ret;
+        }
+
+        return dups;
+}
+
+void dedup_destroy(struct dedup_index *idx) {
+        size_t i;
+
+        if (idx->buckets)
+                for (i = 0; i <= idx->mask; i++)
+                        pthread_spin_destroy(&idx->buckets[i].lock);
+        free(idx->buckets);
+        free(idx->locs);
+        idx->buckets = NULL;
+        idx->locs = NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Digests sharing one cache line bucket */
+#define DEDUP_SLOTS 6
+
+/* No duplicate, see dedup_insert_pages() */
+#define DEDUP_NONE UINT64_MAX
+
+/**
+ * struct dedup_bucket - one cache line of the page index
+ * @seq - odd while a slot is written, lookups retry on change
+ * @lock - serializes inserts and removes of digests homed here
+ * @used - bitmap of occupied slots
+ * @overflow - live entries homed before this bucket and stored past it,
+ * lookups go on while not 0
+ * @digest - page digests, locations are in a side array
+ */
+struct dedup_bucket {
+        uint32_t seq;
+        pthread_spinlock_t lock;
+        uint16_t used;
+        uint16_t overflow;
+        uint32_t pad;
+        uint64_t digest[DEDUP_SLOTS];
+} __attribute__((aligned(64)));
+
+/**
+ * dedup_resolve_fn - find page content of a location
+ * @arg - caller cookie
+ * @loc - location given to dedup_insert()
+ *
+ * Returns PAGE_SIZE bytes to compare with, NULL if gone.
+ */
+typedef const void *(*dedup_resolve_fn)(void *arg, uint64_t loc);
+
+/**
+ * struct dedup_index - concurrent index from page xxh64 to page location
+ *
+ * Open addressing over cache line buckets, linear probing. Lookups take
+ * no locks, only bucket sequence counters. A digest match is confirmed
+ * by memcmp of the page contents, so hash collisions never merge pages.
+ */
+struct dedup_index {
+        struct dedup_bucket *buckets;
+        uint64_t *locs;
+        size_t mask;
+        /* Entries allowed, linear probing degrades past 3/4 load */
+        size_t limit;
+        size_t count;
+        dedup_resolve_fn resolve;
+        void *arg;
+};
+
+int dedup_init(struct dedup_index *idx, size_t capacity, dedup_resolve_fn resolve, void *arg);
+int dedup_lookup(struct dedup_index *idx, uint64_t digest, const void *page, uint64_t *loc);
+int dedup_insert(struct dedup_index *idx, uint64_t digest, const void *page, uint64_t loc,
+                 uint64_t *dup);
+int dedup_remove(struct dedup_index *idx, uint64_t digest, uint64_t loc);
+long dedup_insert_digests(struct dedup_index *idx, const uint64_t digests[],
+                          const void *const pages[], const uint64_t locs[], size_t n, uint64_t dup[]);
+long dedup_insert_pages(struct dedup_index *idx, const void *const pages[], const uint64_t locs[],
+                        size_t n, uint64_t dup[]);
+void dedup_destroy(struct dedup_index *idx);
+
+#endif /* DEDUP_H */
@@ -0,0 +1,207 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "parity.h"
+#include "crc32.h"
+#include "xxhash.h"
+#include "metrics.h"
+
+/*
+ * Kernels specialized for fixed block sizes. Length is a compile time
+ * constant, so loops have known trip count and no remainder handling.
+ * Use the *_fixed() dispatchers: with a constant length they inline
+ * to one kernel, other lengths go to the generic functions.
+ */
+#define FIXED_SIZES(X) X(512) X(4096) X(16384) X(65536)
+
+#define FIXED_INLINE static inline __attribute__((always_inline))
+
+/* fparity64() of N bytes, 8 byte aligned */
+#define FIXED_FPARITY64(N) \
+FIXED_INLINE uint64_t fparity64_##N(const void *data, uint64_t seed) { \
+        const uint64_t *ptr = (const uint64_t *) data; \
+        uint64_t p1 = 0, p2 = 0, p3 = 0, p4 = 0; \
+        size_t i; \
+        _Pragma("GCC unroll 8") \
+        for (i = 0; i < (N)/8; i += 4) { \
+                p1 ^= ptr[i]; \
+                p2 ^= ptr[i + 1]; \
+                p3 ^= ptr[i + 2]; \
+                p4 ^= ptr[i + 3]; \
+        } \
+        return p1 ^ p2 ^ p3 ^ p4 ^ seed; \
+}
+
+#if defined(__x86_64__)
+
+/* Each of three interleaved crc32 streams covers this many bytes */
+#define FIXED_CRC32C_LANE(N) ((N) / 24 * 8)
+
+static inline uint32_t fixed_crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+        return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+               zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/* Shift tables of all sizes live in crc32.c, built together on first use */
+#define FIXED_CRC32C_EXTERN(N) extern uint32_t crc32c_lane_##N[4][256];
+FIXED_SIZES(FIXED_CRC32C_EXTERN)
+extern pthread_once_t crc32c_fixed_once;
+void crc32c_fixed_init(void);
+
+/* crc32c() of N bytes: three streams like crc32c_hw(), then a short tail */
+#define FIXED_CRC32C(N) \
+FIXED_INLINE uint32_t crc32c_##N(uint32_t crc, const void *buf) { \
+        const unsigned char *next = buf; \
+        uint64_t crc0, crc1 = 0, crc2 = 0; \
+        size_t i; \
+        if (!crc32c_hw_available()) \
+                return crc32c_sw(crc, buf, N); \
+        pthread_once(&crc32c_fixed_once, crc32c_fixed_init); \
+        crc0 = crc ^ 0xffffffff; \
+        _Pragma("GCC unroll 4") \
+        for (i = 0; i < FIXED_CRC32C_LANE(N); i += 8) { \
+                __asm__("crc32q\t" "(%3), %0\n\t" \
+                        "crc32q\t" "%c4(%3), %1\n\t" \
+                        "crc32q\t" "%c5(%3), %2" \
+                        : "=r"(crc0), "=r"(crc1), "=r"(crc2) \
+                        : "r"(next + i), "i"(FIXED_CRC32C_LANE(N)), \
+                          "i"(2 * FIXED_CRC32C_LANE(N)), \
+                          "0"(crc0), "1"(crc1), "2"(crc2)); \
+        } \
+        crc0 = fixed_crc32c_shift(crc32c_lane_##N, crc0) ^ crc1; \
+        crc0 = fixed_crc32c_shift(crc32c_lane_##N, crc0) ^ crc2; \
+        next += 3 * FIXED_CRC32C_LANE(N); \
+        for (i = 0; i < (N) - 3 * FIXED_CRC32C_LANE(N); i += 8) { \
+                __asm__("crc32q\t" "(%1), %0" \
+                        : "=r"(crc0) \
+                        : "r"(next + i), "0"(crc0)); \
+        } \
+        return (uint32_t)crc0 ^ 0xffffffff; \
+}
+
+#else
+
+#define FIXED_CRC32C(N) \
+FIXED_INLINE uint32_t crc32c_##N(uint32_t crc, const void *buf) { \
+        return crc32c(crc, buf, N); \
+}
+
+#endif
+
+#define FIXED_PRIME64_1 11400714785074694791ULL
+#define FIXED_PRIME64_2 14029467366897019727ULL
+#define FIXED_PRIME64_3  1609587929392839161ULL
+#define FIXED_PRIME64_4  9650029242287828579ULL
+#define FIXED_PRIME64_5  2870177450012600261ULL
+
+static inline uint64_t fixed_rotl64(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fixed_le64(const void *p) {
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        return v;
+}
+
+static inline uint64_t fixed_xxh64_round(uint64_t acc, uint64_t input) {
+        acc += input * FIXED_PRIME64_2;
+        acc = fixed_rotl64(acc, 31);
+        return acc * FIXED_PRIME64_1;
+}
+
+static inline uint64_t fixed_xxh64_merge(uint64_t acc, uint64_t val) {
+        acc ^= fixed_xxh64_round(0, val);
+        return acc * FIXED_PRIME64_1 + FIXED_PRIME64_4;
+}
+
+/* xxh64() of N bytes, N is a multiple of 32 so there is no tail */
+#define FIXED_XXH64(N) \
+FIXED_INLINE uint64_t xxh64_##N(const void *input, uint64_t seed) { \
+        const uint8_t *p = (const uint8_t *) input; \
+        uint64_t v1 = seed + FIXED_PRIME64_1 + FIXED_PRIME64_2; \
+        uint64_t v2 = seed + FIXED_PRIME64_2; \
+        uint64_t v3 = seed; \
+        uint64_t v4 = seed - FIXED_PRIME64_1; \
+        uint64_t h64; \
+        size_t i; \
+        _Pragma("GCC unroll 4") \
+        for (i = 0; i < (N); i += 32) { \
+                v1 = fixed_xxh64_round(v1, fixed_le64(p + i)); \
+                v2 = fixed_xxh64_round(v2, fixed_le64(p + i + 8)); \
+                v3 = fixed_xxh64_round(v3, fixed_le64(p + i + 16)); \
+                v4 = fixed_xxh64_round(v4, fixed_le64(p + i + 24)); \
+        } \
+        h64 = fixed_rotl64(v1, 1) + fixed_rotl64(v2, 7) + \
+              fixed_rotl64(v3, 12) + fixed_rotl64(v4, 18); \
+        h64 = fixed_xxh64_merge(h64, v1); \
+        h64 = fixed_xxh64_merge(h64, v2); \
+        h64 = fixed_xxh64_merge(h64, v3); \
+        h64 = fixed_xxh64_merge(h64, v4); \
+        h64 += (N); \
+        h64 ^= h64 >> 33; \
+        h64 *= FIXED_PRIME64_2; \
+        h64 ^= h64 >> 29; \
+        h64 *= FIXED_PRIME64_3; \
+        h64 ^= h64 >> 32; \
+        return h64; \
+}
+
+FIXED_SIZES(FIXED_FPARITY64)
+FIXED_SIZES(FIXED_CRC32C)
+FIXED_SIZES(FIXED_XXH64)
+
+/* Fixed sizes are counted here, others by the generic function, except xxh64() of vendored xxhash.c */
+#define FIXED_CASE_FPARITY64(N) case N: ret = fparity64_##N(data, seed); break;
+#define FIXED_CASE_CRC32C(N) case N: ret = crc32c_##N(crc, buf); break;
+#define FIXED_CASE_XXH64(N) case N: ret = xxh64_##N(input, seed); break;
+
+FIXED_INLINE uint64_t fparity64_fixed(const void *data, uint64_t byte_len, uint64_t seed) {
+        uint64_t ret;
+        METRIC_START(start);
+
+        switch (byte_len) {
+        FIXED_SIZES(FIXED_CASE_FPARITY64)
+        default:
+                return fparity64(data, byte_len, seed);
+        }
+        METRIC_RECORD(METRIC_FPARITY64, byte_len, start, 0);
+        return ret;
+}
+
+FIXED_INLINE uint32_t crc32c_fixed(uint32_t crc, const void *buf, uint64_t len) {
+        uint32_t ret;
+        METRIC_START(start);
+
+        switch (len) {
+        FIXED_SIZES(FIXED_CASE_CRC32C)
+        default:
+                return crc32c(crc, buf, len);
+        }
+        METRIC_RECORD(METRIC_CRC32C, len, start, 0);
+        return ret;
+}
+
+FIXED_INLINE uint64_t xxh64_fixed(const void *input, size_t len, uint64_t seed) {
+        uint64_t ret;
+        METRIC_START(start);
+
+        switch (len) {
+        FIXED_SIZES(FIXED_CASE_XXH64)
+        default:
+                ret = xxh64(input, len, seed);
+        }
+        METRIC_RECORD(METRIC_XXH64, len, start, 0);
+        return ret;
+}
+
+#endif /* FIXED_H */
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hints.h"
+#include "scrub.h"
+
+/* Header takes one cache line in front of the table */
+#define HINTS_HDR_SIZE 64
+
+static inline size_t hint_home(const struct fault_map *map, uint64_t region) {
+        return (region * 0x9e3779b97f4a7c15ULL >> 32) & (map->hdr->capacity - 1);
+}
+
+/**
+ * fault_map_open - open or create persistent fault map
+ * @map - map
+ * @path - backing file, locked for exclusive use while open
+ * @capacity - slots of a new map, power of two, ignored for existing one
+ *
+ * An existing map is refused unless its header is sane, probe loops
+ * still stop after @capacity slots should the table itself be damaged.
+ */
+
+int fault_map_open(struct fault_map *map, const char *path, uint32_t capacity) {
+        struct stat st;
+        void *mem;
+        int ret;
+
+        memset(map, 0, sizeof(*map));
+        map->fd = open(path, O_RDWR|O_CREAT, 0644);
+        if (map->fd < 0)
+                return -errno;
+        if (flock(map->fd, LOCK_EX|LOCK_NB)) {
+                ret = errno == EWOULDBLOCK ? -EBUSY : -errno;
+                goto err;
+        }
+        if (fstat(map->fd, &st)) {
+                ret = -errno;
+                goto err;
+        }
+
+        if (st.st_size == 0) {
+                if (!capacity || capacity & (capacity - 1)) {
+                        ret = -EINVAL;
+                        goto err;
+                }
+                map->map_len = HINTS_HDR_SIZE + (size_t) capacity * sizeof(struct fault_hint);
+                if (ftruncate(map->fd, map->map_len)) {
+                        ret = -errno;
+                        goto err;
+                }
+        } else {
+                map->map_len = st.st_size;
+        }
+
+        mem = mmap(NULL, map->map_len, PROT_READ|PROT_WRITE, MAP_SHARED, map->fd, 0);
+        if (mem == MAP_FAILED) {
+                ret = -errno;
+                goto err;
+        }
+        map->hdr = mem;
+        map->slots = (struct fault_hint *) ((uint8_t *) mem + HINTS_HDR_SIZE);
+
+        if (st.st_size == 0) {
+                map->hdr->magic = HINTS_MAGIC;
+                map->hdr->version = HINTS_VERSION;
+                map->hdr->capacity = capacity;
+        } else if (map->hdr->magic != HINTS_MAGIC || map->hdr->version != HINTS_VERSION ||
+                   !map->hdr->capacity || map->hdr->capacity & (map->hdr->capacity - 1) ||
+                   map->map_len < HINTS_HDR_SIZE + (size_t) map->hdr->capacity * sizeof(struct fault_hint) ||
+                   map->hdr->count > map->hdr->capacity / 4 * 3) {
+                fprintf(stderr, "hints: %s is not a fault map\n", path);
+                munmap(mem, map->map_len);
+                map->hdr = NULL;
+                ret = -EINVAL;
+                goto err;
+        }
+
+        /* Linear probing degrades past 3/4 load, evict before that */
+        map->limit = map->hdr->capacity / 4 * 3;
+        pthread_mutex_init(&map->lock, NULL);
+        return 0;
+
+err:
+        close(map->fd);
+        map->fd = -1;
+        return ret;
+}
+
+/**
+ * fault_map_lookup - faults repaired before in a region, most frequent first
+ * @map - map
+ * @region - hint_region() of the page
+ * @out - output
+ * @max - size of @out
+ *
+ * Returns number of hints stored to @out.
+ */
+
+size_t fault_map_lookup(struct fault_map *map, uint64_t region, struct fault_hint *out, size_t max) {
+        size_t mask = map->hdr->capacity - 1;
+        size_t i, j, probes, n = 0;
+
+        pthread_mutex_lock(&map->lock);
+        for (probes = 0, i = hint_home(map, region); probes <= mask && map->slots[i].used;
+             probes++, i = (i + 1) & mask) {
+                const struct fault_hint *h = &map->slots[i];
+
+                if (h->region != region)
+                        continue;
+                /* Insertion sort by hits, then by recency */
+                for (j = n < max ? n++ : max; j > 0; j--) {
+                        if (out[j - 1].hits > h->hits ||
+                            (out[j - 1].hits == h->hits && out[j - 1].stamp >= h->stamp))
+                                break;
+                        if (j < max)
+                                out[j] = out[j - 1];
+                }
+                if (j < max)
+                        out[j] = *h;
+        }
+        pthread_mutex_unlock(&map->lock);
+
+        return n;
+}
+
+/* Remove slot @i keeping probe sequences unbroken, no tombstones */
+static void hint_delete(struct fault_map *map, size_t i) {
+        size_t mask = map->hdr->capacity - 1;
+        size_t j = i, k, probes;
+
+        for (probes = 0; probes < mask; probes++) {
+                j = (j + 1) & mask;
+                if (!map->slots[j].used)
+                        break;
+                k = hint_home(map, map->slots[j].region);
+                /* Move back unless its home lies cyclically in (i, j] */
+                if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+                        map->slots[i] = map->slots[j];
+                        i = j;
+                }
+        }
+        memset(&map->slots[i], 0, sizeof(map->slots[i]));
+        if (map->hdr->count)
+                map->hdr->count--;
+}
+
+static void hint_evict_lru(struct fault_map *map) {
+        size_t i, victim = 0;
+        uint64_t oldest = UINT64_MAX;
+
+        for (i = 0; i < map->hdr->capacity; i++) {
+                if (map->slots[i].used && map->slots[i].stamp < oldest) {
+                        oldest = map->slots[i].stamp;
+                        victim = i;
+                }
+        }
+        hint_delete(map, victim);
+}
+
+/**
+ * fault_map_record - remember a successful repair
+ * @map - map
+ * @region - hint_region() of the page
+ * @offset - byte offset of the fault
+ * @bit - bit inside of the byte
+ *
+ * Least recently repaired place of the region is dropped when it holds
+ * HINTS_PER_REGION places, so a new fault always gets a lookup slot.
+ * Least recently repaired place overall is dropped when map is full.
+ */
+
+int fault_map_record(struct fault_map *map, uint64_t region, uint32_t offset, uint8_t bit) {
+        size_t mask = map->hdr->capacity - 1;
+        size_t i, probes, nr = 0, oldest = 0;
+        struct fault_hint *h;
+
+        pthread_mutex_lock(&map->lock);
+        map->hdr->clock++;
+
+        for (probes = 0, i = hint_home(map, region); probes <= mask && map->slots[i].used;
+             probes++, i = (i + 1) & mask) {
+                h = &map->slots[i];
+                if (h->region != region)
+                        continue;
+                if (h->offset == offset && h->bit == bit) {
+                        h->hits++;
+                        h->stamp = map->hdr->clock;
+                        pthread_mutex_unlock(&map->lock);
+                        return 0;
+                }
+                if (!nr++ || h->stamp < map->slots[oldest].stamp)
+                        oldest = i;
+        }
+
+        /* Count of a damaged table may be low, a used slot means full too */
+        if (nr >= HINTS_PER_REGION || map->hdr->count >= map->limit || map->slots[i].used) {
+                if (nr >= HINTS_PER_REGION)
+                        hint_delete(map, oldest);
+                else
+                        hint_evict_lru(map);
+                /* Deletion may have shifted the probe sequence */
+                for (probes = 0, i = hint_home(map, region); probes <= mask && map->slots[i].used;
+                     probes++, i = (i + 1) & mask)
+                        ;
+        }
+
+        h = &map->slots[i];
+        h->region = region;
+        h->offset = offset;
+        h->bit = bit;
+        h->used = 1;
+        h->hits = 1;
+        h->stamp = map->hdr->clock;
+        map->hdr->count++;
+
+        pthread_mutex_unlock(&map->lock);
+        return 0;
+}
+
+void fault_map_close(struct fault_map *map) {
+        if (map->hdr) {
+                msync(map->hdr, map->map_len, MS_SYNC);
+                munmap(map->hdr, map->map_len);
+                pthread_mutex_destroy(&map->lock);
+        }
+        if (map->fd >= 0)
+                close(map->fd);
+        map->hdr = NULL;
+        map->slots = NULL;
+        map->fd = -1;
+}
+
+static pthread_once_t hint_pagemap_once = PTHREAD_ONCE_INIT;
+static int hint_pagemap_fd = -1;
+
+static void hint_pagemap_open(void) {
+        hint_pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+}
+
+/**
+ * hint_region - stable key of the page for the fault map
+ * @page - page address
+ *
+ * Physical frame number when pagemap exposes it (CAP_SYS_ADMIN),
+ * so faults follow the DRAM cell. Otherwise virtual page number with
+ * the top bit set, good while the mapping lives.
+ */
+
+uint64_t hint_region(const void *page) {
+        uint64_t entry;
+
+        pthread_once(&hint_pagemap_once, hint_pagemap_open);
+        if (hint_pagemap_fd >= 0 && !pagemap_read(hint_pagemap_fd, page, &entry, 1) &&
+            entry & PM_PRESENT && entry & PM_PFN_MASK)
+                return entry & PM_PFN_MASK;
+
+        return (uintptr_t) page / PAGE_SIZE | 1ULL << 63;
+}
@@ -0,0 +1,64 @@
+#ifndef HINTS_H
+#define HINTS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define HINTS_MAGIC 0x53544e4948544c46ULL /* "FLTHINTS" */
+#define HINTS_VERSION 1
+
+/* Entries kept per region, the least recently repaired one makes room */
+#define HINTS_PER_REGION 16
+
+/**
+ * struct fault_hint - place of one repaired fault
+ * @region - hint_region() of the damaged page
+ * @offset - byte offset of the fault inside of the page
+ * @bit - bit inside of the byte, 0 is least significant
+ * @hits - repairs at this place so far
+ * @stamp - map clock at last repair, for LRU eviction
+ */
+struct fault_hint {
+        uint64_t region;
+        uint32_t offset;
+        uint8_t bit;
+        uint8_t used;
+        uint16_t pad;
+        uint32_t hits;
+        uint32_t pad2;
+        uint64_t stamp;
+};
+
+struct fault_map_hdr {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint64_t clock;
+        uint64_t count;
+};
+
+/**
+ * struct fault_map - LRU bounded fault map backed by an mmap-ed file
+ *
+ * Open addressing table keyed by region, so all faults seen in one
+ * region are found by one probe sequence.
+ */
+struct fault_map {
+        struct fault_map_hdr *hdr;
+        struct fault_hint *slots;
+        size_t map_len;
+        /* Entries allowed before LRU eviction */
+        uint32_t limit;
+        int fd;
+        pthread_mutex_t lock;
+};
+
+int fault_map_open(struct fault_map *map, const char *path, uint32_t capacity);
+size_t fault_map_lookup(struct fault_map *map, uint64_t region, struct fault_hint *out, size_t max);
+int fault_map_record(struct fault_map *map, uint64_t region, uint32_t offset, uint8_t bit);
+void fault_map_close(struct fault_map *map);
+
+uint64_t hint_region(const void *page);
+
+#endif /* HINTS_H */
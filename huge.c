@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "huge.h"
+#include "crc32.h"
+
+/**
+ * huge_meta_init - compute protection values of a huge page
+ * @hm - record to fill
+ * @huge - HUGE_PAGE_SIZE bytes of data
+ *
+ * Sub-page records are computed as by page_meta_init(), the summary is
+ * combined from their CRCs without hashing the data again.
+ */
+
+void huge_meta_init(struct huge_meta *hm, const void *huge) {
+        const uint8_t *ptr = (const uint8_t *) huge;
+        uint32_t crc = 0;
+        size_t i;
+
+        for (i = 0; i < HUGE_SUBPAGES; i++) {
+                hm->sub[i].flags = 0;
+                page_meta_init(&hm->sub[i], ptr + i*PAGE_SIZE);
+                crc = i ? crc32c_combine(crc, hm->sub[i].crc, PAGE_SIZE) : hm->sub[i].crc;
+        }
+
+        hm->crc = crc;
+        hm->flags = PAGE_META_VALID;
+}
+
+/**
+ * huge_verify - check huge page against its summary CRC
+ * @hm - record filled by huge_meta_init()
+ * @huge - HUGE_PAGE_SIZE bytes of data
+ *
+ * One streaming pass, sub-page records are not touched.
+ * Returns PAGE_OK or PAGE_BAD.
+ */
+
+int huge_verify(const struct huge_meta *hm, const void *huge) {
+        if (!(hm->flags & PAGE_META_VALID))
+                return PAGE_OK;
+        if (crc32c(0, huge, HUGE_PAGE_SIZE) != hm->crc)
+                return PAGE_BAD;
+        return PAGE_OK;
+}
+
+/**
+ * huge_repair - fix a huge page which failed huge_verify()
+ * @hm - record filled by huge_meta_init()
+ * @huge - HUGE_PAGE_SIZE bytes of data, fixed in place
+ * @bad - output, sub-pages out of reach of repair, may be NULL
+ *
+ * Only sub-pages failing their own CRC go to page_repair(). When all
+ * of them are fine, the damage is in the stored summary, which is
+ * rebuilt from sub-page CRCs.
+ * Returns PAGE_REPAIRED or PAGE_BAD if any sub-page is out of reach.
+ */
+
+int huge_repair(struct huge_meta *hm, void *huge, size_t *bad) {
+        uint8_t *ptr = (uint8_t *) huge;
+        uint32_t crc = 0;
+        size_t i, nr_bad = 0;
+
+        for (i = 0; i < HUGE_SUBPAGES; i++) {
+                if (page_verify(&hm->sub[i], ptr + i*PAGE_SIZE) != PAGE_OK &&
+                    page_repair(&hm->sub[i], ptr + i*PAGE_SIZE) != PAGE_REPAIRED)
+                        nr_bad++;
+                crc = i ? crc32c_combine(crc, hm->sub[i].crc, PAGE_SIZE) : hm->sub[i].crc;
+        }
+
+        if (bad)
+                *bad = nr_bad;
+        if (nr_bad)
+                return PAGE_BAD;
+
+        hm->crc = crc;
+        hm->flags |= PAGE_META_REPAIRED;
+        return PAGE_REPAIRED;
+}
+
+/**
+ * huge_alloc - allocate one huge page
+ *
+ * Takes a page from hugetlbfs pool if there is one, otherwise maps
+ * 2 MiB aligned memory and asks for transparent huge page.
+ * Release with huge_free().
+ */
+
+void *huge_alloc(void) {
+        uint8_t *ptr, *aligned;
+        size_t head;
+
+        ptr = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED)
+                return ptr;
+
+        /* Over-map and trim to get 2 MiB alignment */
+        ptr = mmap(NULL, 2*HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+                return NULL;
+
+        aligned = (uint8_t *) (((uintptr_t) ptr + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+        head = aligned - ptr;
+        if (head)
+                munmap(ptr, head);
+        munmap(aligned + HUGE_PAGE_SIZE, HUGE_PAGE_SIZE - head);
+        madvise(aligned, HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+
+        return aligned;
+}
+
+void huge_free(void *huge) {
+        if (huge)
+                munmap(huge, HUGE_PAGE_SIZE);
+}
@@ -0,0 +1,30 @@
+#ifndef HUGE_H
+#define HUGE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "verify.h"
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define HUGE_SUBPAGES (HUGE_PAGE_SIZE / PAGE_SIZE)
+
+/**
+ * struct huge_meta - two level protection of one huge page
+ * @crc - crc32c() of the whole huge page, combined from @sub CRCs
+ * @flags - PAGE_META_* bits of the summary
+ * @sub - records of PAGE_SIZE sub-pages, used only on mismatch
+ */
+struct huge_meta {
+        uint32_t crc;
+        uint32_t flags;
+        struct page_meta sub[HUGE_SUBPAGES];
+};
+
+void huge_meta_init(struct huge_meta *hm, const void *huge);
+int huge_verify(const struct huge_meta *hm, const void *huge);
+int huge_repair(struct huge_meta *hm, void *huge, size_t *bad);
+void *huge_alloc(void);
+void huge_free(void *huge);
+
+#endif /* HUGE_H */
@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "merkle.h"
+#include "verify.h"
+#include "xxhash.h"
+#include "fixed.h"
+#include "pool.h"
+
+/* Levels above the leaves each pool task builds, log2(MERKLE_TASK_PAGES) */
+#define MERKLE_TASK_LEVELS (__builtin_ctz(MERKLE_TASK_PAGES))
+
+/**
+ * merkle_init - allocate tree for a buffer
+ * @t - tree
+ * @len - buffer length in bytes, not 0
+ *
+ * Nodes are not computed, see merkle_build().
+ */
+
+int merkle_init(struct merkle *t, size_t len) {
+        size_t nr, total = 0;
+        unsigned l = 0;
+
+        memset(t, 0, sizeof(*t));
+        if (!len)
+                return -EINVAL;
+
+        nr = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+        for (;;) {
+                t->off[l] = total;
+                t->nr[l] = nr;
+                total += nr;
+                l++;
+                if (nr == 1)
+                        break;
+                nr = (nr + 1) / 2;
+        }
+        t->levels = l;
+        t->len = len;
+        t->nodes = malloc(total * sizeof(*t->nodes));
+        return t->nodes ? 0 : -ENOMEM;
+}
+
+static inline uint64_t merkle_leaf(const struct merkle *t, const uint8_t *data, size_t page) {
+        const uint8_t *ptr = data + page * PAGE_SIZE;
+        size_t len = t->len - page * PAGE_SIZE;
+
+        if (len >= PAGE_SIZE && !((uintptr_t) ptr & 7))
+                return page_xxh64(ptr);
+        return xxh64_fixed(ptr, len < PAGE_SIZE ? len : PAGE_SIZE, 0);
+}
+
+static inline uint64_t merkle_parent(const struct merkle *t, unsigned l, size_t i) {
+        const uint64_t *child = &t->nodes[t->off[l - 1] + 2 * i];
+
+        return xxh64(child, 2 * i + 1 < t->nr[l - 1] ? 16 : 8, l);
+}
+
+/* Leaves [lo, hi) and their subtree up to level @top */
+static void merkle_build_range(struct merkle *t, const uint8_t *data, size_t lo, size_t hi,
+                               unsigned top) {
+        unsigned l;
+        size_t i;
+
+        for (i = lo; i < hi; i++)
+                t->nodes[i] = merkle_leaf(t, data, i);
+        for (l = 1; l <= top; l++) {
+                lo >>= 1;
+                hi = (hi + 1) >> 1;
+                for (i = lo; i < hi; i++)
+                        t->nodes[t->off[l] + i] = merkle_parent(t, l, i);
+        }
+}
+
+struct merkle_job {
+        struct merkle *t;
+        const uint8_t *data;
+        long pending;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+};
+
+struct merkle_task {
+        struct pool_task task;
+        struct merkle_job *job;
+        size_t first;
+};
+
+static void merkle_task_fn(struct pool_task *task) {
+        struct merkle_task *mt = pool_entry(task, struct merkle_task, task);
+        struct merkle_job *job = mt->job;
+        struct merkle *t = job->t;
+        size_t last = mt->first + MERKLE_TASK_PAGES;
+        unsigned top = MERKLE_TASK_LEVELS < t->levels - 1 ? MERKLE_TASK_LEVELS : t->levels - 1;
+
+        merkle_build_range(t, job->data, mt->first, last < t->nr[0] ? last : t->nr[0], top);
+
+        if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL))
+                return;
+        pthread_mutex_lock(&job->lock);
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * merkle_build - compute all nodes
+ * @t - tree from merkle_init()
+ * @data - buffer, t->len bytes
+ * @pool - workers, NULL to build on the caller
+ *
+ * Every pool task hashes MERKLE_TASK_PAGES leaves and the subtree
+ * above them, which depends on nothing else. Only the few levels above
+ * the subtrees are left to the caller. Builds on the caller if tasks
+ * can't be allocated.
+ */
+
+void merkle_build(struct merkle *t, const void *data, struct pool *pool) {
+        size_t nr_tasks = (t->nr[0] + MERKLE_TASK_PAGES - 1) / MERKLE_TASK_PAGES, i;
+        struct merkle_job job = { t, data, 0 };
+        struct merkle_task *tasks = NULL;
+        unsigned l;
+
+        if (pool && nr_tasks > 1)
+                tasks = calloc(nr_tasks, sizeof(*tasks));
+        if (!tasks) {
+                merkle_build_range(t, data, 0, t->nr[0], t->levels - 1);
+                return;
+        }
+
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.done, NULL);
+        job.pending = nr_tasks;
+        for (i = 0; i < nr_tasks; i++) {
+                tasks[i] = (struct merkle_task) { { merkle_task_fn }, &job, i * MERKLE_TASK_PAGES };
+                pool_submit(pool, &tasks[i].task);
+        }
+        pthread_mutex_lock(&job.lock);
+        while (__atomic_load_n(&job.pending, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&job.done, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        pthread_cond_destroy(&job.done);
+        pthread_mutex_destroy(&job.lock);
+        free(tasks);
+
+        for (l = MERKLE_TASK_LEVELS + 1; l < t->levels; l++)
+                for (i = 0; i < t->nr[l]; i++)
+                        t->nodes[t->off[l] + i] = merkle_parent(t, l, i);
+}
+
+/**
+ * merkle_update - rehash a changed page and its path to the root
+ * @t - tree
+ * @data - buffer
+ * @page - page index
+ */
+
+void merkle_update(struct merkle *t, const void *data, size_t page) {
+        unsigned l;
+
+        t->nodes[page] = merkle_leaf(t, data, page);
+        for (l = 1; l < t->levels; l++) {
+                page >>= 1;
+                t->nodes[t->off[l] + page] = merkle_parent(t, l, page);
+        }
+}
+
+/**
+ * merkle_update_pages - merkle_update() of many pages
+ * @t - tree
+ * @data - buffer
+ * @pages - changed page indexes, ascending
+ * @n - number of pages
+ *
+ * Level by level, so a parent shared by changed pages is hashed once.
+ * Returns 0 or -ENOMEM.
+ */
+
+int merkle_update_pages(struct merkle *t, const void *data, const size_t pages[], size_t n) {
+        size_t *idx, i, m;
+        unsigned l;
+
+        if (!n)
+                return 0;
+        idx = malloc(n * sizeof(*idx));
+        if (!idx)
+                return -ENOMEM;
+
+        for (i = 0; i < n; i++) {
+                idx[i] = pages[i];
+                t->nodes[idx[i]] = merkle_leaf(t, data, idx[i]);
+        }
+        for (l = 1; l < t->levels; l++) {
+                for (m = 0, i = 0; i < n; i++) {
+                        if (m && idx[m - 1] == idx[i] >> 1)
+                                continue;
+                        idx[m++] = idx[i] >> 1;
+                        t->nodes[t->off[l] + idx[m - 1]] = merkle_parent(t, l, idx[m - 1]);
+                }
+                n = m;
+        }
+
+        free(idx);
+        return 0;
+}
+
+/**
+ * merkle_check_page - verify one page against the root
+ * @t - tree
+ * @data - buffer
+ * @page - page index
+ *
+ * Page is hashed and combined with the sibling on every level, so the
+ * page and the stored path are checked in O(log n) hashes.
+ * Returns PAGE_OK or PAGE_BAD.
+ */
+
+int merkle_check_page(const struct merkle *t, const void *data, size_t page) {
+        uint64_t pair[2], h = merkle_leaf(t, data, page);
+        unsigned l;
+
+        for (l = 1; l < t->levels; l++) {
+                if (page & 1) {
+                        pair[0] = t->nodes[t->off[l - 1] + page - 1];
+                        pair[1] = h;
+                        h = xxh64(pair, 16, l);
+                } else if (page + 1 < t->nr[l - 1]) {
+                        pair[0] = h;
+                        pair[1] = t->nodes[t->off[l - 1] + page + 1];
+                        h = xxh64(pair, 16, l);
+                } else {
+                        h = xxh64(&h, 8, l);
+                }
+                page >>= 1;
+        }
+
+        return h == merkle_root(t) ? PAGE_OK : PAGE_BAD;
+}
+
+static void merkle_descend(const struct merkle *a, const struct merkle *b, unsigned l, size_t i,
+                           size_t bad[], size_t max, size_t *n) {
+        if (a->nodes[a->off[l] + i] == b->nodes[b->off[l] + i])
+                return;
+        if (!l) {
+                if (*n < max)
+                        bad[*n] = i;
+                (*n)++;
+                return;
+        }
+        merkle_descend(a, b, l - 1, 2 * i, bad, max, n);
+        if (2 * i + 1 < a->nr[l - 1])
+                merkle_descend(a, b, l - 1, 2 * i + 1, bad, max, n);
+}
+
+/**
+ * merkle_diff - pages whose hashes differ between two trees
+ * @a - tree
+ * @b - tree of a buffer with the same length
+ * @bad - output, differing page indexes, ascending
+ * @max - size of @bad
+ *
+ * Descends only into subtrees whose roots differ, k changed pages
+ * take O(k log n) compares. Returns number of differing pages, which
+ * may be more than @max.
+ */
+
+size_t merkle_diff(const struct merkle *a, const struct merkle *b, size_t bad[], size_t max) {
+        size_t n = 0;
+
+        if (a->len != b->len)
+                return 0;
+        merkle_descend(a, b, a->levels - 1, 0, bad, max, &n);
+        return n;
+}
+
+/**
+ * merkle_verify - find pages changed since the tree was built
+ * @t - tree
+ * @data - buffer
+ * @pool - workers for the rebuild, may be NULL
+ * @bad - output, changed page indexes, ascending
+ * @max - size of @bad
+ *
+ * Returns number of changed pages or -ENOMEM.
+ */
+
+long merkle_verify(const struct merkle *t, const void *data, struct pool *pool,
+                   size_t bad[], size_t max) {
+        struct merkle now;
+        long ret;
+
+        ret = merkle_init(&now, t->len);
+        if (ret)
+                return ret;
+        merkle_build(&now, data, pool);
+        ret = merkle_diff(t, &now, bad, max);
+        merkle_free(&now);
+        return ret;
+}
+
+void merkle_free(struct merkle *t) {
+        free(t->nodes);
+        t->nodes = NULL;
+}
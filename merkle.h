@@ -0,0 +1,48 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define MERKLE_MAX_LEVELS 64
+
+/* Leaves hashed by one pool task, with their subtree, power of two */
+#define MERKLE_TASK_PAGES 1024
+
+/**
+ * struct merkle - binary hash tree over the pages of a buffer
+ * @len - bytes covered, last page may be partial
+ * @levels - tree height, leaves are level 0, root is level @levels - 1
+ * @off - first node of each level in @nodes
+ * @nr - nodes of each level
+ * @nodes - all levels back to back, leaves first
+ *
+ * Leaf i is page_xxh64() of page i, node i of level l is xxh64() of
+ * nodes 2i and 2i + 1 of level l - 1 with seed l. A lone last child is
+ * hashed alone. The whole tree takes less than two words per page.
+ */
+struct merkle {
+        size_t len;
+        unsigned levels;
+        size_t off[MERKLE_MAX_LEVELS];
+        size_t nr[MERKLE_MAX_LEVELS];
+        uint64_t *nodes;
+};
+
+struct pool;
+
+static inline uint64_t merkle_root(const struct merkle *t) {
+        return t->nodes[t->off[t->levels - 1]];
+}
+
+int merkle_init(struct merkle *t, size_t len);
+void merkle_build(struct merkle *t, const void *data, struct pool *pool);
+void merkle_update(struct merkle *t, const void *data, size_t page);
+int merkle_update_pages(struct merkle *t, const void *data, const size_t pages[], size_t n);
+int merkle_check_page(const struct merkle *t, const void *data, size_t page);
+size_t merkle_diff(const struct merkle *a, const struct merkle *b, size_t bad[], size_t max);
+long merkle_verify(const struct merkle *t, const void *data, struct pool *pool,
+                   size_t bad[], size_t max);
+void merkle_free(struct merkle *t);
+
+#endif /* MERKLE_H */
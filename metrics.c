@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+const char *const metric_names[METRIC_KERNELS] = {
+        "crc32c", "fparity64", "xxh64", "verify",
+        "repair_bitflip", "repair_parity64", "repair_wide", "repair_lanes",
+        "repair_burst", "repair_erasure",
+};
+
+static size_t metrics_len(uint32_t max_threads) {
+        return sizeof(struct metrics_hdr) + (size_t) max_threads * sizeof(struct metric_slot);
+}
+
+#ifdef METRICS
+
+struct metrics_hdr *metrics_segment;
+__thread struct metric_slot *metric_slot;
+
+/**
+ * metrics_open - publish counters of this process in a shared file
+ * @path - file to create, e.g. under /dev/shm, replaced if it exists
+ *
+ * Call before threads start using the kernels, calls made with no
+ * segment open are not counted.
+ */
+
+int metrics_open(const char *path) {
+        size_t len = metrics_len(METRICS_MAX_THREADS);
+        struct metrics_hdr *hdr;
+        int fd, ret = 0;
+
+        if (metrics_segment)
+                return -EBUSY;
+        unlink(path);
+        fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644);
+        if (fd < 0)
+                return -errno;
+        if (ftruncate(fd, len)) {
+                ret = -errno;
+                goto out;
+        }
+        hdr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (hdr == MAP_FAILED) {
+                ret = -errno;
+                goto out;
+        }
+
+        hdr->version = METRICS_VERSION;
+        hdr->nr_kernels = METRIC_KERNELS;
+        hdr->lat_buckets = METRICS_LAT_BUCKETS;
+        hdr->max_threads = METRICS_MAX_THREADS;
+        hdr->pid = getpid();
+        /* Readers check magic last */
+        __atomic_store_n(&hdr->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+        __atomic_store_n(&metrics_segment, hdr, __ATOMIC_RELEASE);
+
+out:
+        close(fd);
+        return ret;
+}
+
+/**
+ * metrics_close - stop counting and unmap the segment
+ *
+ * File is left for readers. Call at exit, after all other threads
+ * using the kernels are gone: their slot pointers are not cleared.
+ */
+
+void metrics_close(void) {
+        struct metrics_hdr *hdr = __atomic_exchange_n(&metrics_segment, NULL, __ATOMIC_ACQ_REL);
+
+        if (hdr)
+                munmap(hdr, metrics_len(hdr->max_threads));
+        metric_slot = NULL;
+}
+
+/* Slow path of metric_record(), once per thread */
+struct metric_slot *metric_slot_claim(void) {
+        struct metrics_hdr *hdr = __atomic_load_n(&metrics_segment, __ATOMIC_ACQUIRE);
+        uint32_t idx;
+
+        if (!hdr)
+                return NULL;
+        idx = __atomic_fetch_add(&hdr->nr_slots, 1, __ATOMIC_RELAXED);
+        if (idx >= hdr->max_threads)
+                return NULL;
+        metric_slot = (struct metric_slot *) (hdr + 1) + idx;
+        return metric_slot;
+}
+
+#endif /* METRICS */
+
+/**
+ * metrics_attach - map counters published by metrics_open()
+ * @view - view
+ * @path - segment file
+ *
+ * Works on a live process, nothing is locked.
+ */
+
+int metrics_attach(struct metrics_view *view, const char *path) {
+        struct stat st;
+        void *mem;
+        int fd, ret = 0;
+
+        memset(view, 0, sizeof(*view));
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -errno;
+        if (fstat(fd, &st)) {
+                ret = -errno;
+                goto out;
+        }
+        if ((size_t) st.st_size < sizeof(struct metrics_hdr)) {
+                ret = -EINVAL;
+                goto out;
+        }
+
+        mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+                ret = -errno;
+                goto out;
+        }
+        view->hdr = mem;
+        view->slots = (const struct metric_slot *) (view->hdr + 1);
+        view->map_len = st.st_size;
+
+        if (__atomic_load_n(&view->hdr->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+            view->hdr->version != METRICS_VERSION || view->hdr->nr_kernels != METRIC_KERNELS ||
+            view->hdr->lat_buckets != METRICS_LAT_BUCKETS ||
+            view->map_len < metrics_len(view->hdr->max_threads)) {
+                fprintf(stderr, "metrics: %s is not a metrics segment\n", path);
+                metrics_detach(view);
+                ret = -EINVAL;
+        }
+
+out:
+        close(fd);
+        return ret;
+}
+
+/**
+ * metrics_sum - totals of one kernel over all threads
+ * @view - attached view
+ * @kernel - kernel
+ * @out - output
+ */
+
+void metrics_sum(const struct metrics_view *view, enum metric_kernel kernel,
+                 struct metric_counters *out) {
+        const volatile struct metric_counters *c;
+        uint32_t i, b, n = view->hdr->nr_slots;
+
+        memset(out, 0, sizeof(*out));
+        if (n > view->hdr->max_threads)
+                n = view->hdr->max_threads;
+        for (i = 0; i < n; i++) {
+                c = &view->slots[i].k[kernel];
+                out->calls += c->calls;
+                out->bytes += c->bytes;
+                out->failures += c->failures;
+                for (b = 0; b < METRICS_LAT_BUCKETS; b++)
+                        out->lat[b] += c->lat[b];
+        }
+}
+
+void metrics_detach(struct metrics_view *view) {
+        if (view->hdr)
+                munmap((void *) view->hdr, view->map_len);
+        view->hdr = NULL;
+}
@@ -0,0 +1,145 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+
+#define METRICS_MAGIC 0x005343495254454dULL /* "METRICS" */
+#define METRICS_VERSION 1
+
+/* Threads which get their own counters, later ones are not counted */
+#define METRICS_MAX_THREADS 256
+/* Latency bucket i holds [2^i, 2^(i+1)) ticks of metric_now() */
+#define METRICS_LAT_BUCKETS 40
+
+enum metric_kernel {
+        METRIC_CRC32C,
+        METRIC_FPARITY64,
+        METRIC_XXH64,
+        METRIC_VERIFY,
+        METRIC_REPAIR_BITFLIP,
+        METRIC_REPAIR_PARITY64,
+        METRIC_REPAIR_WIDE,
+        METRIC_REPAIR_LANES,
+        METRIC_REPAIR_BURST,
+        METRIC_REPAIR_ERASURE,
+        METRIC_KERNELS,
+};
+
+/**
+ * struct metric_counters - totals of one kernel
+ * @calls - number of calls
+ * @bytes - bytes processed
+ * @failures - pages failing verification, or repairs which did not fix
+ * @lat - latency histogram
+ */
+struct metric_counters {
+        uint64_t calls;
+        uint64_t bytes;
+        uint64_t failures;
+        uint64_t lat[METRICS_LAT_BUCKETS];
+};
+
+/* Counters of one thread, written by that thread only */
+struct metric_slot {
+        struct metric_counters k[METRIC_KERNELS];
+} __attribute__((aligned(64)));
+
+struct metrics_hdr {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t nr_kernels;
+        uint32_t lat_buckets;
+        uint32_t max_threads;
+        /* Slots handed out so far */
+        uint32_t nr_slots;
+        uint32_t pid;
+} __attribute__((aligned(64)));
+
+/**
+ * struct metrics_view - read only mapping of a metrics segment
+ *
+ * Slots are summed on read while writers go on, totals of a kernel may
+ * be a few calls apart from each other but never go back.
+ */
+struct metrics_view {
+        const struct metrics_hdr *hdr;
+        const struct metric_slot *slots;
+        size_t map_len;
+};
+
+extern const char *const metric_names[METRIC_KERNELS];
+
+int metrics_attach(struct metrics_view *view, const char *path);
+void metrics_sum(const struct metrics_view *view, enum metric_kernel kernel,
+                 struct metric_counters *out);
+void metrics_detach(struct metrics_view *view);
+
+#ifdef METRICS
+
+int metrics_open(const char *path);
+void metrics_close(void);
+struct metric_slot *metric_slot_claim(void);
+
+extern struct metrics_hdr *metrics_segment;
+extern __thread struct metric_slot *metric_slot;
+
+/* TSC cycles on x86, nanoseconds elsewhere */
+static inline uint64_t metric_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * metric_record - count one call in the calling thread's slot
+ * @kernel - kernel
+ * @bytes - bytes processed
+ * @start - metric_now() at entry
+ * @failures - failed pages or repairs of the call
+ *
+ * Plain increments, each slot has a single writer.
+ */
+static inline void metric_record(enum metric_kernel kernel, uint64_t bytes, uint64_t start,
+                                 uint64_t failures) {
+        struct metric_counters *c;
+        uint64_t cycles;
+        unsigned b;
+
+        if (!start || (__builtin_expect(!metric_slot, 0) && !metric_slot_claim()))
+                return;
+        c = &metric_slot->k[kernel];
+        cycles = metric_now() - start;
+        b = cycles ? 63 - __builtin_clzll(cycles) : 0;
+        c->calls++;
+        c->bytes += bytes;
+        c->failures += failures;
+        c->lat[b < METRICS_LAT_BUCKETS ? b : METRICS_LAT_BUCKETS - 1]++;
+}
+
+/* Clock is not read at all while no segment is open */
+#define METRIC_START(t) uint64_t t = metrics_segment ? metric_now() : 0
+#define METRIC_RECORD(kernel, bytes, t, failures) metric_record(kernel, bytes, t, failures)
+
+#else
+
+static inline int metrics_open(const char *path) {
+        return -ENOTSUP;
+}
+
+static inline void metrics_close(void) {
+}
+
+#define METRIC_START(t)
+#define METRIC_RECORD(kernel, bytes, t, failures) do { } while (0)
+
+#endif /* METRICS */
+
+#endif /* METRICS_H */
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "metrics.h"
+
+/*
+ * Print kernel counters of a process built with METRICS, read from its
+ * metrics segment while it runs. With an interval, rates over each
+ * interval are printed instead of totals.
+ */
+
+#define MSTAT_DEFAULT_PATH "/dev/shm/8byte_parity.metrics"
+
+/* Upper bound of the bucket holding quantile @q, in metric_now() ticks */
+static uint64_t lat_quantile(const struct metric_counters *c, double q) {
+        uint64_t seen = 0, want = c->calls * q;
+        int i;
+
+        for (i = 0; i < METRICS_LAT_BUCKETS; i++) {
+                seen += c->lat[i];
+                if (seen > want)
+                        return 2ULL << i;
+        }
+        return 2ULL << (METRICS_LAT_BUCKETS - 1);
+}
+
+static void delta(struct metric_counters *d, const struct metric_counters *now,
+                  const struct metric_counters *prev) {
+        int i;
+
+        d->calls = now->calls - prev->calls;
+        d->bytes = now->bytes - prev->bytes;
+        d->failures = now->failures - prev->failures;
+        for (i = 0; i < METRICS_LAT_BUCKETS; i++)
+                d->lat[i] = now->lat[i] - prev->lat[i];
+}
+
+static void report(const struct metrics_view *view, struct metric_counters prev[],
+                   unsigned interval) {
+        struct metric_counters now, d;
+        int k;
+
+        printf("%-16s %12s %12s %10s %12s %12s\n", "kernel", interval ? "calls/s" : "calls",
+               interval ? "MiB/s" : "MiB", "failures", "p50 ticks", "p99 ticks");
+        for (k = 0; k < METRIC_KERNELS; k++) {
+                metrics_sum(view, k, &now);
+                delta(&d, &now, &prev[k]);
+                prev[k] = now;
+                if (!d.calls)
+                        continue;
+                printf("%-16s %12.0f %12.1f %10" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+                       metric_names[k], (double) d.calls / (interval ? interval : 1),
+                       d.bytes / (1024.0 * 1024) / (interval ? interval : 1), d.failures,
+                       lat_quantile(&d, 0.5), lat_quantile(&d, 0.99));
+        }
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-i seconds] [-c count] [segment]\n"
+                "  segment defaults to " MSTAT_DEFAULT_PATH "\n",
+                prog);
+}
+
+int main(int argc, char **argv) {
+        static struct metric_counters prev[METRIC_KERNELS];
+        struct metrics_view view;
+        const char *path = MSTAT_DEFAULT_PATH;
+        unsigned interval = 0, count = 0, n;
+        int opt, ret;
+
+        while ((opt = getopt(argc, argv, "i:c:h")) != -1) {
+                switch (opt) {
+                case 'i':
+                        interval = strtoul(optarg, NULL, 0);
+                        break;
+                case 'c':
+                        count = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+        if (optind < argc)
+                path = argv[optind];
+
+        ret = metrics_attach(&view, path);
+        if (ret) {
+                fprintf(stderr, "mstat: %s: %s\n", path, strerror(-ret));
+                return 1;
+        }
+        printf("pid %u, threads %u\n", view.hdr->pid, view.hdr->nr_slots);
+
+        if (!interval) {
+                report(&view, prev, 0);
+                goto out;
+        }
+
+        /* First pass only primes @prev */
+        for (n = 0; n < METRIC_KERNELS; n++)
+                metrics_sum(&view, n, &prev[n]);
+        for (n = 0; !count || n < count; n++) {
+                sleep(interval);
+                report(&view, prev, interval);
+        }
+
+out:
+        metrics_detach(&view);
+        return 0;
+}
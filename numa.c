@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "numa.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+
+/* From linux/mempolicy.h */
+#define MPOL_PREFERRED 1
+
+/* Pages per move_pages() call */
+#define NODE_QUERY_BATCH 1024
+
+/* Parse "0-3,8,10-11" into mask, returns number of CPUs */
+static int cpulist_parse(const char *list, uint64_t *mask) {
+        unsigned long first, last, cpu;
+        char *end;
+        int nr = 0;
+
+        while (*list && *list != '\n') {
+                first = strtoul(list, &end, 10);
+                if (end == list)
+                        return -EINVAL;
+                last = first;
+                if (*end == '-') {
+                        list = end + 1;
+                        last = strtoul(list, &end, 10);
+                        if (end == list)
+                                return -EINVAL;
+                }
+                for (cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++) {
+                        mask[cpu / 64] |= 1ULL << (cpu % 64);
+                        nr++;
+                }
+                list = *end == ',' ? end + 1 : end;
+        }
+
+        return nr;
+}
+
+static int node_read_cpus(struct numa_topo *topo, int idx) {
+        char path[128], buf[4096];
+        FILE *f;
+        int nr;
+
+        snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", topo->node_id[idx]);
+        f = fopen(path, "r");
+        if (!f)
+                return -errno;
+        if (!fgets(buf, sizeof(buf), f)) {
+                fclose(f);
+                return -EIO;
+        }
+        fclose(f);
+
+        nr = cpulist_parse(buf, topo->cpumask[idx]);
+        if (nr < 0)
+                return nr;
+        topo->nr_cpus[idx] = nr;
+        return 0;
+}
+
+/**
+ * numa_topo_init - discover NUMA nodes with CPUs from sysfs
+ * @topo - output, nodes sorted by id
+ *
+ * Memory-only nodes are skipped. Without sysfs, whole machine is
+ * reported as single node 0.
+ */
+
+int numa_topo_init(struct numa_topo *topo) {
+        struct dirent *de;
+        DIR *dir;
+        int i, j, id, ret;
+
+        memset(topo, 0, sizeof(*topo));
+
+        dir = opendir(NODE_DIR);
+        while (dir && (de = readdir(dir)) && topo->nr_nodes < NUMA_MAX_NODES) {
+                if (sscanf(de->d_name, "node%d", &id) != 1)
+                        continue;
+                /* Keep sorted by id, readdir() order is arbitrary */
+                for (i = topo->nr_nodes; i > 0 && topo->node_id[i - 1] > id; i--)
+                        topo->node_id[i] = topo->node_id[i - 1];
+                topo->node_id[i] = id;
+                topo->nr_nodes++;
+        }
+        if (dir)
+                closedir(dir);
+
+        for (i = 0, j = 0; i < topo->nr_nodes; i++) {
+                topo->node_id[j] = topo->node_id[i];
+                ret = node_read_cpus(topo, j);
+                if (ret || !topo->nr_cpus[j]) {
+                        memset(topo->cpumask[j], 0, sizeof(topo->cpumask[j]));
+                        topo->nr_cpus[j] = 0;
+                        continue;
+                }
+                j++;
+        }
+        topo->nr_nodes = j;
+
+        if (!topo->nr_nodes) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                topo->nr_nodes = 1;
+                topo->node_id[0] = 0;
+                for (i = 0; i < cpus && i < NUMA_MAX_CPUS; i++)
+                        topo->cpumask[0][i / 64] |= 1ULL << (i % 64);
+                topo->nr_cpus[0] = i;
+        }
+
+        return 0;
+}
+
+/* Index in topology of kernel node @node_id or -1 */
+int numa_topo_index(const struct numa_topo *topo, int node_id) {
+        int i;
+
+        for (i = 0; i < topo->nr_nodes; i++)
+                if (topo->node_id[i] == node_id)
+                        return i;
+        return -1;
+}
+
+/**
+ * numa_pin_thread - restrict calling thread to CPUs of one node
+ * @topo - topology
+ * @idx - node index in @topo
+ */
+
+int numa_pin_thread(const struct numa_topo *topo, int idx) {
+        cpu_set_t set;
+        int cpu;
+
+        CPU_ZERO(&set);
+        for (cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+                if (topo->cpumask[idx][cpu / 64] & 1ULL << (cpu % 64))
+                        CPU_SET(cpu, &set);
+
+        return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+ * numa_page_nodes - find node holding each page
+ * @pages - page addresses
+ * @nodes - output, kernel node id or negative errno, -ENOENT if not faulted in
+ * @n - number of pages
+ */
+
+int numa_page_nodes(void *const pages[], int nodes[], size_t n) {
+        size_t i, count;
+        long ret;
+
+        for (i = 0; i < n; i += count) {
+                count = n - i;
+                if (count > NODE_QUERY_BATCH)
+                        count = NODE_QUERY_BATCH;
+                /* Without target nodes move_pages() only reports placement */
+                ret = syscall(SYS_move_pages, 0, count, &pages[i], NULL, &nodes[i], 0);
+                if (ret < 0)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+/**
+ * numa_alloc_local - allocate memory placed on a given node
+ * @len - size in bytes
+ * @node_id - kernel node id, negative for default policy
+ *
+ * Policy is preferred, not strict: a full node falls back to others
+ * instead of failing. Release with numa_free().
+ */
+
+void *numa_alloc_local(size_t len, int node_id) {
+        unsigned long mask[2] = { 0, 0 };
+        void *ptr;
+
+        ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+                return NULL;
+
+        if (node_id >= 0 && node_id < 64) {
+                mask[0] = 1UL << node_id;
+                /* Kernel wants one more than the number of mask bits.
+                 * On failure first touch from a pinned thread still does it. */
+                syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, mask, 65, 0);
+        }
+
+        return ptr;
+}
+
+void numa_free(void *ptr, size_t len) {
+        if (ptr)
+                munmap(ptr, len);
+}
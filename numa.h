@@ -0,0 +1,29 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+/**
+ * struct numa_topo - NUMA nodes and their CPUs, as seen in sysfs
+ * @node_id - kernel node number of each discovered node
+ * @cpumask - CPUs of each node, bit per CPU
+ */
+struct numa_topo {
+        int nr_nodes;
+        int node_id[NUMA_MAX_NODES];
+        int nr_cpus[NUMA_MAX_NODES];
+        uint64_t cpumask[NUMA_MAX_NODES][NUMA_MAX_CPUS/64];
+};
+
+int numa_topo_init(struct numa_topo *topo);
+int numa_topo_index(const struct numa_topo *topo, int node_id);
+int numa_pin_thread(const struct numa_topo *topo, int idx);
+int numa_page_nodes(void *const pages[], int nodes[], size_t n);
+void *numa_alloc_local(size_t len, int node_id);
+void numa_free(void *ptr, size_t len);
+
+#endif /* NUMA_H */
@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "parity.h"
+#include "crc32.h"
+#include "xxhash.h"
+#include "fixed.h"
+#include "pool.h"
+
+/*
+ * Checksum files in parallel: every file is mapped once and cut into
+ * ranges, ranges are hashed by pool workers and their CRC32C are
+ * combined in order. xxh64 cannot be combined, it is one streaming task
+ * per file running next to the range tasks.
+ *
+ * Manifest lines are "<crc32c> <xxh64> <size> <path>", optionally
+ * followed by "P <page> <crc32c> <fparity64>" records of each page.
+ */
+
+#define PAGESUM_RANGE (16ULL << 20)
+#define PAGESUM_MAX_BAD_PAGES 16
+
+/* Record of one page, last page of a file is zero padded for parity */
+struct page_rec {
+        uint32_t crc;
+        uint64_t parity;
+};
+
+struct ps_file {
+        const char *path;
+        uint64_t size;
+        const uint8_t *map;
+        uint32_t crc;
+        uint64_t xxh;
+        struct page_rec *pages;
+        /* Per range CRC32C, combined once all ranges are done */
+        uint32_t *range_crc;
+        uint64_t nr_ranges;
+        int err;
+        /* Expected values in check mode */
+        int has_expect;
+        uint32_t want_crc;
+        uint64_t want_xxh;
+        uint64_t want_size;
+        struct page_rec *want_pages;
+        uint64_t nr_want_pages;
+};
+
+struct ps_job {
+        struct pool *pool;
+        uint64_t range;
+        int with_pages;
+        long pending;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+};
+
+struct ps_task {
+        struct pool_task task;
+        struct ps_job *job;
+        struct ps_file *f;
+        /* Range index, or -1 for the xxh64 pass */
+        int64_t idx;
+};
+
+static void job_put(struct ps_job *job) {
+        if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL))
+                return;
+        pthread_mutex_lock(&job->lock);
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->lock);
+}
+
+static void page_record(struct page_rec *rec, const uint8_t *page, uint64_t len) {
+        uint8_t pad[PAGE_SIZE] __attribute__((aligned(8)));
+
+        if (len == PAGE_SIZE && !((uintptr_t) page & 7)) {
+                rec->crc = crc32c_fixed(0, page, PAGE_SIZE);
+                rec->parity = fparity64_fixed(page, PAGE_SIZE, 0);
+                return;
+        }
+        memset(pad, 0, sizeof(pad));
+        memcpy(pad, page, len);
+        rec->crc = crc32c(0, page, len);
+        rec->parity = fparity64_fixed(pad, PAGE_SIZE, 0);
+}
+
+static void range_task_fn(struct pool_task *task) {
+        struct ps_task *t = pool_entry(task, struct ps_task, task);
+        struct ps_file *f = t->f;
+        uint64_t off = t->idx * t->job->range;
+        uint64_t len = f->size - off < t->job->range ? f->size - off : t->job->range;
+        uint64_t p, first = off / PAGE_SIZE;
+        uint32_t crc = 0;
+        uint64_t n;
+
+        madvise((void *) (f->map + off), len, MADV_SEQUENTIAL);
+        if (!t->job->with_pages) {
+                crc = crc32c(0, f->map + off, len);
+        } else {
+                /* Page CRCs are folded into the range CRC, data is read once */
+                for (p = 0; p * PAGE_SIZE < len; p++) {
+                        n = len - p * PAGE_SIZE < PAGE_SIZE ? len - p * PAGE_SIZE : PAGE_SIZE;
+                        page_record(&f->pages[first + p], f->map + off + p * PAGE_SIZE, n);
+                        crc = p ? crc32c_combine(crc, f->pages[first + p].crc, n) :
+                                  f->pages[first + p].crc;
+                }
+        }
+        f->range_crc[t->idx] = crc;
+        job_put(t->job);
+}
+
+static void xxh_task_fn(struct pool_task *task) {
+        struct ps_task *t = pool_entry(task, struct ps_task, task);
+
+        t->f->xxh = xxh64_fixed(t->f->map, t->f->size, 0);
+        job_put(t->job);
+}
+
+static int file_open(struct ps_file *f, uint64_t range, int with_pages) {
+        struct stat st;
+        int fd, ret = 0;
+
+        fd = open(f->path, O_RDONLY);
+        if (fd < 0)
+                return -errno;
+        if (fstat(fd, &st)) {
+                ret = -errno;
+                goto out;
+        }
+        if (!S_ISREG(st.st_mode)) {
+                ret = -EINVAL;
+                goto out;
+        }
+
+        f->size = st.st_size;
+        f->nr_ranges = (f->size + range - 1) / range;
+        if (!f->size)
+                goto out;
+        f->map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (f->map == MAP_FAILED) {
+                f->map = NULL;
+                ret = -errno;
+                goto out;
+        }
+        f->range_crc = calloc(f->nr_ranges, sizeof(*f->range_crc));
+        if (with_pages)
+                f->pages = calloc((f->size + PAGE_SIZE - 1) / PAGE_SIZE, sizeof(*f->pages));
+        if (!f->range_crc || (with_pages && !f->pages))
+                ret = -ENOMEM;
+
+out:
+        close(fd);
+        return ret;
+}
+
+static void file_close(struct ps_file *f) {
+        if (f->map)
+                munmap((void *) f->map, f->size);
+        free(f->range_crc);
+        free(f->pages);
+        free(f->want_pages);
+        f->map = NULL;
+        f->range_crc = NULL;
+        f->pages = f->want_pages = NULL;
+}
+
+/**
+ * pagesum_run - hash all files on a pool
+ * @job - pool and options
+ * @files - files, results are stored back
+ * @n - number of files
+ *
+ * Every file gets one xxh64 task and one task per range. xxh64 tasks
+ * are long, they go in as heavy so idle workers pick them up first.
+ */
+
+static void pagesum_run(struct ps_job *job, struct ps_file files[], size_t n) {
+        struct ps_task **tasks;
+        uint64_t r, len;
+        size_t i;
+
+        tasks = calloc(n, sizeof(*tasks));
+        if (!tasks) {
+                for (i = 0; i < n; i++)
+                        files[i].err = -ENOMEM;
+                return;
+        }
+
+        job->pending = 1;
+        for (i = 0; i < n; i++) {
+                struct ps_file *f = &files[i];
+
+                f->err = file_open(f, job->range, job->with_pages);
+                if (f->err || !f->size) {
+                        f->xxh = xxh64(NULL, 0, 0);
+                        continue;
+                }
+                tasks[i] = calloc(f->nr_ranges + 1, sizeof(**tasks));
+                if (!tasks[i]) {
+                        f->err = -ENOMEM;
+                        continue;
+                }
+                __atomic_add_fetch(&job->pending, f->nr_ranges + 1, __ATOMIC_RELAXED);
+                tasks[i][0] = (struct ps_task) { { xxh_task_fn }, job, f, -1 };
+                pool_submit_heavy(job->pool, &tasks[i][0].task);
+                for (r = 0; r < f->nr_ranges; r++) {
+                        tasks[i][r + 1] = (struct ps_task) { { range_task_fn }, job, f, r };
+                        pool_submit(job->pool, &tasks[i][r + 1].task);
+                }
+        }
+
+        job_put(job);
+        pthread_mutex_lock(&job->lock);
+        while (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&job->done, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+
+        for (i = 0; i < n; i++) {
+                struct ps_file *f = &files[i];
+
+                free(tasks[i]);
+                if (f->err || !f->size)
+                        continue;
+                f->crc = f->range_crc[0];
+                for (r = 1; r < f->nr_ranges; r++) {
+                        len = f->size - r * job->range < job->range ? f->size - r * job->range : job->range;
+                        f->crc = crc32c_combine(f->crc, f->range_crc[r], len);
+                }
+        }
+        free(tasks);
+}
+
+static void print_file(const struct ps_file *f) {
+        uint64_t p;
+
+        printf("%08" PRIx32 " %016" PRIx64 " %" PRIu64 " %s\n", f->crc, f->xxh, f->size, f->path);
+        if (!f->pages)
+                return;
+        for (p = 0; p * PAGE_SIZE < f->size; p++)
+                printf("P %" PRIu64 " %08" PRIx32 " %016" PRIx64 "\n", p, f->pages[p].crc,
+                       f->pages[p].parity);
+}
+
+/* Returns 0 if file matches its manifest entry */
+static int check_file(const struct ps_file *f) {
+        uint64_t p, nr_pages, bad = 0;
+
+        if (f->size != f->want_size) {
+                printf("%s: FAILED, size %" PRIu64 " expected %" PRIu64 "\n", f->path, f->size,
+                       f->want_size);
+                return -1;
+        }
+        if (f->crc == f->want_crc && f->xxh == f->want_xxh) {
+                printf("%s: OK\n", f->path);
+                return 0;
+        }
+
+        printf("%s: FAILED\n", f->path);
+        nr_pages = (f->size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (!f->pages || f->nr_want_pages != nr_pages)
+                return -1;
+        /* Page records tell which pages to restore */
+        for (p = 0; p < nr_pages; p++) {
+                if (f->pages[p].crc == f->want_pages[p].crc &&
+                    f->pages[p].parity == f->want_pages[p].parity)
+                        continue;
+                if (bad++ < PAGESUM_MAX_BAD_PAGES)
+                        printf("%s: page %" PRIu64 " at 0x%" PRIx64 " differs\n", f->path, p,
+                               p * PAGE_SIZE);
+        }
+        if (bad > PAGESUM_MAX_BAD_PAGES)
+                printf("%s: %" PRIu64 " pages differ\n", f->path, bad);
+        return -1;
+}
+
+/**
+ * manifest_read - load files and expected values of a manifest
+ * @path - manifest, "-" for stdin
+ * @files - output, array of files
+ * @with_pages - output, set if any entry has page records
+ *
+ * Returns number of files or negative errno.
+ */
+
+static long manifest_read(const char *path, struct ps_file **files, int *with_pages) {
+        FILE *in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+        struct ps_file *f = NULL, *tmp, *cur = NULL;
+        struct page_rec *recs;
+        char *line = NULL, *name;
+        size_t cap = 0, n = 0, alloc = 0;
+        uint64_t page, parity;
+        uint32_t crc;
+        long ret;
+        int off;
+
+        if (!in)
+                return -errno;
+
+        while (getline(&line, &cap, in) > 0) {
+                line[strcspn(line, "\n")] = 0;
+                if (!line[0] || line[0] == '#')
+                        continue;
+
+                if (line[0] == 'P' && line[1] == ' ') {
+                        if (!cur || sscanf(line, "P %" SCNu64 " %" SCNx32 " %" SCNx64, &page, &crc,
+                                           &parity) != 3 || page != cur->nr_want_pages)
+                                goto bad;
+                        /* Capacity doubles whenever page + 1 is a power of two */
+                        if (!(page & (page + 1))) {
+                                recs = realloc(cur->want_pages, 2 * (page + 1) * sizeof(*recs));
+                                if (!recs) {
+                                        ret = -ENOMEM;
+                                        goto err;
+                                }
+                                cur->want_pages = recs;
+                        }
+                        cur->want_pages[page] = (struct page_rec) { crc, parity };
+                        cur->nr_want_pages++;
+                        *with_pages = 1;
+                        continue;
+                }
+
+                if (n == alloc) {
+                        alloc = alloc ? alloc * 2 : 64;
+                        tmp = realloc(f, alloc * sizeof(*f));
+                        if (!tmp) {
+                                ret = -ENOMEM;
+                                goto err;
+                        }
+                        f = tmp;
+                }
+                cur = &f[n];
+                memset(cur, 0, sizeof(*cur));
+                if (sscanf(line, "%" SCNx32 " %" SCNx64 " %" SCNu64 " %n", &cur->want_crc,
+                           &cur->want_xxh, &cur->want_size, &off) != 3 || !line[off])
+                        goto bad;
+                name = strdup(line + off);
+                if (!name) {
+                        ret = -ENOMEM;
+                        goto err;
+                }
+                cur->path = name;
+                cur->has_expect = 1;
+                n++;
+        }
+
+        free(line);
+        if (in != stdin)
+                fclose(in);
+        *files = f;
+        return n;
+
+bad:
+        fprintf(stderr, "pagesum: %s: bad line: %s\n", path, line);
+        ret = -EINVAL;
+err:
+        while (n--) {
+                free((void *) f[n].path);
+                free(f[n].want_pages);
+        }
+        free(f);
+        free(line);
+        if (in != stdin)
+                fclose(in);
+        return ret;
+}
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-j jobs] [-p] [-r MiB] file...\n"
+                "       %s [-j jobs] -c manifest\n"
+                "  -j, --jobs   worker threads (default online CPUs)\n"
+                "  -p, --pages  also print CRC32C and fparity64 of every page\n"
+                "  -r, --range  MiB of a file hashed by one task (default 16)\n"
+                "  -c, --check  verify files of a manifest, \"-\" for stdin\n",
+                prog, prog);
+}
+
+static const struct option long_options[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "pages", no_argument, NULL, 'p' },
+        { "range", required_argument, NULL, 'r' },
+        { "check", required_argument, NULL, 'c' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+};
+
+int main(int argc, char **argv) {
+        struct ps_job job = { .range = PAGESUM_RANGE };
+        struct ps_file *files = NULL;
+        const char *manifest = NULL;
+        struct pool pool;
+        unsigned jobs = 0;
+        uint64_t start, bytes = 0;
+        long n, i;
+        int opt, ret, failed = 0;
+
+        while ((opt = getopt_long(argc, argv, "j:pr:c:h", long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'j':
+                        jobs = strtoul(optarg, NULL, 0);
+                        break;
+                case 'p':
+                        job.with_pages = 1;
+                        break;
+                case 'r':
+                        job.range = strtoull(optarg, NULL, 0) << 20;
+                        break;
+                case 'c':
+                        manifest = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+        if (!job.range || (!manifest && optind == argc) || (manifest && optind != argc)) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (manifest) {
+                n = manifest_read(manifest, &files, &job.with_pages);
+                if (n < 0) {
+                        fprintf(stderr, "pagesum: %s: %s\n", manifest, strerror(-n));
+                        return 1;
+                }
+        } else {
+                n = argc - optind;
+                files = calloc(n, sizeof(*files));
+                if (!files)
+                        return 1;
+                for (i = 0; i < n; i++)
+                        files[i].path = argv[optind + i];
+        }
+
+        ret = pool_init(&pool, jobs);
+        if (ret) {
+                fprintf(stderr, "pagesum: pool: %s\n", strerror(-ret));
+                return 1;
+        }
+        job.pool = &pool;
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.done, NULL);
+
+        start = now_ns();
+        pagesum_run(&job, files, n);
+        start = now_ns() - start;
+
+        for (i = 0; i < n; i++) {
+                if (files[i].err) {
+                        fprintf(stderr, "pagesum: %s: %s\n", files[i].path, strerror(-files[i].err));
+                        if (manifest)
+                                printf("%s: FAILED open or read\n", files[i].path);
+                        failed = 1;
+                } else if (manifest) {
+                        failed |= check_file(&files[i]) ? 1 : 0;
+                } else {
+                        print_file(&files[i]);
+                }
+                bytes += files[i].size;
+                file_close(&files[i]);
+                if (manifest)
+                        free((void *) files[i].path);
+        }
+        fprintf(stderr, "pagesum: %ld files, %.1f MiB in %.3f s, %.1f MiB/s, %u threads\n", n,
+                bytes / (1024.0 * 1024), start / 1e9, start ? bytes * 1e9 / start / (1024 * 1024) : 0,
+                pool.nr_workers);
+
+        pool_destroy(&pool);
+        free(files);
+        return failed;
+}
@@ -0,0 +1,746 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "parity.h"
+#include "crc32.h"
+#include "fixed.h"
+#include "xxhash.h"
+#include "metrics.h"
+#include "pool.h"
+
+/**
+ * fparity32 - use several registres for computing data 32-bit parity
+ * @data - input data stream
+ * @byte_len - input data lengh in bytes
+ * @seed - for altering parity value
+ */
+
+uint32_t fparity32(const void *data, uint64_t byte_len, uint64_t seed) {
+        uint32_t p1 = 0, p2 = 0, p3 = 0, p4 = 0;
+        uint32_t *ptr = (uint32_t *) data;
+        uint64_t index, index_end;
+        uint32_t ret = 0;
+
+        if (byte_len%sizeof(ret)) {
+                printf("Data size must be aligned to: %lu\n", sizeof(ret));
+                return -1;
+        }
+
+        index_end = byte_len/sizeof(ret);
+
+        for (index = 0; index < index_end;) {
+                switch ((index_end - index)%4) {
+                        case 0:
+                                p1 ^= ptr[index++];
+                                p2 ^= ptr[index++];
+                                p3 ^= ptr[index++];
+                                p4 ^= ptr[index++];
+                        break;
+                        case 1:
+                                p1 ^= ptr[index++];
+                        break;
+                        case 2:
+                                p1 ^= ptr[index++];
+                                p2 ^= ptr[index++];
+                        break;
+                        case 3:
+                                p1 ^= ptr[index++];
+                                p2 ^= ptr[index++];
+                                p3 ^= ptr[index++];
+                        break;
+                }
+        }
+
+        ret = p1 ^ p2 ^ p3 ^ p4 ^ seed;
+
+        return ret;
+}
+
+/**
+ * fparity64 - use several registres for computing data 64-bit parity
+ * @data - input data stream
+ * @byte_len - input data lengh in bytes
+ * @seed - for altering parity value
+ */
+
+uint64_t fparity64(const void *data, uint64_t byte_len, uint64_t seed) {
+        uint64_t p1 = 0, p2 = 0, p3 = 0, p4 = 0;
+        uint64_t *ptr = (uint64_t *) data;
+        uint64_t index, index_end;
+        uint64_t ret = 0;
+        METRIC_START(start);
+
+        if (byte_len%sizeof(ret)) {
+                printf("Data size must be aligned to: %lu\n", sizeof(ret));
+                return -1;
+        }
+
+        index_end = byte_len/sizeof(ret);
+
+        for (index = 0; index < index_end;) {
+                switch ((index_end - index)%4) {
+                        case 0:
+                                p1 ^= ptr[index++];
+                                p2 ^= ptr[index++];
+                                p3 ^= ptr[index++];
+                                p4 ^= ptr[index++];
+                        break;
+                        case 1:
+                                p1 ^= ptr[index++];
+                        break;
+                        case 2:
+                                p1 ^= ptr[index++];
+                                p2 ^= ptr[index++];
+                        break;
+                        case 3:
+                                p1 ^= ptr[index++];
+                                p2 ^= ptr[index++];
+                                p3 ^= ptr[index++];
+                        break;
+                }
+        }
+
+        ret = p1 ^ p2 ^ p3 ^ p4 ^ seed;
+        METRIC_RECORD(METRIC_FPARITY64, byte_len, start, 0);
+
+        return ret;
+}
+
+/**
+ * fparity64_fill - fparity64() fused with constant page detection
+ * @data - input data stream
+ * @byte_len - input data lengh in bytes
+ * @seed - for altering parity value
+ * @parity - output, fparity64() of data, NULL to only detect
+ * @fill - output, repeated 8 byte pattern of a constant page
+ *
+ * Cache lines are compared to the first word until the first one
+ * which differs, parity is computed from there on only: any number of
+ * whole equal lines XOR to zero. Returns 1 for a constant page, else 0.
+ */
+
+int fparity64_fill(const void *data, uint64_t byte_len, uint64_t seed,
+                   uint64_t *parity, uint64_t *fill) {
+        const uint64_t *ptr = (const uint64_t *) data;
+        const uint64_t *end = ptr + byte_len/sizeof(*ptr);
+        uint64_t first = ptr[0];
+        uint64_t diff;
+
+        if (byte_len % 64 || !byte_len) {
+                if (parity)
+                        *parity = fparity64(data, byte_len, seed);
+                return 0;
+        }
+
+        for (; ptr < end; ptr += 8) {
+                diff = (ptr[0] ^ first) | (ptr[1] ^ first) |
+                       (ptr[2] ^ first) | (ptr[3] ^ first) |
+                       (ptr[4] ^ first) | (ptr[5] ^ first) |
+                       (ptr[6] ^ first) | (ptr[7] ^ first);
+                if (diff)
+                        break;
+        }
+
+        if (ptr == end) {
+                *fill = first;
+                if (parity)
+                        *parity = seed;
+                return 1;
+        }
+
+        if (parity)
+                *parity = fparity64(ptr, (end - ptr)*sizeof(*ptr), seed);
+        return 0;
+}
+
+static int64_t stripe_repair(void *data, uint64_t byte_len, uint64_t parity, uint32_t crc) {
+        uint64_t *ptr = (uint64_t *) data;
+        uint64_t stripe_num = byte_len/sizeof(parity);
+        uint64_t syndrome;
+        uint64_t i;
+
+        syndrome = fparity64(data, byte_len, parity);
+        if (!syndrome)
+                return -1;
+
+        /* Damage is syndrome wide, try it on each stripe in turn */
+        for (i = 0; i < stripe_num; i++) {
+                ptr[i] ^= syndrome;
+                if (crc32c_fixed(0, data, byte_len) == crc)
+                        return i*sizeof(parity);
+                ptr[i] ^= syndrome;
+        }
+
+        return -1;
+}
+
+int64_t fparity64_repair(void *data, uint64_t byte_len, uint64_t parity, uint32_t crc) {
+        METRIC_START(start);
+        int64_t ret = stripe_repair(data, byte_len, parity, crc);
+
+        METRIC_RECORD(METRIC_REPAIR_PARITY64, byte_len, start, ret < 0);
+        return ret;
+}
+
+/* Widths of fparity_wide(): 8, 16, 32 or 64 bytes */
+#define WIDE_MIN 8
+#define WIDE_MAX 64
+#define WIDE_NR 4
+
+/*
+ * Wide stripes are XORed as 16 byte pieces, which baseline x86-64 has
+ * registers for, vector_size(32/64) is split into slow piecewise code
+ * there. Two stripes per step, each piece with its own accumulator, so
+ * 2*W/16 independent XORs hide the load latency.
+ */
+#define FPARITY_WIDE(W) \
+static void fparity_wide_##W(const uint8_t *ptr, uint64_t byte_len, void *parity) { \
+        typedef uint64_t vec __attribute__((vector_size(16))); \
+        vec acc[2*(W)/16] = { 0 }, v; \
+        uint64_t i, j; \
+        \
+        for (i = 0; i + 2*(W) <= byte_len; i += 2*(W)) { \
+                _Pragma("GCC unroll 8") \
+                for (j = 0; j < 2*(W)/16; j++) { \
+                        memcpy(&v, ptr + i + j*16, 16); \
+                        acc[j] ^= v; \
+                } \
+        } \
+        if (i < byte_len) { \
+                _Pragma("GCC unroll 8") \
+                for (j = 0; j < (W)/16; j++) { \
+                        memcpy(&v, ptr + i + j*16, 16); \
+                        acc[j] ^= v; \
+                } \
+        } \
+        _Pragma("GCC unroll 8") \
+        for (j = 0; j < (W)/16; j++) \
+                acc[j] ^= acc[j + (W)/16]; \
+        memcpy(parity, acc, W); \
+}
+
+FPARITY_WIDE(16)
+FPARITY_WIDE(32)
+FPARITY_WIDE(64)
+
+static inline int wide_index(unsigned width) {
+        switch (width) {
+        case 8: return 0;
+        case 16: return 1;
+        case 32: return 2;
+        case 64: return 3;
+        }
+        return -1;
+}
+
+/**
+ * fparity_wide - XOR of all @width byte stripes of data
+ * @data - input data stream
+ * @byte_len - input data lengh in bytes, multiple of @width
+ * @width - parity width, 8, 16, 32 or 64 bytes
+ * @parity - output, @width bytes
+ *
+ * Width 8 is fparity64() with seed 0. Wider parity rebuilds any burst
+ * up to @width bytes long, see fparity_wide_repair().
+ */
+
+int fparity_wide(const void *data, uint64_t byte_len, unsigned width, void *parity) {
+        uint64_t p;
+
+        if (wide_index(width) < 0 || byte_len % width || !byte_len)
+                return -EINVAL;
+
+        switch (width) {
+        case 8:
+                p = fparity64_fixed(data, byte_len, 0);
+                memcpy(parity, &p, sizeof(p));
+                break;
+        case 16:
+                fparity_wide_16(data, byte_len, parity);
+                break;
+        case 32:
+                fparity_wide_32(data, byte_len, parity);
+                break;
+        case 64:
+                fparity_wide_64(data, byte_len, parity);
+                break;
+        }
+
+        return 0;
+}
+
+/* Tables to move a raw CRC register over @width zero bytes */
+static pthread_once_t wide_shift_once = PTHREAD_ONCE_INIT;
+static uint32_t wide_shift[WIDE_NR][4][256];
+
+static void wide_shift_init(void) {
+        unsigned i;
+
+        for (i = 0; i < WIDE_NR; i++)
+                crc32c_zeros_table(wide_shift[i], WIDE_MIN << i);
+}
+
+static inline uint32_t wide_shift_apply(uint32_t zeros[][256], uint32_t crc) {
+        return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+               zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static int64_t wide_repair(void *data, uint64_t byte_len, unsigned width,
+                           const void *parity, uint32_t crc) {
+        uint8_t *ptr = (uint8_t *) data;
+        uint8_t syn[WIDE_MAX], rot[WIDE_MAX];
+        uint32_t (*zeros)[256];
+        uint32_t target, v;
+        uint64_t stripes, k, p, o, i;
+        int idx = wide_index(width);
+
+        if (idx < 0 || fparity_wide(data, byte_len, width, syn))
+                return -1;
+
+        v = 0;
+        for (i = 0; i < width; i++) {
+                syn[i] ^= ((const uint8_t *) parity)[i];
+                v |= syn[i];
+        }
+        if (!v)
+                return -1;
+
+        pthread_once(&wide_shift_once, wide_shift_init);
+        zeros = wide_shift[idx];
+        target = crc32c_fixed(0, data, byte_len) ^ crc;
+        stripes = byte_len / width;
+
+        /* Aligned stripes first, then bursts crossing a stripe boundary */
+        for (p = 0; p < width; p++) {
+                for (i = 0; i < width; i++)
+                        rot[i] = syn[(p + i) % width];
+
+                /* Raw CRC of the window ending the page, register starts at 0 */
+                v = crc32c(0xffffffff, rot, width) ^ 0xffffffff;
+                if (p)
+                        v = crc32c_shift_zeros(v, width - p);
+
+                for (k = p ? stripes - 1 : stripes; k-- > 0; ) {
+                        if (v == target) {
+                                o = k*width + p;
+                                for (i = 0; i < width; i++)
+                                        ptr[o + i] ^= rot[i];
+                                if (crc32c_fixed(0, data, byte_len) == crc)
+                                        return o;
+                                for (i = 0; i < width; i++)
+                                        ptr[o + i] ^= rot[i];
+                        }
+                        v = wide_shift_apply(zeros, v);
+                }
+        }
+
+        return -1;
+}
+
+/**
+ * fparity_wide_repair - rebuild one damaged burst from wide parity
+ * @data - page with a single burst of damage, fixed in place
+ * @byte_len - page length in bytes, multiple of @width
+ * @width - parity width, 8, 16, 32 or 64 bytes
+ * @parity - fparity_wide() of the page before damage
+ * @crc - crc32c() of the page before damage
+ *
+ * Any burst of up to @width bytes, aligned or not, leaves the damage
+ * itself as syndrome, rotated by the burst offset. CRC is linear, so
+ * the CRC change of putting the syndrome at each offset is found by
+ * shifting one CRC over zeros instead of rehashing the page: O(page)
+ * in total, the full CRC is recomputed only to confirm a match.
+ * Returns byte offset of the rebuilt @width bytes or -1.
+ */
+
+int64_t fparity_wide_repair(void *data, uint64_t byte_len, unsigned width,
+                            const void *parity, uint32_t crc) {
+        METRIC_START(start);
+        int64_t ret = wide_repair(data, byte_len, width, parity, crc);
+
+        METRIC_RECORD(METRIC_REPAIR_WIDE, byte_len, start, ret < 0);
+        return ret;
+}
+
+static inline __attribute__((always_inline))
+void lanes_acc(const uint64_t *ptr, uint64_t words, unsigned lanes, uint64_t *acc) {
+        uint64_t i;
+        unsigned j;
+
+        for (i = 0; i < words; i += lanes)
+                for (j = 0; j < lanes; j++)
+                        acc[j] ^= ptr[i + j];
+}
+
+/**
+ * fparity64_lanes - interleaved 64-bit parity
+ * @data - input data stream
+ * @byte_len - input data lengh in bytes, multiple of 8 * @lanes
+ * @lanes - number of parity words, 1 .. PARITY_MAX_LANES
+ * @parity - output, @lanes words, word j covers stripes j, j + @lanes, ...
+ *
+ * One lane is fparity64() with seed 0. Each lane rebuilds one damaged
+ * stripe, see fparity64_lanes_repair().
+ */
+
+int fparity64_lanes(const void *data, uint64_t byte_len, unsigned lanes, uint64_t *parity) {
+        const uint64_t *ptr = (const uint64_t *) data;
+        uint64_t acc[PARITY_MAX_LANES] = { 0 };
+        uint64_t words = byte_len/sizeof(*ptr);
+
+        if (!lanes || lanes > PARITY_MAX_LANES || byte_len % (sizeof(*ptr) * lanes))
+                return -EINVAL;
+
+        /* Constant lane counts keep accumulators in registers */
+        switch (lanes) {
+        case 1:
+                acc[0] = fparity64_fixed(data, byte_len, 0);
+                break;
+        case 2:
+                lanes_acc(ptr, words, 2, acc);
+                break;
+        case 4:
+                lanes_acc(ptr, words, 4, acc);
+                break;
+        case 8:
+                lanes_acc(ptr, words, 8, acc);
+                break;
+        default:
+                lanes_acc(ptr, words, lanes, acc);
+        }
+
+        memcpy(parity, acc, lanes * sizeof(*parity));
+        return 0;
+}
+
+/* log2 of candidate combinations CRC32C alone may pick from, 1/1024 false match */
+#define LANES_CRC_MAX_BITS 22
+
+/* Combinations a meet-in-the-middle side may enumerate */
+#define LANES_MITM_MAX (1 << 20)
+
+struct lanes_search {
+        uint64_t *ptr;
+        uint64_t byte_len;
+        unsigned lanes;
+        uint32_t crc;
+        const uint64_t *xxh;
+        /* Damaged lanes and their syndromes */
+        unsigned bad[PARITY_MAX_LANES];
+        uint64_t syn[PARITY_MAX_LANES];
+        unsigned nr_bad;
+        /* Candidate stripes per lane */
+        uint64_t n;
+        /* contrib[l][k] - raw CRC change of fixing stripe k of lane bad[l] */
+        uint32_t *contrib[PARITY_MAX_LANES];
+        uint64_t pick[PARITY_MAX_LANES];
+        /* Node local buffer of a pool worker and its bytes handed out */
+        uint8_t *scratch;
+        size_t used;
+};
+
+/* Buffers of a search come from pool scratch on a worker, from malloc() elsewhere */
+static void *lanes_alloc(struct lanes_search *s, size_t size) {
+        void *buf;
+
+        if (s->scratch && size <= POOL_SCRATCH_SIZE - s->used) {
+                buf = s->scratch + s->used;
+                /* Keep buffers cache line aligned */
+                s->used += (size + 63) & ~(size_t) 63;
+                if (s->used > POOL_SCRATCH_SIZE)
+                        s->used = POOL_SCRATCH_SIZE;
+                return buf;
+        }
+        return malloc(size);
+}
+
+static void lanes_release(struct lanes_search *s, void *buf) {
+        if (!s->scratch || (uint8_t *) buf < s->scratch ||
+            (uint8_t *) buf >= s->scratch + POOL_SCRATCH_SIZE)
+                free(buf);
+}
+
+/* XOR of contributions of one combination of lanes first .. last - 1 */
+static uint32_t lanes_sum(struct lanes_search *s, unsigned first, unsigned last, uint64_t combo) {
+        uint32_t sum = 0;
+        unsigned l;
+
+        for (l = first; l < last; l++) {
+                s->pick[l] = combo % s->n;
+                combo /= s->n;
+                sum ^= s->contrib[l][s->pick[l]];
+        }
+        return sum;
+}
+
+static void lanes_apply(struct lanes_search *s) {
+        unsigned l;
+
+        for (l = 0; l < s->nr_bad; l++)
+                s->ptr[s->pick[l] * s->lanes + s->bad[l]] ^= s->syn[l];
+}
+
+/* Fix picked stripes and confirm by full checksums, undo on mismatch */
+static int lanes_try(struct lanes_search *s) {
+        lanes_apply(s);
+        if (crc32c_fixed(0, s->ptr, s->byte_len) == s->crc &&
+            (!s->xxh || xxh64_fixed(s->ptr, s->byte_len, 0) == *s->xxh))
+                return 1;
+        lanes_apply(s);
+        return 0;
+}
+
+static uint64_t lanes_combos(uint64_t n, unsigned lanes) {
+        uint64_t c = 1;
+
+        while (lanes--) {
+                if (c > LANES_MITM_MAX / n)
+                        return 0;
+                c *= n;
+        }
+        return c;
+}
+
+struct lanes_entry {
+        uint32_t sum;
+        uint32_t combo;
+};
+
+static int lanes_mitm(struct lanes_search *s, uint32_t target) {
+        unsigned half = s->nr_bad / 2;
+        uint64_t nr_a = lanes_combos(s->n, half);
+        uint64_t nr_b = lanes_combos(s->n, s->nr_bad - half);
+        struct lanes_entry *table;
+        uint64_t size, mask, a, b, i;
+        uint32_t want;
+        int ret = -1;
+
+        if (!nr_a || !nr_b)
+                return -1;
+
+        for (size = 1; size < nr_a * 2; size <<= 1)
+                ;
+        mask = size - 1;
+        table = lanes_alloc(s, size * sizeof(*table));
+        if (!table)
+                return -1;
+        memset(table, 0, size * sizeof(*table));
+
+        /* Combo is stored plus one, zero marks an empty slot */
+        for (a = 0; a < nr_a; a++) {
+                uint32_t sum = lanes_sum(s, 0, half, a);
+
+                for (i = (sum * 0x9e3779b1U) & mask; table[i].combo; i = (i + 1) & mask)
+                        ;
+                table[i].sum = sum;
+                table[i].combo = a + 1;
+        }
+
+        for (b = 0; b < nr_b && ret < 0; b++) {
+                want = target ^ lanes_sum(s, half, s->nr_bad, b);
+                for (i = (want * 0x9e3779b1U) & mask; table[i].combo; i = (i + 1) & mask) {
+                        if (table[i].sum != want)
+                                continue;
+                        lanes_sum(s, 0, half, table[i].combo - 1);
+                        if (lanes_try(s)) {
+                                ret = 0;
+                                break;
+                        }
+                }
+        }
+
+        lanes_release(s, table);
+        return ret;
+}
+
+static int lanes_repair(void *data, uint64_t byte_len, unsigned lanes,
+                        const uint64_t *parity, uint32_t crc, const uint64_t *xxh) {
+        struct lanes_search s = { .ptr = data, .byte_len = byte_len, .lanes = lanes,
+                                  .crc = crc, .xxh = xxh, .scratch = pool_scratch() };
+        uint64_t cur[PARITY_MAX_LANES];
+        uint32_t (*zeros)[256] = NULL;
+        uint32_t target, v;
+        unsigned j, l;
+        uint64_t k;
+        int ret = -1;
+
+        if (fparity64_lanes(data, byte_len, lanes, cur))
+                return -1;
+
+        for (j = 0; j < lanes; j++) {
+                if (cur[j] == parity[j])
+                        continue;
+                s.bad[s.nr_bad] = j;
+                s.syn[s.nr_bad] = cur[j] ^ parity[j];
+                s.nr_bad++;
+        }
+        if (!s.nr_bad)
+                return -1;
+
+        s.n = byte_len / (sizeof(uint64_t) * lanes);
+        /* Without @xxh the CRC must leave a margin over the candidates */
+        if (!xxh && s.n > 1 && s.nr_bad * (64 - __builtin_clzll(s.n - 1)) > LANES_CRC_MAX_BITS)
+                return -1;
+        zeros = lanes_alloc(&s, sizeof(uint32_t[4][256]));
+        if (!zeros)
+                return -1;
+        crc32c_zeros_table(zeros, sizeof(uint64_t) * lanes);
+
+        for (l = 0; l < s.nr_bad; l++) {
+                s.contrib[l] = lanes_alloc(&s, s.n * sizeof(uint32_t));
+                if (!s.contrib[l])
+                        goto out;
+                /* Last stripe of the lane, then one lane period back each step */
+                v = crc32c(0xffffffff, &s.syn[l], sizeof(uint64_t)) ^ 0xffffffff;
+                v = crc32c_shift_zeros(v, sizeof(uint64_t) * (lanes - 1 - s.bad[l]));
+                for (k = s.n; k-- > 0; ) {
+                        s.contrib[l][k] = v;
+                        v = wide_shift_apply(zeros, v);
+                }
+        }
+
+        target = crc32c_fixed(0, data, byte_len) ^ crc;
+
+        if (s.nr_bad == 1) {
+                for (k = 0; k < s.n; k++) {
+                        if (s.contrib[0][k] != target)
+                                continue;
+                        s.pick[0] = k;
+                        if (lanes_try(&s)) {
+                                ret = 0;
+                                break;
+                        }
+                }
+        } else {
+                ret = lanes_mitm(&s, target);
+        }
+        if (!ret)
+                ret = s.nr_bad;
+
+out:
+        for (l = 0; l < s.nr_bad; l++)
+                lanes_release(&s, s.contrib[l]);
+        lanes_release(&s, zeros);
+        return ret;
+}
+
+/**
+ * fparity64_lanes_repair - rebuild damaged stripes from interleaved parity
+ * @data - page, fixed in place
+ * @byte_len - page length in bytes, multiple of 8 * @lanes
+ * @lanes - number of parity words
+ * @parity - fparity64_lanes() of the page before damage
+ * @crc - crc32c() of the page before damage
+ * @xxh - xxh64() of the page before damage, seed 0, or NULL
+ *
+ * Up to one damaged stripe per lane is rebuilt. Lanes with nonzero
+ * syndrome are damaged, CRC linearity gives the CRC change of fixing
+ * each candidate stripe without rehashing, and combinations over lanes
+ * are matched meet-in-the-middle against the CRC difference. Matches
+ * are confirmed by full CRC32C and @xxh; with many damaged lanes 32 bits
+ * of CRC alone leave several candidates, then @xxh picks the right one.
+ * Without @xxh such damage is refused rather than risking a wrong fix.
+ * Returns number of rebuilt stripes or -1.
+ */
+
+int fparity64_lanes_repair(void *data, uint64_t byte_len, unsigned lanes,
+                           const uint64_t *parity, uint32_t crc, const uint64_t *xxh) {
+        METRIC_START(start);
+        int ret = lanes_repair(data, byte_len, lanes, parity, crc, xxh);
+
+        METRIC_RECORD(METRIC_REPAIR_LANES, byte_len, start, ret < 0);
+        return ret;
+}
+
+/* CRC-32C polynomial, reversed, as in crc32.c */
+#define BURST_POLY 0x82f63b78
+
+static int64_t burst_repair(void *data, uint64_t byte_len, uint32_t crc, unsigned max_bits,
+                            const uint64_t *parity) {
+        uint8_t *ptr = (uint8_t *) data;
+        uint64_t nr_bits = byte_len * 8, t, bit = 0, fold, v;
+        uint32_t r, limit, pattern = 0, want[64];
+        unsigned found = 0, k;
+
+        if (!max_bits || max_bits > 32 || (parity && byte_len % sizeof(*parity)))
+                return -1;
+        r = crc32c(0, data, byte_len) ^ crc;
+        if (!r)
+                return -1;
+        limit = max_bits == 32 ? UINT32_MAX : (1U << max_bits) - 1;
+
+        /*
+         * A burst folds into the parity syndrome as its pattern rotated
+         * to the bit offset inside its stripe, so with parity the only
+         * pattern possible at each offset is known up front. Zero never
+         * matches, the register of a nonzero syndrome stays nonzero.
+         */
+        if (parity) {
+                fold = fparity64(data, byte_len, *parity);
+                for (k = 0; k < 64; k++) {
+                        v = k ? fold >> k | fold << (64 - k) : fold;
+                        want[k] = v <= limit && v & 1 ? v : 0;
+                }
+        }
+
+        /*
+         * Syndrome of a burst starting at bit q is x^(n - q) * pattern
+         * mod P, so stepping the register back one zero bit at a time
+         * leaves the pattern itself, odd and below 2^max_bits, after
+         * n - q steps.
+         */
+        for (t = 1; t <= nr_bits; t++) {
+                r = r & 0x80000000 ? ((r ^ BURST_POLY) << 1) | 1 : r << 1;
+                if (parity ? r != want[(nr_bits - t) % 64] : r > limit || !(r & 1))
+                        continue;
+                if (nr_bits - t + 32 - __builtin_clz(r) > nr_bits)
+                        continue;
+                /* Several bursts explain the syndrome, no way to tell which */
+                if (found++)
+                        return -1;
+                bit = nr_bits - t;
+                pattern = r;
+        }
+        if (!found)
+                return -1;
+
+        for (k = 0; k < 32; k++)
+                if (pattern >> k & 1)
+                        ptr[(bit + k) / 8] ^= 1 << (bit + k) % 8;
+        if (crc32c(0, data, byte_len) == crc)
+                return bit / 8;
+        for (k = 0; k < 32; k++)
+                if (pattern >> k & 1)
+                        ptr[(bit + k) / 8] ^= 1 << (bit + k) % 8;
+        return -1;
+}
+
+/**
+ * crc32c_burst_repair - correct one burst of flipped bits by CRC32C syndrome
+ * @data - damaged memory, fixed in place
+ * @byte_len - length in bytes
+ * @crc - crc32c() of the data before damage
+ * @max_bits - longest burst to look for, 1 to 32 bits
+ * @parity - fparity64() of the data before damage, seed 0, or NULL
+ *
+ * Burst location comes from the syndrome alone in one pass of n bit
+ * steps, no rehashing. Any damage matches some burst of up to @max_bits
+ * with chance about n * 2^(@max_bits - 33), so on 4 KiB without
+ * @parity keep to BURST_CRC_BITS. @parity rules chance matches out and
+ * makes bursts up to 32 bits safe, also ones crossing stripes which
+ * fparity64_repair() can't rebuild. Ambiguous matches are refused.
+ * Returns byte offset of the first damaged byte or -1.
+ */
+
+int64_t crc32c_burst_repair(void *data, uint64_t byte_len, uint32_t crc, unsigned max_bits,
+                            const uint64_t *parity) {
+        METRIC_START(start);
+        int64_t ret = burst_repair(data, byte_len, crc, max_bits, parity);
+
+        METRIC_RECORD(METRIC_REPAIR_BURST, byte_len, start, ret < 0);
+        return ret;
+}
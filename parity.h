@@ -0,0 +1,44 @@
+#ifndef PARITY_H
+#define PARITY_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE (4*1024)
+#endif
+
+uint32_t fparity32(const void *data, uint64_t byte_len, uint64_t seed);
+uint64_t fparity64(const void *data, uint64_t byte_len, uint64_t seed);
+int fparity64_fill(const void *data, uint64_t byte_len, uint64_t seed,
+                   uint64_t *parity, uint64_t *fill);
+
+/**
+ * fparity64_repair - rebuild one corrupted 8-byte stripe from stored parity
+ * @data - page with a single damaged stripe, fixed in place
+ * @byte_len - page length in bytes, multiple of 8
+ * @parity - fparity64() of the page before damage, seed 0
+ * @crc - crc32c() of the page before damage, used to confirm the fix
+ *
+ * Returns byte offset of the rebuilt stripe or -1 if no stripe matched.
+ */
+int64_t fparity64_repair(void *data, uint64_t byte_len, uint64_t parity, uint32_t crc);
+
+int fparity_wide(const void *data, uint64_t byte_len, unsigned width, void *parity);
+int64_t fparity_wide_repair(void *data, uint64_t byte_len, unsigned width,
+                            const void *parity, uint32_t crc);
+
+/* Parity words of fparity64_lanes() */
+#define PARITY_MAX_LANES 16
+
+int fparity64_lanes(const void *data, uint64_t byte_len, unsigned lanes, uint64_t *parity);
+int fparity64_lanes_repair(void *data, uint64_t byte_len, unsigned lanes,
+                           const uint64_t *parity, uint32_t crc, const uint64_t *xxh);
+
+/* Longest burst crc32c_burst_repair() finds without parity on a page */
+#define BURST_CRC_BITS 8
+
+int64_t crc32c_burst_repair(void *data, uint64_t byte_len, uint32_t crc, unsigned max_bits,
+                            const uint64_t *parity);
+
+#endif /* PARITY_H */
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "policy.h"
+#include "xxhash.h"
+
+/**
+ * verify_tier_init - set up policy engine state for one thread
+ * @t - state
+ * @policy - policy to follow
+ * @seed - sampling seed, nonzero
+ */
+
+void verify_tier_init(struct verify_tier *t, const struct verify_policy *policy, uint64_t seed) {
+        memset(t, 0, sizeof(*t));
+        t->policy = *policy;
+        t->rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint64_t xorshift64(uint64_t *state) {
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+static int tier_escalate(struct verify_tier *t) {
+        const struct verify_policy *p = &t->policy;
+
+        t->count++;
+        if (p->period && t->count % p->period == 0)
+                return 1;
+        if (p->sample && (xorshift64(&t->rng) & 0xffff) < p->sample)
+                return 1;
+        return 0;
+}
+
+/* Returns PAGE_OK or PAGE_BAD */
+static int tier_strong(struct verify_tier *t, const struct page_meta *meta,
+                       const void *page, const uint64_t *xxh) {
+        t->stats.strong++;
+        if (t->policy.strong & VERIFY_STRONG_CRC && page_crc32c(page) != meta->crc)
+                goto fail;
+        if (t->policy.strong & VERIFY_STRONG_XXH && xxh && page_xxh64(page) != *xxh)
+                goto fail;
+        return PAGE_OK;
+
+fail:
+        t->stats.strong_fail++;
+        return PAGE_BAD;
+}
+
+/**
+ * page_verify_tiered - verify page by parity, escalate per policy
+ * @t - per thread state
+ * @meta - stored protection values
+ * @page - PAGE_SIZE bytes of data, repaired in place
+ * @xxh - stored xxh64() of the page or NULL
+ *
+ * Sampling or period escalate to the strong checks, failed strong
+ * check goes to page_repair(). Parity mismatch is always checked by
+ * CRC32C, and by xxh64 too when the policy asks for it.
+ * Returns PAGE_OK, PAGE_REPAIRED or PAGE_BAD.
+ */
+
+int page_verify_tiered(struct verify_tier *t, struct page_meta *meta, void *page, const uint64_t *xxh) {
+        uint64_t parity, fill;
+        int ret;
+
+        if (!(meta->flags & PAGE_META_VALID))
+                return PAGE_OK;
+
+        t->stats.reads++;
+        fparity64_fill(page, PAGE_SIZE, 0, &parity, &fill);
+
+        if (parity == meta->parity) {
+                if (!tier_escalate(t) || tier_strong(t, meta, page, xxh) == PAGE_OK)
+                        return PAGE_OK;
+        } else {
+                t->stats.parity_fail++;
+                /*
+                 * Stored parity is only replaced once CRC32C vouches for the
+                 * data, whatever the policy enables: a policy without strong
+                 * checks must not turn corruption into new parity.
+                 */
+                t->stats.strong++;
+                if (page_crc32c(page) == meta->crc &&
+                    (!(t->policy.strong & VERIFY_STRONG_XXH) || !xxh || page_xxh64(page) == *xxh)) {
+                        meta->parity = parity;
+                        return PAGE_REPAIRED;
+                }
+                t->stats.strong_fail++;
+        }
+
+        ret = page_repair(meta, page);
+        if (ret == PAGE_REPAIRED)
+                t->stats.repaired++;
+        else
+                t->stats.bad++;
+        return ret;
+}
+
+/**
+ * verify_policy_coverage - estimate what the policy catches
+ * @policy - policy
+ * @c - output
+ *
+ * CRC32C catches any error of up to 3 bits at page size and misses
+ * other patterns with 2^-32 probability, parity misses patterns which
+ * flip every bit column an even number of times.
+ */
+
+void verify_policy_coverage(const struct verify_policy *policy, struct verify_coverage *c) {
+        double s, miss;
+
+        s = 1.0 - (1.0 - policy->sample / 65536.0) *
+                  (1.0 - (policy->period ? 1.0 / policy->period : 0.0));
+        if (!(policy->strong & (VERIFY_STRONG_CRC|VERIFY_STRONG_XXH)))
+                s = 0;
+
+        miss = 1.0;
+        if (policy->strong & VERIFY_STRONG_CRC)
+                miss *= 1.0 / 4294967296.0;
+        if (policy->strong & VERIFY_STRONG_XXH)
+                miss *= 1.0 / 18446744073709551616.0;
+
+        c->strong_fraction = s;
+        c->single_bit = 1.0;
+        c->single_stripe = 1.0;
+        /* Parity is blind when both bits share a column, CRC never is */
+        c->double_bit = 63.0/64.0 + 1.0/64.0 * (policy->strong & VERIFY_STRONG_CRC ? s : s * (1.0 - miss));
+        /* Same damage in two stripes cancels out in parity */
+        c->twin_stripes = s * (1.0 - miss);
+        c->scribble = 1.0 - (1.0 / 18446744073709551616.0) * (1.0 - s * (1.0 - miss));
+}
+
+void verify_policy_report(const struct verify_policy *policy, FILE *out) {
+        struct verify_coverage c;
+
+        verify_policy_coverage(policy, &c);
+        fprintf(out, "Policy: sample %.4f%%, period %u, strong:%s%s\n",
+                policy->sample * 100.0 / 65536, policy->period,
+                policy->strong & VERIFY_STRONG_CRC ? " crc32c" : "",
+                policy->strong & VERIFY_STRONG_XXH ? " xxh64" : "");
+        fprintf(out, "Strong checks on %.4f%% of clean reads\n", c.strong_fraction * 100);
+        fprintf(out, "Detection: 1 bit %.6f, 1 stripe %.6f, 2 bits %.6f, twin stripes %.6f, scribble %.6f\n",
+                c.single_bit, c.single_stripe, c.double_bit, c.twin_stripes, c.scribble);
+}
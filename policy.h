@@ -0,0 +1,65 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "verify.h"
+
+/* Strong check compares CRC32C from struct page_meta */
+#define VERIFY_STRONG_CRC (1 << 0)
+/* Strong check also compares xxh64, if caller stores it */
+#define VERIFY_STRONG_XXH (1 << 1)
+
+/**
+ * struct verify_policy - when to go past the parity check
+ * @sample - fraction of reads to check strongly, in 1/65536 units
+ * @period - check every @period-th read strongly, 0 for never
+ * @strong - VERIFY_STRONG_* checks to run on escalation
+ *
+ * Parity mismatch always escalates.
+ */
+struct verify_policy {
+        uint32_t sample;
+        uint32_t period;
+        unsigned strong;
+};
+
+struct verify_tier_stats {
+        uint64_t reads;
+        uint64_t parity_fail;
+        uint64_t strong;
+        uint64_t strong_fail;
+        uint64_t repaired;
+        uint64_t bad;
+};
+
+/* Per thread state of the policy engine */
+struct verify_tier {
+        struct verify_policy policy;
+        uint64_t rng;
+        uint64_t count;
+        struct verify_tier_stats stats;
+};
+
+/**
+ * struct verify_coverage - estimated detection probability per fault class
+ *
+ * Single bit and single stripe faults are always caught by parity.
+ * Other classes depend on the fraction of strong checks.
+ */
+struct verify_coverage {
+        double strong_fraction;
+        double single_bit;
+        double single_stripe;
+        double double_bit;
+        double twin_stripes;
+        double scribble;
+};
+
+void verify_tier_init(struct verify_tier *t, const struct verify_policy *policy, uint64_t seed);
+int page_verify_tiered(struct verify_tier *t, struct page_meta *meta, void *page, const uint64_t *xxh);
+void verify_policy_coverage(const struct verify_policy *policy, struct verify_coverage *c);
+void verify_policy_report(const struct verify_policy *policy, FILE *out);
+
+#endif /* POLICY_H */
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define DEQUE_INIT_SIZE 256
+
+/* Worker running on current thread, NULL outside of pool */
+static __thread struct pool_worker *pool_self;
+
+static int deque_init(struct pool_deque *dq) {
+        memset(dq, 0, sizeof(*dq));
+        dq->ring = malloc(DEQUE_INIT_SIZE * sizeof(*dq->ring));
+        if (!dq->ring)
+                return -ENOMEM;
+        dq->mask = DEQUE_INIT_SIZE - 1;
+        pthread_spin_init(&dq->lock, PTHREAD_PROCESS_PRIVATE);
+        return 0;
+}
+
+static void deque_free(struct pool_deque *dq) {
+        pthread_spin_destroy(&dq->lock);
+        free(dq->ring);
+        dq->ring = NULL;
+}
+
+/* Called with lock held, doubles the ring keeping order */
+static int deque_grow(struct pool_deque *dq) {
+        size_t size = dq->mask + 1;
+        struct pool_task **ring;
+        size_t i;
+
+        ring = malloc(2 * size * sizeof(*ring));
+        if (!ring)
+                return -ENOMEM;
+        for (i = 0; i < size; i++)
+                ring[i] = dq->ring[(dq->head + i) & dq->mask];
+        free(dq->ring);
+        dq->ring = ring;
+        dq->head = 0;
+        dq->tail = size;
+        dq->mask = 2 * size - 1;
+        return 0;
+}
+
+static int deque_push_tail(struct pool_deque *dq, struct pool_task *task) {
+        int ret = 0;
+
+        pthread_spin_lock(&dq->lock);
+        if (dq->tail - dq->head > dq->mask)
+                ret = deque_grow(dq);
+        if (!ret)
+                dq->ring[dq->tail++ & dq->mask] = task;
+        pthread_spin_unlock(&dq->lock);
+        return ret;
+}
+
+static int deque_push_head(struct pool_deque *dq, struct pool_task *task) {
+        int ret = 0;
+
+        pthread_spin_lock(&dq->lock);
+        if (dq->tail - dq->head > dq->mask)
+                ret = deque_grow(dq);
+        if (!ret)
+                dq->ring[--dq->head & dq->mask] = task;
+        pthread_spin_unlock(&dq->lock);
+        return ret;
+}
+
+static struct pool_task *deque_pop_tail(struct pool_deque *dq) {
+        struct pool_task *task = NULL;
+
+        pthread_spin_lock(&dq->lock);
+        if (dq->tail != dq->head)
+                task = dq->ring[--dq->tail & dq->mask];
+        pthread_spin_unlock(&dq->lock);
+        return task;
+}
+
+static struct pool_task *deque_steal(struct pool_deque *dq) {
+        struct pool_task *task = NULL;
+
+        /* Unlocked peek, don't bounce lock of a busy worker for nothing */
+        if (__atomic_load_n(&dq->tail, __ATOMIC_RELAXED) ==
+            __atomic_load_n(&dq->head, __ATOMIC_RELAXED))
+                return NULL;
+
+        pthread_spin_lock(&dq->lock);
+        if (dq->tail != dq->head)
+                task = dq->ring[dq->head++ & dq->mask];
+        pthread_spin_unlock(&dq->lock);
+        return task;
+}
+
+static struct pool_task *pool_take(struct pool_worker *self) {
+        struct pool *pool = self->pool;
+        struct pool_task *task;
+        unsigned i, victim;
+
+        task = deque_pop_tail(&self->deque);
+        if (task)
+                goto out;
+
+        /* Neighbours on the same node first, their data is local to us too */
+        victim = rand_r(&self->seed);
+        for (i = 0; i < pool->nr_workers; i++) {
+                struct pool_worker *w = &pool->workers[(victim + i) % pool->nr_workers];
+
+                if (w == self || w->node != self->node)
+                        continue;
+                task = deque_steal(&w->deque);
+                if (task)
+                        goto out;
+        }
+
+        for (i = 0; pool->pinned && i < pool->nr_workers; i++) {
+                struct pool_worker *w = &pool->workers[(victim + i) % pool->nr_workers];
+
+                if (w->node == self->node)
+                        continue;
+                task = deque_steal(&w->deque);
+                if (task)
+                        goto out;
+        }
+
+        return NULL;
+
+out:
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        return task;
+}
+
+static void *pool_worker_fn(void *arg) {
+        struct pool_worker *self = arg;
+        struct pool *pool = self->pool;
+        struct pool_task *task;
+
+        pool_self = self;
+        if (pool->pinned)
+                numa_pin_thread(&pool->topo, self->node);
+        /* Allocated after pinning, so first touch lands on own node too */
+        self->scratch = numa_alloc_local(POOL_SCRATCH_SIZE, pool->pinned ? pool->topo.node_id[self->node] : -1);
+        if (self->scratch)
+                memset(self->scratch, 0, POOL_SCRATCH_SIZE);
+
+        for (;;) {
+                task = pool_take(self);
+                if (task) {
+                        task->fn(task);
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                while (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) && !pool->stop)
+                        pthread_cond_wait(&pool->wake, &pool->lock);
+                __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                if (pool->stop && !__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST)) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        numa_free(self->scratch, POOL_SCRATCH_SIZE);
+        self->scratch = NULL;
+        return NULL;
+}
+
+static int pool_setup(struct pool *pool, unsigned nr_workers) {
+        unsigned i;
+        int ret;
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->wake, NULL);
+        pool->workers = aligned_alloc(64, nr_workers * sizeof(*pool->workers));
+        if (!pool->workers) {
+                ret = -ENOMEM;
+                goto err_sync;
+        }
+        memset(pool->workers, 0, nr_workers * sizeof(*pool->workers));
+        pool->nr_workers = nr_workers;
+
+        for (i = 0; i < nr_workers; i++) {
+                struct pool_worker *w = &pool->workers[i];
+
+                ret = deque_init(&w->deque);
+                if (ret)
+                        goto err_deques;
+                w->pool = pool;
+                w->id = i;
+                w->seed = i * 2654435761U;
+        }
+
+        for (i = 0; i < pool->topo.nr_nodes; i++) {
+                unsigned j;
+
+                for (j = 0; j < pool->node_workers[i]; j++)
+                        pool->workers[pool->node_first[i] + j].node = i;
+        }
+
+        for (i = 0; i < nr_workers; i++) {
+                ret = -pthread_create(&pool->workers[i].thread, NULL, pool_worker_fn, &pool->workers[i]);
+                if (ret) {
+                        unsigned j;
+
+                        /* Stop the ones already running */
+                        for (j = i; j < nr_workers; j++)
+                                deque_free(&pool->workers[j].deque);
+                        pool->nr_workers = i;
+                        pool_destroy(pool);
+                        return ret;
+                }
+        }
+
+        return 0;
+
+err_deques:
+        while (i--)
+                deque_free(&pool->workers[i].deque);
+        free(pool->workers);
+        pool->workers = NULL;
+        pool->nr_workers = 0;
+err_sync:
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        return ret;
+}
+
+/**
+ * pool_init - start work stealing thread pool
+ * @pool - pool to set up
+ * @nr_workers - number of threads, 0 for one per online CPU
+ */
+
+int pool_init(struct pool *pool, unsigned nr_workers) {
+        if (!nr_workers)
+                nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+        memset(pool, 0, sizeof(*pool));
+        /* Whole machine as one node, no pinning */
+        pool->topo.nr_nodes = 1;
+        pool->node_workers[0] = nr_workers;
+
+        return pool_setup(pool, nr_workers);
+}
+
+/**
+ * pool_init_numa - start pool with workers pinned to NUMA nodes
+ * @pool - pool to set up
+ * @topo - topology from numa_topo_init()
+ * @per_node - workers per node, 0 for one per CPU of the node
+ *
+ * Idle workers steal from own node first, see pool_submit_node().
+ */
+
+int pool_init_numa(struct pool *pool, const struct numa_topo *topo, unsigned per_node) {
+        unsigned nr_workers = 0;
+        int i;
+
+        memset(pool, 0, sizeof(*pool));
+        pool->topo = *topo;
+        pool->pinned = 1;
+        for (i = 0; i < topo->nr_nodes; i++) {
+                pool->node_first[i] = nr_workers;
+                pool->node_workers[i] = per_node ? per_node : topo->nr_cpus[i];
+                nr_workers += pool->node_workers[i];
+        }
+
+        return pool_setup(pool, nr_workers);
+}
+
+/**
+ * pool_scratch - node local POOL_SCRATCH_SIZE buffer of current worker
+ *
+ * Valid inside of a task only, NULL elsewhere.
+ */
+
+void *pool_scratch(void) {
+        return pool_self ? pool_self->scratch : NULL;
+}
+
+/* Deque full and can't grow: submitter runs the task itself, it is not lost */
+static void pool_run_inline(struct pool *pool, struct pool_task *task) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        task->fn(task);
+}
+
+/* Counted before push: a worker may spin on it, but never sleeps past it */
+static void pool_kick(struct pool *pool) {
+        if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_signal(&pool->wake);
+                pthread_mutex_unlock(&pool->lock);
+        }
+}
+
+static struct pool_worker *pool_target(struct pool *pool) {
+        if (pool_self && pool_self->pool == pool)
+                return pool_self;
+        return &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nr_workers];
+}
+
+/**
+ * pool_submit - queue cheap task
+ * @pool - pool
+ * @task - task, must stay valid until its fn is called
+ *
+ * From inside of a worker task lands on own deque, LIFO order. If the
+ * deque can't grow, the task is run on the caller before returning.
+ */
+
+void pool_submit(struct pool *pool, struct pool_task *task) {
+        __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        if (deque_push_tail(&pool_target(pool)->deque, task)) {
+                pool_run_inline(pool, task);
+                return;
+        }
+        pool_kick(pool);
+}
+
+/**
+ * pool_submit_node - queue cheap task to a worker of given node
+ * @pool - pool
+ * @node_id - kernel node id holding task data, negative if unknown
+ * @task - task, must stay valid until its fn is called
+ */
+
+void pool_submit_node(struct pool *pool, int node_id, struct pool_task *task) {
+        int idx = pool->pinned && node_id >= 0 ? numa_topo_index(&pool->topo, node_id) : -1;
+        struct pool_worker *w;
+        unsigned rr;
+
+        if (idx < 0 || !pool->node_workers[idx]) {
+                pool_submit(pool, task);
+                return;
+        }
+
+        rr = __atomic_fetch_add(&pool->node_next[idx], 1, __ATOMIC_RELAXED);
+        w = &pool->workers[pool->node_first[idx] + rr % pool->node_workers[idx]];
+        __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        if (deque_push_tail(&w->deque, task)) {
+                pool_run_inline(pool, task);
+                return;
+        }
+        pool_kick(pool);
+}
+
+/**
+ * pool_submit_heavy - queue expensive task
+ * @pool - pool
+ * @task - task, must stay valid until its fn is called
+ *
+ * Task goes to the steal end of the deque, so an idle worker picks
+ * it up instead of it blocking cheap tasks queued behind.
+ */
+
+void pool_submit_heavy(struct pool *pool, struct pool_task *task) {
+        __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        if (deque_push_head(&pool_target(pool)->deque, task)) {
+                pool_run_inline(pool, task);
+                return;
+        }
+        pool_kick(pool);
+}
+
+/**
+ * pool_destroy - run remaining tasks and stop workers
+ * @pool - pool set up by pool_init()
+ */
+
+void pool_destroy(struct pool *pool) {
+        unsigned i;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->nr_workers; i++)
+                pthread_join(pool->workers[i].thread, NULL);
+        for (i = 0; i < pool->nr_workers; i++)
+                deque_free(&pool->workers[i].deque);
+
+        free(pool->workers);
+        pool->workers = NULL;
+        pool->nr_workers = 0;
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,76 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "numa.h"
+
+/* Node local scratch memory of each worker, see pool_scratch() */
+#define POOL_SCRATCH_SIZE (64*1024)
+
+/**
+ * struct pool_task - unit of work, embed into own structure
+ * @fn - called once on one of the workers
+ */
+struct pool_task {
+        void (*fn)(struct pool_task *task);
+};
+
+#define pool_entry(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * struct pool_deque - task ring of one worker
+ *
+ * Owner pushes and pops at @tail, thieves take from @head.
+ * Heavy tasks are pushed at @head, so idle workers steal them
+ * first while owner keeps going through cheap ones.
+ */
+struct pool_deque {
+        pthread_spinlock_t lock;
+        struct pool_task **ring;
+        size_t mask;
+        size_t head;
+        size_t tail;
+} __attribute__((aligned(64)));
+
+struct pool_worker {
+        struct pool_deque deque;
+        struct pool *pool;
+        pthread_t thread;
+        unsigned id;
+        unsigned seed;
+        /* Node index in pool topology */
+        int node;
+        void *scratch;
+};
+
+struct pool {
+        struct pool_worker *workers;
+        unsigned nr_workers;
+        /* Tasks sitting in deques */
+        long queued;
+        /* Workers asleep on @wake */
+        int idle;
+        int stop;
+        unsigned next;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        /* Workers of node i are node_first[i] .. node_first[i] + node_workers[i] */
+        int pinned;
+        struct numa_topo topo;
+        unsigned node_first[NUMA_MAX_NODES];
+        unsigned node_workers[NUMA_MAX_NODES];
+        unsigned node_next[NUMA_MAX_NODES];
+};
+
+int pool_init(struct pool *pool, unsigned nr_workers);
+int pool_init_numa(struct pool *pool, const struct numa_topo *topo, unsigned per_node);
+void *pool_scratch(void);
+void pool_submit(struct pool *pool, struct pool_task *task);
+void pool_submit_node(struct pool *pool, int node_id, struct pool_task *task);
+void pool_submit_heavy(struct pool *pool, struct pool_task *task);
+void pool_destroy(struct pool *pool);
+
+#endif /* POOL_H */
@@ -0,0 +1,7 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "crc32.h"
+#include "xxhash.h"
+int main(int c, char **v){ for(int i=1;i<c;i++){FILE*f=fopen(v[i],"rb");fseek(f,0,2);long n=ftell(f);rewind(f);char*b=malloc(n+1);fread(b,1,n,f);fclose(f);
+printf("%08x %016" PRIx64 " %ld %s\n",crc32c(0,b,n),xxh64(b,n,0),n,v[i]);} }
@@ -0,0 +1,183 @@
+#include <inttypes.h>
+
+#include "repair.h"
+#include "parity.h"
+#include "crc32.h"
+#include "fixed.h"
+#include "metrics.h"
+
+#define ALIGN(x, y) ((x - x % y)/y)
+
+static inline uint8_t bitshift(int shift) {
+        static const uint8_t jump_table[8] = {
+                1 << 0, 1 << 1, 1 << 2, 1 << 3,
+                1 << 4, 1 << 5, 1 << 6, 1 << 7
+        };
+        return jump_table[shift % 8];
+}
+
+/* Bit indexes of known faults inside of @size bytes, most frequent first */
+static size_t hint_bits(struct fault_map *hints, uint64_t region, size_t size, size_t bits[]) {
+        struct fault_hint found[REPAIR_HINTS];
+        size_t i, n, nr = 0;
+
+        if (!hints)
+                return 0;
+        n = fault_map_lookup(hints, region, found, REPAIR_HINTS);
+        for (i = 0; i < n; i++)
+                if (found[i].offset < size)
+                        bits[nr++] = found[i].offset * 8 + found[i].bit;
+        return nr;
+}
+
+/* Pairs of known faults, as one failing cell tends to come with a neighbour */
+static int hint_try(struct crc32_correction *data, const size_t bits[], size_t nr,
+                    unsigned *fi, unsigned *fj) {
+        char *ptr = (char *)data->memory;
+        size_t a, b;
+
+        for (a = 0; a < nr; a++) {
+                ptr[ALIGN(bits[a], 8)] ^= bitshift(bits[a]);
+                if (data->orig_crc == crc32c(0, data->memory, data->size)) {
+                        *fi = bits[a];
+                        *fj = 0;
+                        return 1;
+                }
+                for (b = a + 1; b < nr; b++) {
+                        ptr[ALIGN(bits[b], 8)] ^= bitshift(bits[b]);
+                        if (data->orig_crc == crc32c(0, data->memory, data->size)) {
+                                *fi = bits[a];
+                                *fj = bits[b];
+                                return 1;
+                        }
+                        ptr[ALIGN(bits[b], 8)] ^= bitshift(bits[b]);
+                }
+                ptr[ALIGN(bits[a], 8)] ^= bitshift(bits[a]);
+        }
+
+        return 0;
+}
+
+/**
+ * crc32_bitflip_corrector - brute force 1 and 2 bit errors against CRC32C
+ * @data - damaged memory and expected CRC, result is stored back
+ *
+ * With @data->hints set, faults repaired before in @data->region are
+ * tried first and every successful repair is recorded.
+ */
+
+void crc32_bitflip_corrector(struct crc32_correction *data) {
+        const size_t size = data->size;
+        const size_t bits_to_flip = data->size * 8;
+        size_t hinted[REPAIR_HINTS];
+        size_t nr_hinted;
+
+        char *ptr = (char *)data->memory;
+        unsigned i, j = 0;
+        METRIC_START(start);
+
+        nr_hinted = hint_bits(data->hints, data->region, size, hinted);
+        if (hint_try(data, hinted, nr_hinted, &i, &j))
+                goto out;
+
+        /* Brute force 1-bit error */
+        for (i = 0; i < bits_to_flip; i++) {
+                ptr[ALIGN(i, 8)] ^= bitshift(i);
+                if (data->orig_crc == crc32c(0, data->memory, size))
+                        goto out;
+                ptr[ALIGN(i, 8)] ^= bitshift(i);
+        }
+
+        /* Brute force err 2-bits error */
+        for (i = 0; i < bits_to_flip; i++) {
+                ptr[ALIGN(i, 8)] ^= bitshift(i);
+                for (j = i + 1; j < bits_to_flip; j++) {
+                        ptr[ALIGN(j, 8)] ^= bitshift(j);
+                        if (data->orig_crc == crc32c(0, data->memory, size))
+                                goto out;
+                        ptr[ALIGN(j, 8)] ^= bitshift(j);
+                }
+                ptr[ALIGN(i, 8)] ^= bitshift(i);
+        }
+
+        METRIC_RECORD(METRIC_REPAIR_BITFLIP, size, start, 1);
+        return;
+
+        out:
+                data->error_offset = ALIGN(i, 8);
+                data->fixed = 1;
+                METRIC_RECORD(METRIC_REPAIR_BITFLIP, size, start, 0);
+                if (data->hints) {
+                        fault_map_record(data->hints, data->region, ALIGN(i, 8), i % 8);
+                        if (j)
+                                fault_map_record(data->hints, data->region, ALIGN(j, 8), j % 8);
+                }
+}
+
+/*
+ * One repair is one event, however many bits it flipped: its first and
+ * last flipped bit bound the burst, and either one being flipped again
+ * brings the stripe up first. Stripes are little endian, syndrome bit
+ * 8*k+b is bit b of byte k.
+ */
+static void record_stripe(struct fault_map *hints, uint64_t region, uint64_t offset, uint64_t syndrome) {
+        int first = __builtin_ctzll(syndrome), last = 63 - __builtin_clzll(syndrome);
+
+        fault_map_record(hints, region, offset + first / 8, first % 8);
+        if (last != first)
+                fault_map_record(hints, region, offset + last / 8, last % 8);
+}
+
+/**
+ * fparity64_repair_hinted - fparity64_repair() trying known faults first
+ * @hints - fault map or NULL
+ * @region - hint_region() of the page
+ * @data - page with a single damaged stripe, fixed in place
+ * @byte_len - page length in bytes, multiple of 8
+ * @parity - fparity64() of the page before damage, seed 0
+ * @crc - crc32c() of the page before damage
+ *
+ * Stripes holding faults recorded before are checked ahead of the
+ * full search, a repair found either way is recorded.
+ * Returns byte offset of the rebuilt stripe or -1.
+ */
+
+int64_t fparity64_repair_hinted(struct fault_map *hints, uint64_t region, void *data,
+                                uint64_t byte_len, uint64_t parity, uint32_t crc) {
+        struct fault_hint found[REPAIR_HINTS];
+        uint64_t *ptr = (uint64_t *) data;
+        uint64_t syndrome, stripe;
+        int64_t offset;
+        size_t i, n;
+
+        if (!hints)
+                return fparity64_repair(data, byte_len, parity, crc);
+
+        syndrome = fparity64(data, byte_len, parity);
+        if (!syndrome)
+                return -1;
+
+        n = fault_map_lookup(hints, region, found, REPAIR_HINTS);
+        for (i = 0; i < n; i++) {
+                stripe = found[i].offset / sizeof(parity);
+                if (stripe >= byte_len / sizeof(parity))
+                        continue;
+                /* Known cell must be among the flipped bits */
+                if (!(syndrome >> (found[i].offset % 8 * 8 + found[i].bit) & 1))
+                        continue;
+                ptr[stripe] ^= syndrome;
+                if (crc32c_fixed(0, data, byte_len) == crc) {
+                        offset = stripe * sizeof(parity);
+                        goto out;
+                }
+                ptr[stripe] ^= syndrome;
+        }
+
+        offset = fparity64_repair(data, byte_len, parity, crc);
+        if (offset < 0)
+                return -1;
+
+out:
+        record_stripe(hints, region, offset, syndrome);
+        return offset;
+}
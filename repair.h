@@ -0,0 +1,30 @@
+#ifndef REPAIR_H
+#define REPAIR_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "hints.h"
+
+/* Fault map entries tried before a full search, all a region may hold */
+#define REPAIR_HINTS HINTS_PER_REGION
+
+struct crc32_correction {
+        /* Memory with crc32 missmatch */
+        void *memory;
+        size_t size;
+        /* CRC32 to match */
+        unsigned orig_crc;
+        /* Byte offset with fixed error */
+        size_t error_offset;
+        int fixed:1;
+        /* Optional, faults seen before in @region are tried first */
+        struct fault_map *hints;
+        uint64_t region;
+};
+
+void crc32_bitflip_corrector(struct crc32_correction *data);
+int64_t fparity64_repair_hinted(struct fault_map *hints, uint64_t region, void *data,
+                                uint64_t byte_len, uint64_t parity, uint32_t crc);
+
+#endif /* REPAIR_H */
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ring.h"
+
+/**
+ * ring_init - allocate ring
+ * @r - ring
+ * @size - number of slots, power of two
+ */
+
+int ring_init(struct ring *r, size_t size) {
+        size_t i;
+
+        if (!size || size & (size - 1))
+                return -EINVAL;
+
+        memset(r, 0, sizeof(*r));
+        r->slots = aligned_alloc(64, size * sizeof(*r->slots));
+        if (!r->slots)
+                return -ENOMEM;
+        for (i = 0; i < size; i++) {
+                r->slots[i].seq = i;
+                r->slots[i].item = NULL;
+        }
+        r->mask = size - 1;
+
+        return 0;
+}
+
+/**
+ * ring_push - add item to the ring
+ * @r - ring
+ * @item - any pointer but NULL
+ *
+ * Returns 0 or -EAGAIN when ring is full.
+ */
+
+int ring_push(struct ring *r, void *item) {
+        uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        struct ring_slot *slot;
+        int64_t diff;
+
+        for (;;) {
+                slot = &r->slots[pos & r->mask];
+                diff = (int64_t) __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t) pos;
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        /* Slot still holds item from previous lap */
+                        return -EAGAIN;
+                } else {
+                        pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+                }
+        }
+
+        slot->item = item;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+/**
+ * ring_pop - take oldest item from the ring
+ * @r - ring
+ *
+ * Returns item or NULL when ring is empty.
+ */
+
+void *ring_pop(struct ring *r) {
+        uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        struct ring_slot *slot;
+        int64_t diff;
+        void *item;
+
+        for (;;) {
+                slot = &r->slots[pos & r->mask];
+                diff = (int64_t) __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t) (pos + 1);
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        return NULL;
+                } else {
+                        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+                }
+        }
+
+        item = slot->item;
+        /* Free the slot for producer of the next lap */
+        __atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+        return item;
+}
+
+/**
+ * ring_push_batch - add items to the ring with one reservation
+ * @r - ring
+ * @items - pointers, none NULL
+ * @n - number of items
+ *
+ * Free slots in a row from the tail are counted and taken by a single
+ * CAS on it, only a producer moves the tail so they stay free until
+ * filled. Returns number of items pushed, less than @n when the ring
+ * fills up.
+ */
+
+size_t ring_push_batch(struct ring *r, void *const items[], size_t n) {
+        uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        size_t i, k;
+
+        if (!n)
+                return 0;
+        for (;;) {
+                for (k = 0; k < n; k++)
+                        if (__atomic_load_n(&r->slots[(pos + k) & r->mask].seq, __ATOMIC_ACQUIRE) != pos + k)
+                                break;
+                if (!k) {
+                        /* Raced with another producer, or full */
+                        if (pos == __atomic_load_n(&r->tail, __ATOMIC_RELAXED))
+                                return 0;
+                        pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+                        continue;
+                }
+                if (__atomic_compare_exchange_n(&r->tail, &pos, pos + k, 1,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        break;
+        }
+
+        for (i = 0; i < k; i++) {
+                r->slots[(pos + i) & r->mask].item = items[i];
+                __atomic_store_n(&r->slots[(pos + i) & r->mask].seq, pos + i + 1, __ATOMIC_RELEASE);
+        }
+        return k;
+}
+
+/**
+ * ring_pop_batch - take oldest items from the ring with one reservation
+ * @r - ring
+ * @items - output
+ * @n - size of @items
+ *
+ * Filled slots in a row from the head are taken by a single CAS on it.
+ * Returns number of items taken, less than @n when the ring runs empty.
+ */
+
+size_t ring_pop_batch(struct ring *r, void *items[], size_t n) {
+        uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        size_t i, k;
+
+        if (!n)
+                return 0;
+        for (;;) {
+                for (k = 0; k < n; k++)
+                        if (__atomic_load_n(&r->slots[(pos + k) & r->mask].seq, __ATOMIC_ACQUIRE) != pos + k + 1)
+                                break;
+                if (!k) {
+                        if (pos == __atomic_load_n(&r->head, __ATOMIC_RELAXED))
+                                return 0;
+                        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+                        continue;
+                }
+                if (__atomic_compare_exchange_n(&r->head, &pos, pos + k, 1,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        break;
+        }
+
+        for (i = 0; i < k; i++) {
+                items[i] = r->slots[(pos + i) & r->mask].item;
+                /* Free the slot for producer of the next lap */
+                __atomic_store_n(&r->slots[(pos + i) & r->mask].seq, pos + i + r->mask + 1, __ATOMIC_RELEASE);
+        }
+        return k;
+}
+
+void ring_free(struct ring *r) {
+        free(r->slots);
+        r->slots = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef RING_H
+#define RING_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+ * struct ring_slot - one cell of the ring, own cache line
+ * @seq - position the slot is ready for: equal to it when free for
+ * producer of that position, one more when filled for consumer
+ */
+struct ring_slot {
+        uint64_t seq;
+        void *item;
+} __attribute__((aligned(64)));
+
+/**
+ * struct ring - bounded lock-free multi producer multi consumer queue
+ *
+ * Producers and consumers only contend on @tail and @head
+ * respectively, each slot is handed over by its sequence number.
+ */
+struct ring {
+        uint64_t tail __attribute__((aligned(64)));
+        uint64_t head __attribute__((aligned(64)));
+        struct ring_slot *slots __attribute__((aligned(64)));
+        uint64_t mask;
+};
+
+int ring_init(struct ring *r, size_t size);
+int ring_push(struct ring *r, void *item);
+void *ring_pop(struct ring *r);
+size_t ring_push_batch(struct ring *r, void *const items[], size_t n);
+size_t ring_pop_batch(struct ring *r, void *items[], size_t n);
+void ring_free(struct ring *r);
+
+#endif /* RING_H */
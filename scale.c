@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "parity.h"
+#include "crc32.h"
+#include "xxhash.h"
+#include "fixed.h"
+#include "verify.h"
+
+/*
+ * Throughput of the page kernels over working sets sized to each level
+ * of the cache hierarchy, at 1..N threads. Every thread walks its own
+ * buffer page by page, so the numbers show where a kernel turns memory
+ * bound and how many cores a scrub pass needs to saturate a level.
+ */
+
+enum level {
+        LEVEL_L1,
+        LEVEL_L2,
+        LEVEL_LLC,
+        LEVEL_DRAM,
+        LEVELS,
+};
+
+static const char *const level_names[LEVELS] = { "L1", "L2", "LLC", "DRAM" };
+
+/* Used when sysfs does not describe the caches */
+static const size_t level_defaults[LEVEL_DRAM] = { 32 << 10, 1 << 20, 32 << 20 };
+
+/* Smallest DRAM working set, whatever the LLC size */
+#define SCALE_DRAM_MIN (256ULL << 20)
+
+/* Pages handed to a kernel per call, deadline is checked in between */
+#define SCALE_CHUNK 64
+
+#define SCALE_MAX_THREADS 256
+
+struct scale_buf {
+        uint8_t *data;
+        size_t nr_pages;
+        const void **pages;
+        struct page_meta *meta;
+};
+
+struct kernel {
+        const char *name;
+        uint64_t (*fn)(struct scale_buf *b, size_t first, size_t n);
+};
+
+static uint64_t k_fparity64(struct scale_buf *b, size_t first, size_t n) {
+        uint64_t r = 0;
+        size_t i;
+
+        for (i = first; i < first + n; i++)
+                r ^= fparity64_fixed(b->pages[i], PAGE_SIZE, 0);
+        return r;
+}
+
+static uint64_t k_crc32c(struct scale_buf *b, size_t first, size_t n) {
+        uint64_t r = 0;
+        size_t i;
+
+        for (i = first; i < first + n; i++)
+                r ^= crc32c_fixed(0, b->pages[i], PAGE_SIZE);
+        return r;
+}
+
+static uint64_t k_xxh64(struct scale_buf *b, size_t first, size_t n) {
+        uint64_t r = 0;
+        size_t i;
+
+        for (i = first; i < first + n; i++)
+                r ^= xxh64_fixed(b->pages[i], PAGE_SIZE, 0);
+        return r;
+}
+
+/* Parity and CRC of the page in one call, as stored by the scrubber */
+static uint64_t k_meta_init(struct scale_buf *b, size_t first, size_t n) {
+        struct page_meta m = { 0 };
+        uint64_t r = 0;
+        size_t i;
+
+        for (i = first; i < first + n; i++) {
+                page_meta_init(&m, b->pages[i]);
+                r ^= m.parity ^ m.crc;
+        }
+        return r;
+}
+
+static uint64_t k_verify_pages(struct scale_buf *b, size_t first, size_t n) {
+        uint64_t bad = 0;
+
+        return verify_pages(b->pages + first, b->meta + first, n, &bad) ^ bad;
+}
+
+static const struct kernel kernels[] = {
+        { "fparity64", k_fparity64 },
+        { "crc32c", k_crc32c },
+        { "xxh64", k_xxh64 },
+        { "page_meta_init", k_meta_init },
+        { "verify_pages", k_verify_pages },
+};
+
+#define NR_KERNELS (sizeof(kernels)/sizeof(kernels[0]))
+
+struct scale {
+        size_t set_size[LEVELS];
+        unsigned max_threads;
+        int pin;
+        uint64_t run_ns;
+        int cpus[SCALE_MAX_THREADS];
+        int nr_cpus;
+        /* Per thread working set of the current run */
+        size_t thread_size;
+        pthread_barrier_t barrier;
+        /* Single thread results of the current level, for efficiency */
+        double single[NR_KERNELS];
+};
+
+struct worker {
+        struct scale *s;
+        pthread_t thread;
+        unsigned idx;
+        int err;
+        uint64_t bytes[NR_KERNELS];
+        uint64_t ns[NR_KERNELS];
+};
+
+static volatile uint64_t sink;
+
+static inline uint64_t xorshift64(uint64_t *state) {
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Parse sysfs cache size like "48K" */
+static size_t parse_size(const char *str) {
+        char *end;
+        size_t v = strtoull(str, &end, 10);
+
+        switch (*end) {
+        case 'K':
+                return v << 10;
+        case 'M':
+                return v << 20;
+        case 'G':
+                return v << 30;
+        default:
+                return v;
+        }
+}
+
+static int read_line(const char *path, char *buf, size_t len) {
+        FILE *f = fopen(path, "r");
+        int ret = -1;
+
+        if (!f)
+                return -1;
+        if (fgets(buf, len, f))
+                ret = 0;
+        fclose(f);
+        return ret;
+}
+
+/**
+ * cache_sizes - data cache sizes of cpu0 from sysfs
+ * @size - output, bytes of L1 data, L2 and last level cache
+ *
+ * Levels sysfs does not report keep their previous value.
+ */
+
+static void cache_sizes(size_t size[LEVEL_DRAM]) {
+        char path[128], buf[64];
+        int idx, level, last = 0;
+
+        for (idx = 0; ; idx++) {
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", idx);
+                if (read_line(path, buf, sizeof(buf)))
+                        break;
+                level = atoi(buf);
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", idx);
+                if (read_line(path, buf, sizeof(buf)) || !strncmp(buf, "Instruction", 11))
+                        continue;
+                snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", idx);
+                if (read_line(path, buf, sizeof(buf)))
+                        continue;
+                if (level == 1 || level == 2)
+                        size[level - 1] = parse_size(buf);
+                else if (level > last)
+                        size[LEVEL_LLC] = parse_size(buf);
+                if (level > last)
+                        last = level;
+        }
+}
+
+/* CPUs the process may run on, in order */
+static int allowed_cpus(int cpus[], int max) {
+        cpu_set_t set;
+        int cpu, n = 0;
+
+        if (sched_getaffinity(0, sizeof(set), &set))
+                return -errno;
+        for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+                if (CPU_ISSET(cpu, &set))
+                        cpus[n++] = cpu;
+        return n;
+}
+
+static int pin_cpu(int cpu) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Buffer is filled by the thread using it, so it lands on its node */
+static int buf_init(struct scale_buf *b, size_t size, uint64_t seed) {
+        uint64_t *words;
+        size_t i;
+
+        b->nr_pages = size / PAGE_SIZE;
+        b->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b->data == MAP_FAILED)
+                return -ENOMEM;
+        b->pages = malloc(b->nr_pages * sizeof(*b->pages));
+        b->meta = calloc(b->nr_pages, sizeof(*b->meta));
+        if (!b->pages || !b->meta) {
+                free(b->pages);
+                free(b->meta);
+                munmap(b->data, size);
+                return -ENOMEM;
+        }
+
+        words = (uint64_t *) b->data;
+        for (i = 0; i < size / sizeof(*words); i++)
+                words[i] = xorshift64(&seed);
+        for (i = 0; i < b->nr_pages; i++) {
+                b->pages[i] = b->data + i * PAGE_SIZE;
+                page_meta_init(&b->meta[i], b->pages[i]);
+        }
+        return 0;
+}
+
+static void buf_free(struct scale_buf *b) {
+        free(b->pages);
+        free(b->meta);
+        munmap(b->data, b->nr_pages * PAGE_SIZE);
+}
+
+static void *worker_fn(void *arg) {
+        struct worker *w = arg;
+        struct scale *s = w->s;
+        struct scale_buf b;
+        uint64_t start, end, bytes, r = 0;
+        size_t first, n;
+        unsigned k;
+
+        if (s->pin)
+                w->err = pin_cpu(s->cpus[w->idx % s->nr_cpus]);
+        if (!w->err)
+                w->err = buf_init(&b, s->thread_size, 0x9e3779b97f4a7c15ULL * (w->idx + 1));
+
+        for (k = 0; k < NR_KERNELS; k++) {
+                /* Everyone starts each kernel together */
+                pthread_barrier_wait(&s->barrier);
+                if (w->err)
+                        continue;
+
+                /* One untimed pass to warm the caches */
+                for (first = 0; first < b.nr_pages; first += n) {
+                        n = b.nr_pages - first < SCALE_CHUNK ? b.nr_pages - first : SCALE_CHUNK;
+                        r ^= kernels[k].fn(&b, first, n);
+                }
+
+                bytes = 0;
+                first = 0;
+                start = now_ns();
+                do {
+                        n = b.nr_pages - first < SCALE_CHUNK ? b.nr_pages - first : SCALE_CHUNK;
+                        r ^= kernels[k].fn(&b, first, n);
+                        bytes += n * PAGE_SIZE;
+                        first = first + n == b.nr_pages ? 0 : first + n;
+                        end = now_ns();
+                } while (end - start < s->run_ns);
+                w->bytes[k] = bytes;
+                w->ns[k] = end - start;
+        }
+
+        sink ^= r;
+        if (!w->err)
+                buf_free(&b);
+        return NULL;
+}
+
+static size_t round_pages(size_t size) {
+        size -= size % PAGE_SIZE;
+        return size < PAGE_SIZE ? PAGE_SIZE : size;
+}
+
+/**
+ * scale_run - time all kernels on one cache level with @nr_threads
+ * @s - configuration
+ * @level - working set to use
+ * @nr_threads - threads, each with its own buffer
+ *
+ * L1 and L2 are private so every thread gets a set of their size,
+ * LLC and DRAM sets are split between the threads.
+ */
+
+static int scale_run(struct scale *s, enum level level, unsigned nr_threads) {
+        struct worker *w;
+        double gib, per_thread;
+        unsigned i, k;
+        int ret = 0;
+
+        if (level == LEVEL_L1 || level == LEVEL_L2)
+                s->thread_size = round_pages(s->set_size[level]);
+        else
+                s->thread_size = round_pages(s->set_size[level] / nr_threads);
+
+        w = calloc(nr_threads, sizeof(*w));
+        if (!w)
+                return -ENOMEM;
+        pthread_barrier_init(&s->barrier, NULL, nr_threads);
+
+        for (i = 0; i < nr_threads; i++) {
+                w[i].s = s;
+                w[i].idx = i;
+                if (pthread_create(&w[i].thread, NULL, worker_fn, &w[i])) {
+                        /* Barrier counts on every thread, cannot continue */
+                        fprintf(stderr, "scale: cannot start thread %u\n", i);
+                        exit(1);
+                }
+        }
+        for (i = 0; i < nr_threads; i++) {
+                pthread_join(w[i].thread, NULL);
+                if (w[i].err)
+                        ret = w[i].err;
+        }
+        pthread_barrier_destroy(&s->barrier);
+        if (ret)
+                goto out;
+
+        for (k = 0; k < NR_KERNELS; k++) {
+                gib = 0;
+                for (i = 0; i < nr_threads; i++)
+                        gib += w[i].bytes[k] * 1e9 / w[i].ns[k] / (1ULL << 30);
+                per_thread = gib / nr_threads;
+                if (nr_threads == 1)
+                        s->single[k] = gib;
+                printf("%-5s %-16s %7u %10.2f %12.2f %9.0f%%\n", level_names[level], kernels[k].name,
+                       nr_threads, gib, per_thread, s->single[k] ? per_thread * 100 / s->single[k] : 0);
+        }
+
+out:
+        free(w);
+        return ret;
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-t threads] [-p] [-d ms] [-m MiB] [-l levels]\n"
+                "  -t  most threads to scale to (default online CPUs)\n"
+                "  -p  pin thread i to the i-th allowed CPU\n"
+                "  -d  time per kernel and thread count (default 200)\n"
+                "  -m  DRAM working set (default 4x LLC, at least 256)\n"
+                "  -l  comma separated list of: L1,L2,LLC,DRAM (default all)\n",
+                prog);
+}
+
+static int parse_levels(char *list, int enabled[LEVELS]) {
+        char *tok;
+        int i;
+
+        for (i = 0; i < LEVELS; i++)
+                enabled[i] = 0;
+        for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+                for (i = 0; i < LEVELS; i++)
+                        if (!strcasecmp(tok, level_names[i]))
+                                break;
+                if (i == LEVELS) {
+                        fprintf(stderr, "scale: unknown level %s\n", tok);
+                        return -1;
+                }
+                enabled[i] = 1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv) {
+        static struct scale s;
+        int enabled[LEVELS];
+        size_t dram = 0;
+        unsigned t;
+        int opt, i, ret;
+
+        s.max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        s.run_ns = 200 * 1000000ULL;
+        for (i = 0; i < LEVELS; i++)
+                enabled[i] = 1;
+
+        while ((opt = getopt(argc, argv, "t:pd:m:l:h")) != -1) {
+                switch (opt) {
+                case 't':
+                        s.max_threads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'p':
+                        s.pin = 1;
+                        break;
+                case 'd':
+                        s.run_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+                        break;
+                case 'm':
+                        dram = strtoull(optarg, NULL, 0) << 20;
+                        break;
+                case 'l':
+                        if (parse_levels(optarg, enabled))
+                                return 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+        if (!s.max_threads || s.max_threads > SCALE_MAX_THREADS || !s.run_ns) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        s.nr_cpus = allowed_cpus(s.cpus, SCALE_MAX_THREADS);
+        if (s.nr_cpus <= 0) {
+                fprintf(stderr, "scale: no usable CPUs\n");
+                return 1;
+        }
+
+        memcpy(s.set_size, level_defaults, sizeof(level_defaults));
+        cache_sizes(s.set_size);
+        if (!dram) {
+                dram = 4 * s.set_size[LEVEL_LLC];
+                if (dram < SCALE_DRAM_MIN)
+                        dram = SCALE_DRAM_MIN;
+        }
+        /* Half of a cache leaves room for code, stack and metadata */
+        for (i = 0; i < LEVEL_DRAM; i++)
+                s.set_size[i] /= 2;
+        s.set_size[LEVEL_DRAM] = dram;
+
+        printf("crc32c tier: %s, CPUs: %d, pinned: %s\n", crc32c_hw_available() ? "hw" : "sw",
+               s.nr_cpus, s.pin ? "yes" : "no");
+        for (i = 0; i < LEVELS; i++)
+                printf("%s set: %zu KiB%s\n", level_names[i], s.set_size[i] >> 10,
+                       i < LEVEL_LLC ? " per thread" : " total");
+        printf("%-5s %-16s %7s %10s %12s %10s\n", "level", "kernel", "threads", "GiB/s",
+               "GiB/s/thread", "efficiency");
+
+        for (i = 0; i < LEVELS; i++) {
+                if (!enabled[i])
+                        continue;
+                for (t = 1; t <= s.max_threads; t = t * 2 > s.max_threads && t < s.max_threads ?
+                     s.max_threads : t * 2) {
+                        ret = scale_run(&s, i, t);
+                        if (ret) {
+                                fprintf(stderr, "scale: %s\n", strerror(-ret));
+                                return 1;
+                        }
+                }
+        }
+
+        return 0;
+}
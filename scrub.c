@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "scrub.h"
+#include "pool.h"
+
+/* pagemap entries fetched by one pread() */
+#define PAGEMAP_BATCH 512
+
+/* Linux 6.7 uapi, missing from older headers */
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#define UFFD_FEATURE_WP_ASYNC (1 << 15)
+#endif
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WRITTEN (1 << 1)
+#define PM_SCAN_WP_MATCHING (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC (1 << 1)
+
+struct page_region {
+        uint64_t start;
+        uint64_t end;
+        uint64_t categories;
+};
+
+struct pm_scan_arg {
+        uint64_t size;
+        uint64_t flags;
+        uint64_t start;
+        uint64_t end;
+        uint64_t walk_end;
+        uint64_t vec;
+        uint64_t vec_len;
+        uint64_t max_pages;
+        uint64_t category_inverted;
+        uint64_t category_mask;
+        uint64_t category_anyof_mask;
+        uint64_t return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+/* Written ranges returned by one PAGEMAP_SCAN */
+#define SCAN_BATCH 64
+
+/* Pages per scrub_pass() task, whole bitmap words so tasks share none */
+#define SCRUB_TASK_PAGES 1024
+
+/**
+ * pagemap_read - fetch pagemap entries for a range of pages
+ * @fd - opened /proc/self/pagemap
+ * @addr - page aligned address of first page
+ * @entries - output, one entry per page
+ * @count - number of pages
+ */
+
+int pagemap_read(int fd, const void *addr, uint64_t *entries, size_t count) {
+        off_t off = (uintptr_t) addr / PAGE_SIZE * sizeof(*entries);
+        size_t len = count * sizeof(*entries);
+        ssize_t got;
+
+        while (len) {
+                got = pread(fd, entries, len, off);
+                if (got < 0 && errno == EINTR)
+                        continue;
+                if (got <= 0)
+                        return got < 0 ? -errno : -EIO;
+                entries += got / sizeof(*entries);
+                off += got;
+                len -= got;
+        }
+
+        return 0;
+}
+
+/**
+ * clear_soft_dirty - reset soft-dirty bits of the whole process
+ * @fd - opened /proc/self/clear_refs
+ *
+ * All pages get write protected again, so first write to each
+ * of them after this call costs a minor fault.
+ */
+
+int clear_soft_dirty(int fd) {
+        if (pwrite(fd, "4", 1, 0) != 1)
+                return -errno;
+        return 0;
+}
+
+/* Kernel may be built without CONFIG_MEM_SOFT_DIRTY, check it on own page */
+static int soft_dirty_works(int pagemap_fd, int clear_refs_fd) {
+        volatile uint8_t *probe;
+        uint64_t entry;
+        int ret = -ENOTSUP;
+
+        probe = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (probe == MAP_FAILED)
+                return -errno;
+
+        probe[0] = 1;
+        if (clear_soft_dirty(clear_refs_fd))
+                goto out;
+        if (pagemap_read(pagemap_fd, (void *) probe, &entry, 1) || entry & PM_SOFT_DIRTY)
+                goto out;
+        probe[0] = 2;
+        if (pagemap_read(pagemap_fd, (void *) probe, &entry, 1) || !(entry & PM_SOFT_DIRTY))
+                goto out;
+        ret = 0;
+
+out:
+        munmap((void *) probe, PAGE_SIZE);
+        return ret;
+}
+
+/*
+ * Async write protect: writes to the range don't fault to a handler, the
+ * kernel just drops protection and marks the page written. PAGEMAP_SCAN
+ * then reports and protects again the written pages atomically, a write
+ * can't slip in between as it does between pagemap read and clear_refs.
+ */
+static int scrub_wp_init(struct scrub_region *r) {
+        struct uffdio_api api = {
+                .api = UFFD_API,
+                .features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED,
+        };
+        struct uffdio_register reg = {
+                .range = { (uintptr_t) r->base, r->pages * PAGE_SIZE },
+                .mode = UFFDIO_REGISTER_MODE_WP,
+        };
+        struct uffdio_writeprotect wp = {
+                .range = { (uintptr_t) r->base, r->pages * PAGE_SIZE },
+                .mode = UFFDIO_WRITEPROTECT_MODE_WP,
+        };
+        int fd;
+
+        fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+        if (fd < 0)
+                return -errno;
+        if (ioctl(fd, UFFDIO_API, &api) || ioctl(fd, UFFDIO_REGISTER, &reg) ||
+            ioctl(fd, UFFDIO_WRITEPROTECT, &wp)) {
+                close(fd);
+                return -ENOTSUP;
+        }
+        r->uffd = fd;
+        return 0;
+}
+
+/**
+ * scrub_init - take a baseline of a memory range
+ * @r - region to set up
+ * @base - page aligned start of protected memory
+ * @len - length in bytes, multiple of PAGE_SIZE
+ * @clean_interval - clean pages are verified once per this many passes
+ */
+
+int scrub_init(struct scrub_region *r, void *base, size_t len, unsigned clean_interval) {
+        size_t i;
+        int ret;
+
+        if ((uintptr_t) base % PAGE_SIZE || len % PAGE_SIZE || !clean_interval)
+                return -EINVAL;
+
+        memset(r, 0, sizeof(*r));
+        r->base = base;
+        r->pages = len / PAGE_SIZE;
+        r->clean_interval = clean_interval;
+        r->uffd = -1;
+        r->clear_refs_fd = -1;
+        r->pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+        if (r->pagemap_fd < 0) {
+                ret = -errno;
+                goto err;
+        }
+
+        r->meta = calloc(r->pages, sizeof(*r->meta));
+        r->dirty = calloc((r->pages + 63) / 64, sizeof(*r->dirty));
+        r->suspect = calloc((r->pages + 63) / 64, sizeof(*r->suspect));
+        if (!r->meta || !r->dirty || !r->suspect) {
+                ret = -ENOMEM;
+                goto err;
+        }
+
+        /* Writes racing with baseline are caught as written by first pass */
+        if (scrub_wp_init(r)) {
+                r->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+                if (r->clear_refs_fd < 0) {
+                        ret = -errno;
+                        goto err;
+                }
+                ret = soft_dirty_works(r->pagemap_fd, r->clear_refs_fd);
+                if (ret)
+                        goto err;
+                ret = clear_soft_dirty(r->clear_refs_fd);
+                if (ret)
+                        goto err;
+        }
+        for (i = 0; i < r->pages; i++)
+                page_meta_init(&r->meta[i], r->base + i * PAGE_SIZE);
+
+        return 0;
+
+err:
+        scrub_free(r);
+        return ret;
+}
+
+static inline void mark_dirty(struct scrub_region *r, size_t i) {
+        r->dirty[i / 64] |= 1ULL << (i % 64);
+}
+
+/* Fetch and clear written bits of the region in one step */
+static int scrub_snapshot_wp(struct scrub_region *r) {
+        struct page_region vec[SCAN_BATCH];
+        uint64_t end = (uintptr_t) r->base + r->pages * PAGE_SIZE, p;
+        struct pm_scan_arg arg = {
+                .size = sizeof(arg),
+                .flags = PM_SCAN_WP_MATCHING | PM_SCAN_CHECK_WPASYNC,
+                .start = (uintptr_t) r->base,
+                .end = end,
+                .vec = (uintptr_t) vec,
+                .vec_len = SCAN_BATCH,
+                .category_mask = PAGE_IS_WRITTEN,
+                .return_mask = PAGE_IS_WRITTEN,
+        };
+        long n, k;
+
+        do {
+                n = ioctl(r->pagemap_fd, PAGEMAP_SCAN, &arg);
+                if (n < 0)
+                        return -errno;
+                for (k = 0; k < n; k++)
+                        for (p = vec[k].start; p < vec[k].end; p += PAGE_SIZE)
+                                mark_dirty(r, (p - (uintptr_t) r->base) / PAGE_SIZE);
+                /* Full vector stops the walk early, go on from where it ended */
+                arg.start = arg.walk_end;
+        } while (arg.start < end);
+
+        return 0;
+}
+
+/* Snapshot written pages of the region into r->dirty */
+static int scrub_snapshot(struct scrub_region *r) {
+        uint64_t entries[PAGEMAP_BATCH];
+        size_t i, j, n;
+        int ret;
+
+        memset(r->dirty, 0, (r->pages + 63) / 64 * sizeof(*r->dirty));
+        if (r->uffd >= 0)
+                return scrub_snapshot_wp(r);
+
+        for (i = 0; i < r->pages; i += n) {
+                n = r->pages - i;
+                if (n > PAGEMAP_BATCH)
+                        n = PAGEMAP_BATCH;
+                ret = pagemap_read(r->pagemap_fd, r->base + i * PAGE_SIZE, entries, n);
+                if (ret)
+                        return ret;
+                for (j = 0; j < n; j++)
+                        if (entries[j] & PM_SOFT_DIRTY)
+                                mark_dirty(r, i + j);
+        }
+
+        return clear_soft_dirty(r->clear_refs_fd);
+}
+
+/*
+ * Page written since the snapshot of this pass, left for the next pass.
+ * Neither check clears the written state, the next snapshot still sees it.
+ */
+static int page_written(struct scrub_region *r, uint8_t *page) {
+        struct page_region vec;
+        struct pm_scan_arg arg = {
+                .size = sizeof(arg),
+                .start = (uintptr_t) page,
+                .end = (uintptr_t) page + PAGE_SIZE,
+                .vec = (uintptr_t) &vec,
+                .vec_len = 1,
+                .category_mask = PAGE_IS_WRITTEN,
+                .return_mask = PAGE_IS_WRITTEN,
+        };
+        uint64_t entry;
+
+        if (r->uffd >= 0)
+                return ioctl(r->pagemap_fd, PAGEMAP_SCAN, &arg) != 0;
+        return pagemap_read(r->pagemap_fd, page, &entry, 1) || entry & PM_SOFT_DIRTY;
+}
+
+/* Pages [first, last) of a pass, returns number left damaged */
+static long scrub_range(struct scrub_region *r, unsigned slice, size_t first, size_t last) {
+        uint64_t dirty = 0, verified = 0, repaired = 0, unrepaired = 0, bit;
+        long bad = 0;
+        uint8_t *page;
+        size_t i;
+
+        for (i = first; i < last; i++) {
+                page = r->base + i * PAGE_SIZE;
+                bit = 1ULL << (i % 64);
+
+                if (r->dirty[i / 64] & bit) {
+                        page_meta_init(&r->meta[i], page);
+                        r->suspect[i / 64] &= ~bit;
+                        dirty++;
+                        continue;
+                }
+
+                if (i % r->clean_interval != slice && !(r->suspect[i / 64] & bit))
+                        continue;
+
+                verified++;
+                if (page_verify(&r->meta[i], page) == PAGE_OK) {
+                        r->suspect[i / 64] &= ~bit;
+                        continue;
+                }
+                /* Written after the snapshot looks the same, the next one tells */
+                if (!(r->suspect[i / 64] & bit)) {
+                        r->suspect[i / 64] |= bit;
+                        continue;
+                }
+                r->suspect[i / 64] &= ~bit;
+                if (page_written(r, page))
+                        continue;
+                /* A soft-dirty bit lost before the clear can't be told from damage */
+                if (r->uffd < 0 && !r->quiesced) {
+                        unrepaired++;
+                        continue;
+                }
+                if (page_repair(&r->meta[i], page) == PAGE_REPAIRED) {
+                        repaired++;
+                        continue;
+                }
+                fprintf(stderr, "scrub: page %p damaged, can't repair\n", page);
+                bad++;
+        }
+
+        __atomic_add_fetch(&r->stats.dirty, dirty, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&r->stats.verified, verified, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&r->stats.repaired, repaired, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&r->stats.bad, bad, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&r->stats.unrepaired, unrepaired, __ATOMIC_RELAXED);
+        return bad;
+}
+
+struct scrub_job {
+        struct scrub_region *r;
+        unsigned slice;
+        long bad;
+        long pending;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+};
+
+struct scrub_task {
+        struct pool_task task;
+        struct scrub_job *job;
+        size_t first;
+};
+
+static void scrub_task_fn(struct pool_task *task) {
+        struct scrub_task *st = pool_entry(task, struct scrub_task, task);
+        struct scrub_job *job = st->job;
+        size_t last = st->first + SCRUB_TASK_PAGES;
+
+        __atomic_add_fetch(&job->bad, scrub_range(job->r, job->slice, st->first,
+                                                  last < job->r->pages ? last : job->r->pages),
+                           __ATOMIC_RELAXED);
+
+        if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL))
+                return;
+        pthread_mutex_lock(&job->lock);
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->lock);
+}
+
+/* Tasks of SCRUB_TASK_PAGES pages, each sent to the node holding its first page */
+static long scrub_range_pool(struct scrub_region *r, unsigned slice) {
+        size_t nr_tasks = (r->pages + SCRUB_TASK_PAGES - 1) / SCRUB_TASK_PAGES, i;
+        struct scrub_job job = { r, slice, 0 };
+        struct scrub_task *tasks;
+        void **first = NULL;
+        int *nodes = NULL;
+
+        tasks = calloc(nr_tasks, sizeof(*tasks));
+        if (!tasks)
+                return scrub_range(r, slice, 0, r->pages);
+
+        if (r->pool->pinned) {
+                first = malloc(nr_tasks * sizeof(*first));
+                nodes = malloc(nr_tasks * sizeof(*nodes));
+                if (first && nodes) {
+                        for (i = 0; i < nr_tasks; i++)
+                                first[i] = r->base + i * SCRUB_TASK_PAGES * PAGE_SIZE;
+                        if (numa_page_nodes(first, nodes, nr_tasks)) {
+                                free(nodes);
+                                nodes = NULL;
+                        }
+                }
+        }
+
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.done, NULL);
+        job.pending = nr_tasks;
+        for (i = 0; i < nr_tasks; i++) {
+                tasks[i] = (struct scrub_task) { { scrub_task_fn }, &job, i * SCRUB_TASK_PAGES };
+                pool_submit_node(r->pool, nodes ? nodes[i] : -1, &tasks[i].task);
+        }
+        pthread_mutex_lock(&job.lock);
+        while (__atomic_load_n(&job.pending, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&job.done, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        pthread_cond_destroy(&job.done);
+        pthread_mutex_destroy(&job.lock);
+
+        free(first);
+        free(nodes);
+        free(tasks);
+        return job.bad;
+}
+
+/**
+ * scrub_pass - refresh metadata of written pages, verify a slice of the rest
+ * @r - region set up by scrub_init()
+ *
+ * A page written after the snapshot of written pages looks clean with
+ * stale metadata, and repair would revert the write. Clean pages failing
+ * verification are therefore only repaired when the next pass finds them
+ * still clean and still failing, and not written since that pass began.
+ * A page written again meanwhile just gets fresh metadata. That does
+ * not cover a write between the pagemap read and clear_soft_dirty(),
+ * its soft-dirty bit is gone and the page stays clean and failing, so
+ * soft-dirty tracking repairs only with @r->quiesced set. Write protect
+ * tracking reads and clears the bits in one step and always repairs;
+ * the check right before a repair still leaves a few instructions for a
+ * write to land in, stop writers if even that matters.
+ * With @r->pool set, pages are scrubbed on its workers.
+ * Returns number of pages left damaged or negative errno.
+ */
+
+int scrub_pass(struct scrub_region *r) {
+        unsigned slice = r->stats.passes % r->clean_interval;
+        long bad;
+        int ret;
+
+        ret = scrub_snapshot(r);
+        if (ret)
+                return ret;
+
+        if (r->pool && r->pages > SCRUB_TASK_PAGES)
+                bad = scrub_range_pool(r, slice);
+        else
+                bad = scrub_range(r, slice, 0, r->pages);
+
+        r->stats.passes++;
+        return bad;
+}
+
+void scrub_free(struct scrub_region *r) {
+        if (r->pagemap_fd >= 0)
+                close(r->pagemap_fd);
+        if (r->uffd >= 0)
+                close(r->uffd);
+        if (r->clear_refs_fd >= 0)
+                close(r->clear_refs_fd);
+        free(r->meta);
+        free(r->dirty);
+        free(r->suspect);
+        r->pagemap_fd = -1;
+        r->uffd = -1;
+        r->clear_refs_fd = -1;
+        r->meta = NULL;
+        r->dirty = NULL;
+        r->suspect = NULL;
+}
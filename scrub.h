@@ -0,0 +1,77 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "verify.h"
+
+struct scrub_stats {
+        /* Finished scrub_pass() calls */
+        uint64_t passes;
+        /* Pages written since previous pass, metadata refreshed */
+        uint64_t dirty;
+        /* Clean pages checked against stored metadata */
+        uint64_t verified;
+        uint64_t repaired;
+        /* Pages with damage out of reach of repair */
+        uint64_t bad;
+        /* Clean pages failing verification left alone, see @quiesced */
+        uint64_t unrepaired;
+};
+
+/**
+ * struct scrub_region - memory protected by incremental scrubbing
+ *
+ * Pages written since previous pass get fresh metadata. They are found
+ * by PAGEMAP_SCAN over an async userfaultfd write protected range, which
+ * reads and clears the written bits in one step, or by soft-dirty bits
+ * of pagemap where that is not available. Clean pages are verified in
+ * slices, so each one is checked once per @clean_interval passes.
+ * Set @pool after scrub_init() to scrub on the workers of the nodes
+ * holding the pages.
+ *
+ * A write between the pagemap read and clear_soft_dirty() loses its
+ * soft-dirty bit for good, the page then fails verification just as
+ * damaged memory does. So with soft-dirty tracking clean pages are only
+ * repaired when @quiesced says nothing writes the region while
+ * scrub_pass() runs, otherwise they are counted in @stats.unrepaired.
+ */
+struct scrub_region {
+        uint8_t *base;
+        size_t pages;
+        struct page_meta *meta;
+        /* One bit per page, written pages of current pass */
+        uint64_t *dirty;
+        /* One bit per page, clean page failed verification, repaired next pass */
+        uint64_t *suspect;
+        unsigned clean_interval;
+        int pagemap_fd;
+        /* Write protect tracking, or -1 and soft-dirty by @clear_refs_fd */
+        int uffd;
+        int clear_refs_fd;
+        /* Workers for scrub_pass(), NULL to scrub on the caller */
+        struct pool *pool;
+        /* Writers are stopped during scrub_pass(), soft-dirty tracking may repair */
+        int quiesced;
+        struct scrub_stats stats;
+};
+
+int scrub_init(struct scrub_region *r, void *base, size_t len, unsigned clean_interval);
+int scrub_pass(struct scrub_region *r);
+void scrub_free(struct scrub_region *r);
+
+/* pagemap(5) helpers, also usable outside of scrubber */
+#define PM_PFN_MASK ((1ULL << 55) - 1)
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PM_SWAP (1ULL << 62)
+#define PM_PRESENT (1ULL << 63)
+
+int pagemap_read(int fd, const void *addr, uint64_t *entries, size_t count);
+/*
+ * Resets the bits of the whole process: two scrub_regions, or anything
+ * else writing clear_refs, take each other's dirty state away.
+ */
+int clear_soft_dirty(int fd);
+
+#endif /* SCRUB_H */
@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "scrub_sched.h"
+
+/* Virtual time charged for one page of a zone without repair history */
+#define SCHED_STRIDE (1 << 16)
+/* Zone with this many recent repairs is scrubbed this many times more often */
+#define SCHED_MAX_WEIGHT 64
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sleep @ns, cut short when the background worker is being stopped.
+ * Returns 0 or -EINTR, the latter only to the worker.
+ */
+static int sched_sleep(struct scrub_sched *s, uint64_t ns) {
+        uint64_t end = now_ns() + ns;
+        struct timespec ts = {
+                .tv_sec = end / 1000000000ULL,
+                .tv_nsec = end % 1000000000ULL,
+        };
+        int worker, ret = 0;
+
+        pthread_mutex_lock(&s->lock);
+        worker = s->running;
+        while (!(worker && !s->running) && now_ns() < end)
+                pthread_cond_timedwait(&s->wake, &s->lock, &ts);
+        if (worker && !s->running)
+                ret = -EINTR;
+        pthread_mutex_unlock(&s->lock);
+
+        return ret;
+}
+
+static inline uint64_t zone_vtime(struct scrub_sched *s, size_t heap_idx) {
+        return s->zones[s->heap[heap_idx]].vtime;
+}
+
+static void heap_swap(struct scrub_sched *s, size_t a, size_t b) {
+        size_t tmp = s->heap[a];
+
+        s->heap[a] = s->heap[b];
+        s->heap[b] = tmp;
+}
+
+static void heap_sift_up(struct scrub_sched *s, size_t i) {
+        while (i && zone_vtime(s, (i - 1)/2) > zone_vtime(s, i)) {
+                heap_swap(s, i, (i - 1)/2);
+                i = (i - 1)/2;
+        }
+}
+
+static void heap_sift_down(struct scrub_sched *s, size_t i) {
+        size_t min, l, r;
+
+        for (;;) {
+                min = i;
+                l = 2*i + 1;
+                r = 2*i + 2;
+                if (l < s->nr_zones && zone_vtime(s, l) < zone_vtime(s, min))
+                        min = l;
+                if (r < s->nr_zones && zone_vtime(s, r) < zone_vtime(s, min))
+                        min = r;
+                if (min == i)
+                        return;
+                heap_swap(s, i, min);
+                i = min;
+        }
+}
+
+/**
+ * scrub_sched_init - set up empty scheduler
+ * @s - scheduler
+ * @rate - bandwidth budget in bytes per second
+ * @zone_pages - prioritization granularity, 0 for SCHED_ZONE_PAGES
+ */
+
+int scrub_sched_init(struct scrub_sched *s, uint64_t rate, size_t zone_pages) {
+        pthread_condattr_t attr;
+
+        if (!rate)
+                return -EINVAL;
+
+        memset(s, 0, sizeof(*s));
+        s->rate = rate;
+        s->zone_pages = zone_pages ? zone_pages : SCHED_ZONE_PAGES;
+        /* Allow ~10ms of work at once, never less than a chunk */
+        s->burst = rate / 100;
+        if (s->burst < SCHED_CHUNK_PAGES*PAGE_SIZE)
+                s->burst = SCHED_CHUNK_PAGES*PAGE_SIZE;
+        s->tokens = s->burst;
+        s->refill_ns = now_ns();
+        pthread_mutex_init(&s->lock, NULL);
+        /* Throttle deadlines are on the monotonic clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&s->wake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        return 0;
+}
+
+/**
+ * scrub_sched_add - put memory with its metadata under scrubbing
+ * @s - scheduler
+ * @base - page aligned memory
+ * @meta - metadata, one record per page, filled by page_meta_init()
+ * @pages - number of pages
+ *
+ * Zones can be added only while background worker is stopped.
+ */
+
+int scrub_sched_add(struct scrub_sched *s, void *base, struct page_meta *meta, size_t pages) {
+        size_t nr = (pages + s->zone_pages - 1) / s->zone_pages;
+        struct sched_zone *zones;
+        uint64_t vtime;
+        size_t *heap;
+        size_t i;
+
+        if (s->running)
+                return -EBUSY;
+
+        pthread_mutex_lock(&s->lock);
+
+        zones = realloc(s->zones, (s->nr_zones + nr) * sizeof(*zones));
+        if (zones)
+                s->zones = zones;
+        heap = realloc(s->heap, (s->nr_zones + nr) * sizeof(*heap));
+        if (heap)
+                s->heap = heap;
+        if (!zones || !heap) {
+                pthread_mutex_unlock(&s->lock);
+                return -ENOMEM;
+        }
+
+        /* New zones join at current virtual time, not ahead of everyone */
+        vtime = s->nr_zones ? zone_vtime(s, 0) : 0;
+        for (i = 0; i < nr; i++) {
+                struct sched_zone *z = &s->zones[s->nr_zones];
+
+                memset(z, 0, sizeof(*z));
+                z->base = (uint8_t *) base + i * s->zone_pages * PAGE_SIZE;
+                z->meta = meta + i * s->zone_pages;
+                z->pages = pages - i * s->zone_pages;
+                if (z->pages > s->zone_pages)
+                        z->pages = s->zone_pages;
+                z->vtime = vtime;
+                z->decay_ns = now_ns();
+
+                s->heap[s->nr_zones] = s->nr_zones;
+                s->nr_zones++;
+                heap_sift_up(s, s->nr_zones - 1);
+        }
+        s->total_pages += pages;
+        s->stats.total = s->total_pages * PAGE_SIZE;
+
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+}
+
+static void zone_decay(struct sched_zone *z, uint64_t now) {
+        uint64_t halves = (now - z->decay_ns) / SCHED_DECAY_NS;
+
+        if (!halves)
+                return;
+        z->repairs = halves < 32 ? z->repairs >> halves : 0;
+        z->decay_ns += halves * SCHED_DECAY_NS;
+}
+
+/**
+ * scrub_sched_note_repair - record repair done outside of the scheduler
+ * @s - scheduler
+ * @addr - address inside of repaired page
+ *
+ * Zone holding @addr gets scrubbed more often for a while.
+ */
+
+void scrub_sched_note_repair(struct scrub_sched *s, const void *addr) {
+        const uint8_t *p = addr;
+        size_t i;
+
+        pthread_mutex_lock(&s->lock);
+        for (i = 0; i < s->nr_zones; i++) {
+                struct sched_zone *z = &s->zones[i];
+
+                if (p >= z->base && p < z->base + z->pages * PAGE_SIZE) {
+                        zone_decay(z, now_ns());
+                        z->repairs++;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&s->lock);
+}
+
+/* Wait until bucket holds @bytes tokens and take them, -EINTR on stop */
+static int sched_throttle(struct scrub_sched *s, uint64_t bytes) {
+        uint64_t now, elapsed, fill;
+
+        for (;;) {
+                now = now_ns();
+                elapsed = now - s->refill_ns;
+                /* Bucket is full after a second anyway */
+                if (elapsed > 1000000000ULL)
+                        elapsed = 1000000000ULL;
+                /* A second times rate passes 2^64 from 18 GB/s on */
+                fill = (unsigned __int128) elapsed * s->rate / 1000000000ULL;
+                if (fill) {
+                        s->tokens += fill;
+                        if (s->tokens > s->burst)
+                                s->tokens = s->burst;
+                        s->refill_ns = now;
+                }
+                if (s->tokens >= bytes)
+                        break;
+                if (sched_sleep(s, (unsigned __int128) (bytes - s->tokens) * 1000000000ULL / s->rate + 1))
+                        return -EINTR;
+        }
+        s->tokens -= bytes;
+
+        return 0;
+}
+
+/**
+ * scrub_sched_step - scrub one chunk of the most starving zone
+ * @s - scheduler
+ *
+ * Blocks while bandwidth budget is exhausted. Must not be called
+ * from several threads at once, scrub_sched_start() does it in
+ * background. Returns number of pages left damaged.
+ */
+
+int scrub_sched_step(struct scrub_sched *s) {
+        struct sched_zone *z;
+        uint32_t weight;
+        size_t i, n, first;
+        int repaired = 0, bad = 0, ret;
+
+        if (!s->nr_zones)
+                return 0;
+
+        /* Worker is being stopped, rather than waiting out the budget */
+        if (sched_throttle(s, SCHED_CHUNK_PAGES*PAGE_SIZE))
+                return 0;
+
+        pthread_mutex_lock(&s->lock);
+        z = &s->zones[s->heap[0]];
+        zone_decay(z, now_ns());
+        n = z->pages - z->cursor;
+        if (n > SCHED_CHUNK_PAGES)
+                n = SCHED_CHUNK_PAGES;
+        first = z->cursor;
+        weight = z->repairs + 1;
+        if (weight > SCHED_MAX_WEIGHT)
+                weight = SCHED_MAX_WEIGHT;
+        /* Charge in advance, so zone is already resorted when we unlock */
+        z->vtime += n * SCHED_STRIDE / weight;
+        heap_sift_down(s, 0);
+        pthread_mutex_unlock(&s->lock);
+
+        for (i = first; i < first + n; i++) {
+                uint8_t *page = z->base + i * PAGE_SIZE;
+
+                if (page_verify(&z->meta[i], page) == PAGE_OK)
+                        continue;
+                ret = page_repair(&z->meta[i], page);
+                if (ret == PAGE_REPAIRED) {
+                        repaired++;
+                } else {
+                        fprintf(stderr, "scrub: page %p damaged, can't repair\n", page);
+                        bad++;
+                }
+        }
+
+        pthread_mutex_lock(&s->lock);
+        z->cursor = (first + n) % z->pages;
+        z->repairs += repaired;
+        s->stats.verified += n;
+        s->stats.repaired += repaired;
+        s->stats.bad += bad;
+        s->scanned_pages += n;
+        if (z->covered < z->pages) {
+                size_t add = z->pages - z->covered;
+
+                if (add > n)
+                        add = n;
+                z->covered += add;
+                s->covered_pages += add;
+        }
+        if (s->covered_pages == s->total_pages) {
+                for (i = 0; i < s->nr_zones; i++)
+                        s->zones[i].covered = 0;
+                s->covered_pages = 0;
+                s->scanned_pages = 0;
+                s->stats.sweeps++;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        return bad;
+}
+
+static void *sched_worker(void *arg) {
+        struct scrub_sched *s = arg;
+        struct sched_param param = { .sched_priority = 0 };
+
+        /* Run only when CPU has nothing better to do */
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+        while (__atomic_load_n(&s->running, __ATOMIC_RELAXED))
+                scrub_sched_step(s);
+
+        return NULL;
+}
+
+int scrub_sched_start(struct scrub_sched *s) {
+        int ret;
+
+        __atomic_store_n(&s->running, 1, __ATOMIC_RELAXED);
+        ret = pthread_create(&s->thread, NULL, sched_worker, s);
+        if (ret) {
+                s->running = 0;
+                return -ret;
+        }
+
+        return 0;
+}
+
+void scrub_sched_stop(struct scrub_sched *s) {
+        if (!s->running)
+                return;
+        pthread_mutex_lock(&s->lock);
+        __atomic_store_n(&s->running, 0, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+}
+
+/**
+ * scrub_sched_progress - snapshot of sweep progress and counters
+ * @s - scheduler
+ * @p - output
+ *
+ * ETA accounts for extra visits of zones with repair history,
+ * seen so far in the current sweep.
+ */
+
+void scrub_sched_progress(struct scrub_sched *s, struct scrub_progress *p) {
+        uint64_t remain;
+
+        pthread_mutex_lock(&s->lock);
+        *p = s->stats;
+        p->done = s->covered_pages * PAGE_SIZE;
+        remain = (s->total_pages - s->covered_pages) * PAGE_SIZE;
+        if (s->covered_pages)
+                remain = remain * s->scanned_pages / s->covered_pages;
+        p->eta = remain / s->rate;
+        pthread_mutex_unlock(&s->lock);
+}
+
+void scrub_sched_free(struct scrub_sched *s) {
+        scrub_sched_stop(s);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->wake);
+        free(s->zones);
+        free(s->heap);
+        s->zones = NULL;
+        s->heap = NULL;
+        s->nr_zones = 0;
+}
@@ -0,0 +1,86 @@
+#ifndef SCRUB_SCHED_H
+#define SCRUB_SCHED_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "verify.h"
+
+/* Pages scrubbed between two scheduling decisions, 64 KiB */
+#define SCHED_CHUNK_PAGES 16
+/* Default zone size, one huge page */
+#define SCHED_ZONE_PAGES 512
+/* Repair history half-life, one hour */
+#define SCHED_DECAY_NS (3600ULL*1000*1000*1000)
+
+/**
+ * struct sched_zone - unit of scrub prioritization
+ * @cursor - next page of current walk over the zone
+ * @covered - pages of the zone checked in current sweep
+ * @vtime - stride scheduling virtual time, lowest goes next
+ * @repairs - repair history, halved every SCHED_DECAY_NS
+ */
+struct sched_zone {
+        uint8_t *base;
+        struct page_meta *meta;
+        size_t pages;
+        size_t cursor;
+        size_t covered;
+        uint64_t vtime;
+        uint32_t repairs;
+        uint64_t decay_ns;
+};
+
+struct scrub_progress {
+        /* Completed sweeps over all zones */
+        uint64_t sweeps;
+        /* Bytes covered / total in current sweep */
+        uint64_t done;
+        uint64_t total;
+        /* Estimated seconds to end of current sweep */
+        uint64_t eta;
+        uint64_t verified;
+        uint64_t repaired;
+        uint64_t bad;
+};
+
+/**
+ * struct scrub_sched - background scrubber limited to @rate bytes/sec
+ *
+ * Zones with recent repairs are visited proportionally more often,
+ * worker runs as SCHED_IDLE to yield CPU to everything else.
+ */
+struct scrub_sched {
+        struct sched_zone *zones;
+        /* Min-heap of zone indexes ordered by vtime */
+        size_t *heap;
+        size_t nr_zones;
+        size_t zone_pages;
+        /* Token bucket */
+        uint64_t rate;
+        uint64_t burst;
+        uint64_t tokens;
+        uint64_t refill_ns;
+        /* Sweep accounting */
+        uint64_t total_pages;
+        uint64_t covered_pages;
+        uint64_t scanned_pages;
+        struct scrub_progress stats;
+        pthread_mutex_t lock;
+        /* Signalled on stop, wakes the worker from throttling */
+        pthread_cond_t wake;
+        pthread_t thread;
+        int running;
+};
+
+int scrub_sched_init(struct scrub_sched *s, uint64_t rate, size_t zone_pages);
+int scrub_sched_add(struct scrub_sched *s, void *base, struct page_meta *meta, size_t pages);
+void scrub_sched_note_repair(struct scrub_sched *s, const void *addr);
+int scrub_sched_step(struct scrub_sched *s);
+int scrub_sched_start(struct scrub_sched *s);
+void scrub_sched_stop(struct scrub_sched *s);
+void scrub_sched_progress(struct scrub_sched *s, struct scrub_progress *p);
+void scrub_sched_free(struct scrub_sched *s);
+
+#endif /* SCRUB_SCHED_H */
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vdclient.h"
+
+/**
+ * vdc_connect - connect to verifyd
+ * @c - connection
+ * @path - socket path, NULL for VD_DEFAULT_SOCKET
+ */
+
+int vdc_connect(struct vdc *c, const char *path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int ret;
+
+        memset(c, 0, sizeof(*c));
+        if (!path)
+                path = VD_DEFAULT_SOCKET;
+        if (strlen(path) >= sizeof(addr.sun_path))
+                return -ENAMETOOLONG;
+        strcpy(addr.sun_path, path);
+
+        c->req = malloc(VD_VERIFY_SIZE(VD_MAX_BATCH));
+        c->reply = malloc(VD_REPLY_SIZE(VD_MAX_BATCH));
+        if (!c->req || !c->reply) {
+                ret = -ENOMEM;
+                goto err;
+        }
+        c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (c->fd < 0) {
+                ret = -errno;
+                goto err;
+        }
+        if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+                ret = -errno;
+                close(c->fd);
+                goto err;
+        }
+        return 0;
+
+err:
+        free(c->req);
+        free(c->reply);
+        c->req = NULL;
+        c->reply = NULL;
+        c->fd = -1;
+        return ret;
+}
+
+/* Send one message, @fd rides along in SCM_RIGHTS if not negative */
+static int vdc_call(struct vdc *c, struct vd_hdr *msg, size_t len, int fd) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { .iov_base = msg, .iov_len = len };
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+        struct cmsghdr *cmsg;
+        ssize_t got;
+
+        msg->seq = ++c->seq;
+        if (fd >= 0) {
+                memset(control, 0, sizeof(control));
+                mh.msg_control = control;
+                mh.msg_controllen = sizeof(control);
+                cmsg = CMSG_FIRSTHDR(&mh);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        if (sendmsg(c->fd, &mh, MSG_NOSIGNAL) < 0)
+                return -errno;
+
+        got = recv(c->fd, c->reply, VD_REPLY_SIZE(VD_MAX_BATCH), 0);
+        if (got < 0)
+                return -errno;
+        if ((size_t) got < sizeof(*c->reply) || c->reply->hdr.seq != msg->seq ||
+            c->reply->hdr.type != msg->type)
+                return -EPROTO;
+        return c->reply->ret;
+}
+
+/**
+ * vdc_map - share a memfd with the daemon
+ * @c - connection
+ * @fd - memfd sealed with F_SEAL_SHRINK, may be closed afterwards
+ * @len - bytes to map
+ *
+ * Returns buffer id for struct vd_page or negative errno.
+ */
+
+int vdc_map(struct vdc *c, int fd, uint64_t len) {
+        struct vd_map msg = { .hdr.type = VD_MSG_MAP, .len = len };
+
+        return vdc_call(c, &msg.hdr, sizeof(msg), fd);
+}
+
+/**
+ * vdc_alloc - create, seal and share a buffer
+ * @c - connection
+ * @len - size in bytes, multiple of PAGE_SIZE
+ * @id - output, buffer id or negative errno on failure
+ *
+ * Returns the client mapping, or NULL.
+ */
+
+void *vdc_alloc(struct vdc *c, uint64_t len, int *id) {
+        void *mem = MAP_FAILED;
+        int fd;
+
+        fd = memfd_create("verifyd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+                *id = -errno;
+                return NULL;
+        }
+        if (ftruncate(fd, len) ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+                *id = -errno;
+                goto out;
+        }
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+                *id = -errno;
+                goto out;
+        }
+        *id = vdc_map(c, fd, len);
+        if (*id < 0) {
+                munmap(mem, len);
+                mem = MAP_FAILED;
+        }
+
+out:
+        close(fd);
+        return mem == MAP_FAILED ? NULL : mem;
+}
+
+int vdc_unmap(struct vdc *c, int id) {
+        struct vd_unmap msg = { .hdr.type = VD_MSG_UNMAP, .id = id };
+
+        return vdc_call(c, &msg.hdr, sizeof(msg), -1);
+}
+
+/**
+ * vdc_verify - verify and repair pages in shared buffers
+ * @c - connection
+ * @pages - pages and their metadata
+ * @n - number of pages, any, sent in VD_MAX_BATCH chunks
+ * @status - output, PAGE_OK, PAGE_REPAIRED or PAGE_BAD per page
+ *
+ * Repaired pages and their metadata are updated in place.
+ */
+
+int vdc_verify(struct vdc *c, const struct vd_page pages[], size_t n, int8_t status[]) {
+        size_t done, cnt;
+        int ret;
+
+        for (done = 0; done < n; done += cnt) {
+                cnt = n - done < VD_MAX_BATCH ? n - done : VD_MAX_BATCH;
+                c->req->hdr.type = VD_MSG_VERIFY;
+                c->req->nr = cnt;
+                memcpy(c->req->pages, pages + done, cnt * sizeof(*pages));
+                ret = vdc_call(c, &c->req->hdr, VD_VERIFY_SIZE(cnt), -1);
+                if (ret)
+                        return ret;
+                if (c->reply->nr != cnt)
+                        return -EPROTO;
+                memcpy(status + done, c->reply->status, cnt);
+        }
+
+        return 0;
+}
+
+void vdc_close(struct vdc *c) {
+        if (c->fd >= 0)
+                close(c->fd);
+        free(c->req);
+        free(c->reply);
+        c->fd = -1;
+        c->req = NULL;
+        c->reply = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef VDCLIENT_H
+#define VDCLIENT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "vdproto.h"
+
+/**
+ * struct vdc - connection to verifyd
+ *
+ * One request is in flight at a time, share a connection between
+ * threads only under a lock.
+ */
+struct vdc {
+        int fd;
+        uint32_t seq;
+        /* Request and reply of VD_MAX_BATCH pages */
+        struct vd_verify *req;
+        struct vd_reply *reply;
+};
+
+int vdc_connect(struct vdc *c, const char *path);
+int vdc_map(struct vdc *c, int fd, uint64_t len);
+void *vdc_alloc(struct vdc *c, uint64_t len, int *id);
+int vdc_unmap(struct vdc *c, int id);
+int vdc_verify(struct vdc *c, const struct vd_page pages[], size_t n, int8_t status[]);
+void vdc_close(struct vdc *c);
+
+#endif /* VDCLIENT_H */
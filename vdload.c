@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "vdclient.h"
+#include "verify.h"
+
+/*
+ * Load generator for verifyd: every thread is one client with its own
+ * shared buffers, sends batches of random pages and flips one bit in
+ * some of them first. Flipped pages must come back repaired and clean
+ * pages untouched, anything else is counted as an error.
+ */
+
+/* Batch latency histogram, bucket i holds [2^i, 2^(i+1)) ns */
+#define LAT_BUCKETS 40
+
+struct load {
+        const char *path;
+        unsigned nr_clients;
+        size_t nr_pages;
+        size_t batch;
+        /* Pages in 1000 with a bit flipped before sending */
+        unsigned flip_rate;
+        uint64_t run_ns;
+};
+
+struct client {
+        struct load *l;
+        pthread_t thread;
+        int err;
+        uint64_t batches;
+        uint64_t pages;
+        uint64_t repaired;
+        uint64_t errors;
+        uint64_t lat[LAT_BUCKETS];
+};
+
+static inline uint64_t xorshift64(uint64_t *state) {
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        *state = x;
+        return x;
+}
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void *client_fn(void *arg) {
+        struct client *cl = arg;
+        struct load *l = cl->l;
+        uint64_t rng = (uintptr_t) cl ^ now_ns();
+        uint64_t start, deadline, t, *words, bit;
+        struct page_meta *meta;
+        struct vd_page *reqs;
+        int8_t *status;
+        uint8_t *pages, *flipped;
+        size_t meta_len = (l->nr_pages * sizeof(*meta) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1ULL);
+        int page_id, meta_id;
+        struct vdc c;
+        size_t i, idx;
+
+        cl->err = vdc_connect(&c, l->path);
+        if (cl->err)
+                return NULL;
+        pages = vdc_alloc(&c, l->nr_pages * PAGE_SIZE, &page_id);
+        meta = vdc_alloc(&c, meta_len, &meta_id);
+        reqs = calloc(l->batch, sizeof(*reqs));
+        status = calloc(l->batch, sizeof(*status));
+        flipped = calloc(l->batch, 1);
+        if (!pages || !meta || !reqs || !status || !flipped) {
+                cl->err = !pages ? page_id : !meta ? meta_id : -ENOMEM;
+                goto out;
+        }
+
+        words = (uint64_t *) pages;
+        for (i = 0; i < l->nr_pages * PAGE_SIZE / sizeof(*words); i++)
+                words[i] = xorshift64(&rng);
+        for (i = 0; i < l->nr_pages; i++)
+                page_meta_init(&meta[i], pages + i * PAGE_SIZE);
+
+        deadline = now_ns() + l->run_ns;
+        do {
+                /* Distinct pages: a batch holds at most one fault per page */
+                idx = xorshift64(&rng) % l->nr_pages;
+                for (i = 0; i < l->batch; i++) {
+                        reqs[i] = (struct vd_page) { page_id, meta_id, (idx + i) % l->nr_pages * PAGE_SIZE,
+                                                     (idx + i) % l->nr_pages * sizeof(*meta) };
+                        flipped[i] = xorshift64(&rng) % 1000 < l->flip_rate;
+                        if (flipped[i]) {
+                                bit = xorshift64(&rng) % (PAGE_SIZE * 8);
+                                pages[reqs[i].page_off + bit / 8] ^= 1 << bit % 8;
+                        }
+                }
+
+                start = now_ns();
+                cl->err = vdc_verify(&c, reqs, l->batch, status);
+                t = now_ns();
+                if (cl->err)
+                        break;
+                cl->lat[63 - __builtin_clzll((t - start) | 1)]++;
+
+                for (i = 0; i < l->batch; i++) {
+                        if (status[i] == PAGE_REPAIRED)
+                                cl->repaired++;
+                        if (status[i] != (flipped[i] ? PAGE_REPAIRED : PAGE_OK) ||
+                            page_verify(&meta[reqs[i].page_off / PAGE_SIZE], pages + reqs[i].page_off))
+                                cl->errors++;
+                }
+                cl->batches++;
+                cl->pages += l->batch;
+        } while (t < deadline);
+
+out:
+        if (pages)
+                munmap(pages, l->nr_pages * PAGE_SIZE);
+        if (meta)
+                munmap(meta, meta_len);
+        free(reqs);
+        free(status);
+        free(flipped);
+        vdc_close(&c);
+        return NULL;
+}
+
+static uint64_t lat_quantile(const uint64_t lat[], uint64_t total, double q) {
+        uint64_t seen = 0, want = total * q;
+        int i;
+
+        for (i = 0; i < LAT_BUCKETS; i++) {
+                seen += lat[i];
+                if (seen > want)
+                        return 2ULL << i;
+        }
+        return 2ULL << (LAT_BUCKETS - 1);
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-s socket] [-c clients] [-n pages] [-b batch] [-f flips] [-d seconds]\n"
+                "  -n  pages shared by each client (default 4096)\n"
+                "  -b  pages per request (default 64)\n"
+                "  -f  pages in 1000 with a bit flipped before the request (default 10)\n",
+                prog);
+}
+
+int main(int argc, char **argv) {
+        struct load l = { VD_DEFAULT_SOCKET, 4, 4096, 64, 10, 5000000000ULL };
+        struct client *clients, sum = { 0 };
+        uint64_t start;
+        unsigned i, b;
+        int opt, ret = 0;
+
+        while ((opt = getopt(argc, argv, "s:c:n:b:f:d:h")) != -1) {
+                switch (opt) {
+                case 's':
+                        l.path = optarg;
+                        break;
+                case 'c':
+                        l.nr_clients = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        l.nr_pages = strtoull(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        l.batch = strtoull(optarg, NULL, 0);
+                        break;
+                case 'f':
+                        l.flip_rate = strtoul(optarg, NULL, 0);
+                        break;
+                case 'd':
+                        l.run_ns = strtoull(optarg, NULL, 0) * 1000000000ULL;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+        if (!l.nr_clients || !l.nr_pages || !l.batch || l.batch > l.nr_pages || l.flip_rate > 1000) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        clients = calloc(l.nr_clients, sizeof(*clients));
+        if (!clients)
+                return 1;
+        start = now_ns();
+        for (i = 0; i < l.nr_clients; i++) {
+                clients[i].l = &l;
+                if (pthread_create(&clients[i].thread, NULL, client_fn, &clients[i])) {
+                        l.nr_clients = i;
+                        break;
+                }
+        }
+        for (i = 0; i < l.nr_clients; i++) {
+                pthread_join(clients[i].thread, NULL);
+                if (clients[i].err) {
+                        fprintf(stderr, "vdload: client %u: %s\n", i, strerror(-clients[i].err));
+                        ret = 1;
+                }
+                sum.batches += clients[i].batches;
+                sum.pages += clients[i].pages;
+                sum.repaired += clients[i].repaired;
+                sum.errors += clients[i].errors;
+                for (b = 0; b < LAT_BUCKETS; b++)
+                        sum.lat[b] += clients[i].lat[b];
+        }
+        start = now_ns() - start;
+
+        printf("clients: %u, batch: %zu, %.0f requests/s, %.0f pages/s, %.1f MiB/s\n",
+               l.nr_clients, l.batch, sum.batches * 1e9 / start, sum.pages * 1e9 / start,
+               sum.pages * PAGE_SIZE * 1e9 / start / (1024 * 1024));
+        printf("repaired: %" PRIu64 ", errors: %" PRIu64 ", latency p50: %.1f us, p99: %.1f us\n",
+               sum.repaired, sum.errors, lat_quantile(sum.lat, sum.batches, 0.5) / 1000.0,
+               lat_quantile(sum.lat, sum.batches, 0.99) / 1000.0);
+
+        free(clients);
+        return ret || sum.errors ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+#ifndef VDPROTO_H
+#define VDPROTO_H
+
+#include <inttypes.h>
+
+/*
+ * Wire format of verifyd, one message per SOCK_SEQPACKET packet.
+ *
+ * Clients hand pages over as memfd buffers: VD_MSG_MAP carries the fd
+ * in SCM_RIGHTS, the daemon maps it shared and answers with a buffer
+ * id. VD_MSG_VERIFY then names pages and their struct page_meta by
+ * buffer id and offset, pages are checked and repaired in place and
+ * only statuses travel back. Buffers must be sealed against shrinking,
+ * a shrunk buffer would fault the daemon.
+ */
+
+#define VD_DEFAULT_SOCKET "/tmp/verifyd.sock"
+
+#define VD_MSG_MAP 1
+#define VD_MSG_UNMAP 2
+#define VD_MSG_VERIFY 3
+
+/* Buffers one connection may have mapped */
+#define VD_MAX_MAPS 64
+/* Pages in one VD_MSG_VERIFY */
+#define VD_MAX_BATCH 1024
+
+struct vd_hdr {
+        uint32_t type;
+        uint32_t seq;
+};
+
+/* VD_MSG_MAP, fd of the memfd in SCM_RIGHTS */
+struct vd_map {
+        struct vd_hdr hdr;
+        uint64_t len;
+};
+
+/* VD_MSG_UNMAP */
+struct vd_unmap {
+        struct vd_hdr hdr;
+        uint32_t id;
+        uint32_t pad;
+};
+
+/**
+ * struct vd_page - one page of a verify request
+ * @buf - buffer id holding the page
+ * @meta_buf - buffer id holding its struct page_meta
+ * @page_off - page offset in @buf, PAGE_SIZE aligned
+ * @meta_off - record offset in @meta_buf, 8 byte aligned
+ */
+struct vd_page {
+        uint32_t buf;
+        uint32_t meta_buf;
+        uint64_t page_off;
+        uint64_t meta_off;
+};
+
+/* VD_MSG_VERIFY */
+struct vd_verify {
+        struct vd_hdr hdr;
+        uint32_t nr;
+        uint32_t pad;
+        struct vd_page pages[];
+};
+
+/**
+ * struct vd_reply - answer to every message, same type and seq
+ * @ret - buffer id for VD_MSG_MAP, else 0, negative errno on failure
+ * @nr - entries of @status, VD_MSG_VERIFY only
+ * @status - PAGE_OK, PAGE_REPAIRED or PAGE_BAD of each page
+ */
+struct vd_reply {
+        struct vd_hdr hdr;
+        int32_t ret;
+        uint32_t nr;
+        int8_t status[];
+};
+
+#define VD_VERIFY_SIZE(n) (sizeof(struct vd_verify) + (n) * sizeof(struct vd_page))
+#define VD_REPLY_SIZE(n) (sizeof(struct vd_reply) + (n))
+
+#endif /* VDPROTO_H */
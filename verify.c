@@ -0,0 +1,473 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "verify.h"
+#include "crc32.h"
+#include "xxhash.h"
+#include "fixed.h"
+#include "pool.h"
+#include "repair.h"
+#include "metrics.h"
+
+/* Checksums of constant pages, computed once instead of hashing */
+static pthread_once_t page_fill_once = PTHREAD_ONCE_INIT;
+static struct crc32c_fill_op page_fill_op;
+static uint32_t zero_page_crc;
+static uint64_t zero_page_xxh64;
+
+static void page_fill_init(void) {
+        static const uint8_t zero_page[PAGE_SIZE];
+
+        crc32c_fill_init(&page_fill_op, PAGE_SIZE);
+        zero_page_crc = crc32c_fill_apply(&page_fill_op, 0);
+        zero_page_xxh64 = xxh64(zero_page, PAGE_SIZE, 0);
+}
+
+static inline uint32_t page_fill_crc(uint64_t fill) {
+        pthread_once(&page_fill_once, page_fill_init);
+        return fill ? crc32c_fill_apply(&page_fill_op, fill) : zero_page_crc;
+}
+
+/**
+ * page_crc32c - crc32c() of a page, constant pages are not hashed
+ * @page - PAGE_SIZE bytes of data, 8 byte aligned
+ */
+
+uint32_t page_crc32c(const void *page) {
+        uint64_t fill;
+
+        if (fparity64_fill(page, PAGE_SIZE, 0, NULL, &fill))
+                return page_fill_crc(fill);
+        return crc32c_fixed(0, page, PAGE_SIZE);
+}
+
+/**
+ * page_xxh64 - xxh64() of a page with seed 0, zero pages are not hashed
+ * @page - PAGE_SIZE bytes of data, 8 byte aligned
+ */
+
+uint64_t page_xxh64(const void *page) {
+        uint64_t fill;
+
+        if (fparity64_fill(page, PAGE_SIZE, 0, NULL, &fill) && !fill) {
+                pthread_once(&page_fill_once, page_fill_init);
+                return zero_page_xxh64;
+        }
+        return xxh64_fixed(page, PAGE_SIZE, 0);
+}
+
+/**
+ * page_meta_init - compute protection values of a page
+ * @meta - record to fill
+ * @page - PAGE_SIZE bytes of data, 8 byte aligned
+ *
+ * Parity pass stops comparing at the first cache line differing from
+ * the page start, CRC32C of constant pages is derived, not hashed.
+ */
+
+void page_meta_init(struct page_meta *meta, const void *page) {
+        uint64_t fill;
+
+        if (fparity64_fill(page, PAGE_SIZE, 0, &meta->parity, &fill))
+                meta->crc = page_fill_crc(fill);
+        else
+                meta->crc = crc32c_fixed(0, page, PAGE_SIZE);
+        meta->flags |= PAGE_META_VALID;
+}
+
+/**
+ * page_verify - check page against its stored protection values
+ * @meta - record filled by page_meta_init()
+ * @page - PAGE_SIZE bytes of data
+ *
+ * Only CRC32C is checked, parity is kept for repair.
+ * Returns PAGE_OK or PAGE_BAD.
+ */
+
+int page_verify(const struct page_meta *meta, const void *page) {
+        METRIC_START(start);
+        int ret = PAGE_OK;
+
+        if (!(meta->flags & PAGE_META_VALID))
+                return PAGE_OK;
+        if (page_crc32c(page) != meta->crc)
+                ret = PAGE_BAD;
+        METRIC_RECORD(METRIC_VERIFY, PAGE_SIZE, start, ret == PAGE_BAD);
+        return ret;
+}
+
+/* Pages prefetched ahead of the one being hashed, see verify_pages() */
+static unsigned verify_prefetch = VERIFY_PREFETCH;
+
+/**
+ * verify_pages_set_prefetch - tune verify_pages() prefetch distance
+ * @distance - pages ahead, 0 turns prefetch off
+ *
+ * One page ahead covers DRAM latency at CRC32C speed, more helps when
+ * pages are scattered over remote nodes or the memory system is busy.
+ */
+
+void verify_pages_set_prefetch(unsigned distance) {
+        __atomic_store_n(&verify_prefetch, distance, __ATOMIC_RELAXED);
+}
+
+static inline void page_prefetch(const void *page) {
+        const char *ptr = (const char *) page;
+        size_t off;
+
+        for (off = 0; off < PAGE_SIZE; off += 64)
+                __builtin_prefetch(ptr + off, 0, 3);
+}
+
+/**
+ * verify_pages - page_verify() of many pages at once
+ * @pages - page pointers
+ * @meta - metadata of each page
+ * @n - number of pages
+ * @bad_bitmap - output, bit i set if page i failed, (@n + 63) / 64 words
+ *
+ * Page i + distance is prefetched while page i is hashed, so memory
+ * latency overlaps with hashing. CRCs of 64 pages are compared to the
+ * stored ones with vector compares into one bitmap word.
+ * Returns number of failed pages.
+ */
+
+size_t verify_pages(const void *const pages[], const struct page_meta meta[], size_t n,
+                    uint64_t *bad_bitmap) {
+        typedef uint32_t vec __attribute__((vector_size(32)));
+        typedef int32_t vmask __attribute__((vector_size(32)));
+        uint32_t got[64] __attribute__((aligned(32)));
+        uint32_t want[64] __attribute__((aligned(32)));
+        unsigned dist = __atomic_load_n(&verify_prefetch, __ATOMIC_RELAXED);
+        size_t base, cnt, i, j, bad = 0;
+        uint64_t word;
+        vec a, b;
+        vmask ne;
+        METRIC_START(start);
+
+        for (i = 0; i < dist && i < n; i++)
+                page_prefetch(pages[i]);
+
+        for (base = 0; base < n; base += 64) {
+                cnt = n - base < 64 ? n - base : 64;
+                for (i = 0; i < cnt; i++) {
+                        if (dist && base + i + dist < n)
+                                page_prefetch(pages[base + i + dist]);
+                        if (meta[base + i].flags & PAGE_META_VALID) {
+                                got[i] = page_crc32c(pages[base + i]);
+                                want[i] = meta[base + i].crc;
+                        } else {
+                                got[i] = want[i] = 0;
+                        }
+                }
+                for (; i < 64; i++)
+                        got[i] = want[i] = 0;
+
+                word = 0;
+                for (i = 0; i < 64; i += 8) {
+                        memcpy(&a, &got[i], sizeof(a));
+                        memcpy(&b, &want[i], sizeof(b));
+                        ne = a != b;
+                        for (j = 0; j < 8; j++)
+                                word |= (uint64_t) (ne[j] & 1) << (i + j);
+                }
+                bad_bitmap[base / 64] = word;
+                bad += __builtin_popcountll(word);
+        }
+
+        METRIC_RECORD(METRIC_VERIFY, n * PAGE_SIZE, start, bad);
+        return bad;
+}
+
+static struct fault_map *repair_hints;
+
+/**
+ * page_repair_set_hints - use fault map for all following page_repair()
+ * @map - open fault map, NULL to stop using it
+ *
+ * Map must stay open while repairs may run.
+ */
+
+void page_repair_set_hints(struct fault_map *map) {
+        __atomic_store_n(&repair_hints, map, __ATOMIC_RELEASE);
+}
+
+/**
+ * page_repair - try to fix a page which failed page_verify()
+ * @meta - record filled by page_meta_init()
+ * @page - PAGE_SIZE bytes of data, fixed in place
+ *
+ * Damage inside one stripe is rebuilt from parity, a burst of up to
+ * 32 bits crossing stripes is located by the CRC32C syndrome.
+ * Returns PAGE_REPAIRED or PAGE_BAD if damage is out of reach.
+ */
+
+int page_repair(struct page_meta *meta, void *page) {
+        struct fault_map *hints = __atomic_load_n(&repair_hints, __ATOMIC_ACQUIRE);
+        uint64_t region = hints ? hint_region(page) : 0;
+
+        if (fparity64_repair_hinted(hints, region, page, PAGE_SIZE, meta->parity, meta->crc) < 0 &&
+            crc32c_burst_repair(page, PAGE_SIZE, meta->crc, 32, &meta->parity) < 0)
+                return PAGE_BAD;
+        meta->flags |= PAGE_META_REPAIRED;
+        return PAGE_REPAIRED;
+}
+
+/**
+ * parity_repair_erasure - rebuild a damaged range whose place is known
+ * @page - PAGE_SIZE bytes of data, 8 byte aligned, fixed in place
+ * @meta - record filled by page_meta_init()
+ * @offset - first damaged byte
+ * @len - damaged bytes
+ * @group - other pages of the parity group and its page_group_parity(), or NULL
+ * @nr_group - number of pages in @group
+ *
+ * Up to 8 bytes, aligned or not, sit at distinct byte positions of a
+ * stripe, so the parity syndrome is their damage: one parity pass and
+ * one XOR, no search over stripes. Longer ranges are rebuilt as XOR of
+ * the same range of @group. Either way one CRC32C confirms the result,
+ * a refused range is left as it was.
+ * Returns PAGE_REPAIRED, PAGE_OK if the page was intact or PAGE_BAD.
+ */
+
+int parity_repair_erasure(void *page, struct page_meta *meta, uint32_t offset, uint32_t len,
+                          const void *const group[], size_t nr_group) {
+        uint8_t *ptr = (uint8_t *) page, own[PAGE_SIZE], *saved;
+        uint64_t syndrome, mask = 0;
+        int ret = PAGE_BAD;
+        uint32_t i;
+        size_t g;
+        METRIC_START(start);
+
+        if (!(meta->flags & PAGE_META_VALID) || !len || offset >= PAGE_SIZE || len > PAGE_SIZE - offset)
+                goto out;
+
+        if (len <= sizeof(syndrome)) {
+                syndrome = fparity64(page, PAGE_SIZE, meta->parity);
+                if (!syndrome) {
+                        ret = page_crc32c(page) == meta->crc ? PAGE_OK : PAGE_BAD;
+                        goto out;
+                }
+                /* Damage outside of the range shows in other syndrome bytes */
+                for (i = offset; i < offset + len; i++)
+                        mask |= 0xffULL << i % 8 * 8;
+                if (syndrome & ~mask)
+                        goto out;
+                for (i = offset; i < offset + len; i++)
+                        ptr[i] ^= syndrome >> i % 8 * 8;
+                if (page_crc32c(page) == meta->crc) {
+                        ret = PAGE_REPAIRED;
+                        goto out;
+                }
+                for (i = offset; i < offset + len; i++)
+                        ptr[i] ^= syndrome >> i % 8 * 8;
+                goto out;
+        }
+
+        if (!group || !nr_group)
+                goto out;
+        /* Node local buffer when repairing on a pool worker */
+        saved = pool_scratch();
+        if (!saved)
+                saved = own;
+        memcpy(saved, ptr + offset, len);
+        memcpy(ptr + offset, (const uint8_t *) group[0] + offset, len);
+        for (g = 1; g < nr_group; g++)
+                for (i = offset; i < offset + len; i++)
+                        ptr[i] ^= ((const uint8_t *) group[g])[i];
+        if (page_crc32c(page) == meta->crc) {
+                /* Rebuilt range may have been intact */
+                ret = memcmp(saved, ptr + offset, len) ? PAGE_REPAIRED : PAGE_OK;
+                goto out;
+        }
+        memcpy(ptr + offset, saved, len);
+
+out:
+        if (ret == PAGE_REPAIRED)
+                meta->flags |= PAGE_META_REPAIRED;
+        METRIC_RECORD(METRIC_REPAIR_ERASURE, len, start, ret == PAGE_BAD);
+        return ret;
+}
+
+/**
+ * page_group_parity - parity page of a group for parity_repair_erasure()
+ * @parity - output, PAGE_SIZE bytes
+ * @pages - pages of the group
+ * @n - number of pages
+ */
+
+void page_group_parity(void *parity, const void *const pages[], size_t n) {
+        uint64_t *out = (uint64_t *) parity;
+        size_t i, w;
+
+        memset(out, 0, PAGE_SIZE);
+        for (i = 0; i < n; i++)
+                for (w = 0; w < PAGE_SIZE / sizeof(*out); w++)
+                        out[w] ^= ((const uint64_t *) pages[i])[w];
+}
+
+struct verify_task {
+        struct pool_task task;
+        struct verify_batch *batch;
+        size_t first;
+        size_t count;
+        /* Damaged pages of the task, left to repair_task_fn() */
+        uint64_t bad[(VERIFY_GRAIN + 63) / 64];
+};
+
+struct verify_batch {
+        struct pool *pool;
+        void *const *pages;
+        struct page_meta *meta;
+        size_t n;
+        verify_cb cb;
+        void *arg;
+        /* Unfinished tasks, verify and repair */
+        long pending;
+        long bad;
+        int finished;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        struct verify_task tasks[];
+};
+
+static void verify_task_put(struct verify_batch *b) {
+        if (__atomic_sub_fetch(&b->pending, 1, __ATOMIC_ACQ_REL))
+                return;
+        pthread_mutex_lock(&b->lock);
+        b->finished = 1;
+        pthread_cond_broadcast(&b->done);
+        pthread_mutex_unlock(&b->lock);
+}
+
+static void repair_task_fn(struct pool_task *task) {
+        struct verify_task *vt = pool_entry(task, struct verify_task, task);
+        struct verify_batch *b = vt->batch;
+        size_t i;
+        int status;
+
+        for (i = vt->first; i < vt->first + vt->count; i++) {
+                if (!(vt->bad[(i - vt->first) / 64] >> ((i - vt->first) % 64) & 1))
+                        continue;
+                status = page_repair(&b->meta[i], b->pages[i]);
+                if (status != PAGE_REPAIRED)
+                        __atomic_add_fetch(&b->bad, 1, __ATOMIC_RELAXED);
+                if (b->cb)
+                        b->cb(b->arg, i, status);
+        }
+
+        verify_task_put(b);
+}
+
+static void verify_task_fn(struct pool_task *task) {
+        struct verify_task *vt = pool_entry(task, struct verify_task, task);
+        struct verify_batch *b = vt->batch;
+
+        if (!verify_pages((const void *const *) b->pages + vt->first, b->meta + vt->first,
+                          vt->count, vt->bad)) {
+                verify_task_put(b);
+                return;
+        }
+
+        /* Repair costs hundreds of verifies, let an idle worker take it */
+        vt->task.fn = repair_task_fn;
+        pool_submit_heavy(b->pool, &vt->task);
+}
+
+/**
+ * verify_pages_async - verify and repair pages on a thread pool
+ * @pool - work stealing pool
+ * @pages - page pointers
+ * @meta - metadata of each page, updated on repair
+ * @n - number of pages
+ * @cb - optional per damaged page verdict
+ * @arg - cookie for @cb
+ *
+ * Pages are split in VERIFY_GRAIN sized tasks, a task finding damaged
+ * pages is queued again as a heavy one repairing them, so the repair
+ * path allocates nothing. On a pool from pool_init_numa()
+ * tasks go to workers of the node holding the pages. Returns batch handle to pass
+ * to verify_batch_wait() or NULL on allocation failure.
+ */
+
+struct verify_batch *verify_pages_async(struct pool *pool, void *const pages[],
+                                        struct page_meta meta[], size_t n,
+                                        verify_cb cb, void *arg) {
+        size_t nr_tasks = (n + VERIFY_GRAIN - 1) / VERIFY_GRAIN;
+        struct verify_batch *b;
+        void **first = NULL;
+        int *nodes = NULL;
+        size_t i;
+
+        b = malloc(sizeof(*b) + nr_tasks * sizeof(b->tasks[0]));
+        if (!b)
+                return NULL;
+
+        b->pool = pool;
+        b->pages = pages;
+        b->meta = meta;
+        b->n = n;
+        b->cb = cb;
+        b->arg = arg;
+        /* Own reference keeps batch alive until everything is queued */
+        b->pending = nr_tasks + 1;
+        b->bad = 0;
+        b->finished = 0;
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_cond_init(&b->done, NULL);
+
+        /* Send each task to a worker on the node owning its pages */
+        if (pool->pinned) {
+                first = malloc(nr_tasks * sizeof(*first));
+                nodes = malloc(nr_tasks * sizeof(*nodes));
+                if (first && nodes) {
+                        for (i = 0; i < nr_tasks; i++)
+                                first[i] = pages[i * VERIFY_GRAIN];
+                        if (numa_page_nodes(first, nodes, nr_tasks)) {
+                                free(nodes);
+                                nodes = NULL;
+                        }
+                }
+        }
+
+        for (i = 0; i < nr_tasks; i++) {
+                struct verify_task *vt = &b->tasks[i];
+
+                vt->task.fn = verify_task_fn;
+                vt->batch = b;
+                vt->first = i * VERIFY_GRAIN;
+                vt->count = n - vt->first < VERIFY_GRAIN ? n - vt->first : VERIFY_GRAIN;
+                pool_submit_node(pool, nodes ? nodes[i] : -1, &vt->task);
+        }
+        verify_task_put(b);
+
+        free(first);
+        free(nodes);
+
+        return b;
+}
+
+/**
+ * verify_batch_wait - wait for batch completion and release it
+ * @batch - handle from verify_pages_async()
+ *
+ * Returns number of pages left damaged.
+ */
+
+long verify_batch_wait(struct verify_batch *batch) {
+        long bad;
+
+        pthread_mutex_lock(&batch->lock);
+        while (!batch->finished)
+                pthread_cond_wait(&batch->done, &batch->lock);
+        pthread_mutex_unlock(&batch->lock);
+
+        bad = batch->bad;
+        pthread_cond_destroy(&batch->done);
+        pthread_mutex_destroy(&batch->lock);
+        free(batch);
+
+        return bad;
+}
@@ -0,0 +1,73 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <inttypes.h>
+
+#include "parity.h"
+
+/**
+ * struct page_meta - stored protection values of one page
+ * @parity - fparity64() of the page, seed 0
+ * @crc - crc32c() of the page, seed 0
+ * @flags - PAGE_META_* bits
+ *
+ * Four records share a cache line.
+ */
+struct page_meta {
+        uint64_t parity;
+        uint32_t crc;
+        uint32_t flags;
+};
+
+/* Record holds values for current page content */
+#define PAGE_META_VALID (1 << 0)
+/* Page was damaged and repaired at least once */
+#define PAGE_META_REPAIRED (1 << 1)
+
+/* Return values of page_verify() and page_repair() */
+#define PAGE_OK 0
+#define PAGE_BAD -1
+#define PAGE_REPAIRED 1
+
+uint32_t page_crc32c(const void *page);
+uint64_t page_xxh64(const void *page);
+void page_meta_init(struct page_meta *meta, const void *page);
+int page_verify(const struct page_meta *meta, const void *page);
+int page_repair(struct page_meta *meta, void *page);
+
+int parity_repair_erasure(void *page, struct page_meta *meta, uint32_t offset, uint32_t len,
+                          const void *const group[], size_t nr_group);
+void page_group_parity(void *parity, const void *const pages[], size_t n);
+
+struct fault_map;
+void page_repair_set_hints(struct fault_map *map);
+
+/* Default verify_pages() prefetch distance in pages */
+#define VERIFY_PREFETCH 2
+
+size_t verify_pages(const void *const pages[], const struct page_meta meta[], size_t n,
+                    uint64_t *bad_bitmap);
+void verify_pages_set_prefetch(unsigned distance);
+
+struct pool;
+struct verify_batch;
+
+/* Pages checked by one pool task */
+#define VERIFY_GRAIN 16
+
+/**
+ * verify_cb - verdict on a page which failed verification
+ * @arg - caller cookie
+ * @idx - page index in the batch
+ * @status - PAGE_REPAIRED or PAGE_BAD
+ *
+ * Called from pool workers, clean pages are not reported.
+ */
+typedef void (*verify_cb)(void *arg, size_t idx, int status);
+
+struct verify_batch *verify_pages_async(struct pool *pool, void *const pages[],
+                                        struct page_meta meta[], size_t n,
+                                        verify_cb cb, void *arg);
+long verify_batch_wait(struct verify_batch *batch);
+
+#endif /* VERIFY_H */
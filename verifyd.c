@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "vdproto.h"
+#include "vsvc.h"
+#include "verify.h"
+#include "fixed.h"
+
+/*
+ * Verification daemon: one process keeps the verifier threads and the
+ * CRC and repair tables warm for every client on the host. Pages stay
+ * in client memfd buffers mapped shared on both sides, requests carry
+ * offsets only.
+ *
+ * One poll loop reads a message from every ready client, requests of
+ * all of them go to the verifiers as one batch, replies go out once
+ * the batch is done.
+ */
+
+#define VD_MAX_CLIENTS 64
+
+struct vd_buf {
+        uint8_t *mem;
+        uint64_t len;
+        /* File behind the mapping, mapped at most once per client */
+        dev_t dev;
+        ino_t ino;
+};
+
+struct vd_client {
+        int fd;
+        struct vd_buf maps[VD_MAX_MAPS];
+        /* Verify request taken in this round, if any */
+        struct vd_verify *msg;
+        uint32_t nr;
+        struct vreq reqs[VD_MAX_BATCH];
+        struct vd_reply *reply;
+};
+
+struct verifyd {
+        const char *path;
+        int listen_fd;
+        struct vsvc svc;
+        struct vd_client *clients[VD_MAX_CLIENTS];
+        /* Whole round, pointers into the clients' reqs */
+        struct vreq **batch;
+        struct vreq **reaped;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+        stop = 1;
+}
+
+/* A client not reading its replies gets -EAGAIN and is dropped, the loop never blocks on it */
+static int reply_send(struct vd_client *cl, const struct vd_hdr *hdr, int ret, uint32_t nr) {
+        cl->reply->hdr = *hdr;
+        cl->reply->ret = ret;
+        cl->reply->nr = nr;
+        if (send(cl->fd, cl->reply, VD_REPLY_SIZE(nr), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+                return -errno;
+        return 0;
+}
+
+static void client_free(struct vd_client *cl) {
+        int i;
+
+        for (i = 0; i < VD_MAX_MAPS; i++)
+                if (cl->maps[i].mem)
+                        munmap(cl->maps[i].mem, cl->maps[i].len);
+        close(cl->fd);
+        free(cl->msg);
+        free(cl->reply);
+        free(cl);
+}
+
+static struct vd_client *client_new(int fd) {
+        struct vd_client *cl = calloc(1, sizeof(*cl));
+
+        if (!cl)
+                return NULL;
+        cl->fd = fd;
+        cl->msg = malloc(VD_VERIFY_SIZE(VD_MAX_BATCH));
+        cl->reply = malloc(VD_REPLY_SIZE(VD_MAX_BATCH));
+        if (!cl->msg || !cl->reply) {
+                client_free(cl);
+                return NULL;
+        }
+        return cl;
+}
+
+/*
+ * Map a client memfd, refused unless it cannot shrink under us. A file
+ * mapped already is refused too, so every page of the client has one
+ * address here and duplicate checks can go by address.
+ */
+static int client_map(struct vd_client *cl, int fd, uint64_t len) {
+        struct stat st;
+        int id, seals;
+        void *mem;
+
+        seals = fcntl(fd, F_GET_SEALS);
+        if (seals < 0 || !(seals & F_SEAL_SHRINK))
+                return -EPERM;
+        if (fstat(fd, &st))
+                return -errno;
+        if (!len || len > (uint64_t) st.st_size)
+                return -EINVAL;
+        for (id = 0; id < VD_MAX_MAPS; id++)
+                if (cl->maps[id].mem && cl->maps[id].dev == st.st_dev && cl->maps[id].ino == st.st_ino)
+                        return -EEXIST;
+        for (id = 0; id < VD_MAX_MAPS && cl->maps[id].mem; id++)
+                ;
+        if (id == VD_MAX_MAPS)
+                return -ENOSPC;
+
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED)
+                return -errno;
+        cl->maps[id].mem = mem;
+        cl->maps[id].len = len;
+        cl->maps[id].dev = st.st_dev;
+        cl->maps[id].ino = st.st_ino;
+        return id;
+}
+
+static const struct vd_buf *client_buf(const struct vd_client *cl, uint32_t id) {
+        return id < VD_MAX_MAPS && cl->maps[id].mem ? &cl->maps[id] : NULL;
+}
+
+static int key_cmp(const void *a, const void *b) {
+        uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Sorted addresses closer than @size name overlapping objects */
+static int keys_overlap(uintptr_t keys[], uint32_t nr, size_t size) {
+        uint32_t i;
+
+        qsort(keys, nr, sizeof(*keys), key_cmp);
+        for (i = 1; i < nr; i++)
+                if (keys[i] - keys[i - 1] < size)
+                        return 1;
+        return 0;
+}
+
+/*
+ * Turn a verify message into vreqs, whole message is refused on a bad
+ * entry. A page or metadata named twice would be repaired by two
+ * verifiers at once.
+ */
+static int client_prepare(struct vd_client *cl) {
+        uintptr_t pages[VD_MAX_BATCH], metas[VD_MAX_BATCH];
+        const struct vd_page *p;
+        const struct vd_buf *pb, *mb;
+        uint32_t i;
+
+        for (i = 0; i < cl->msg->nr; i++) {
+                p = &cl->msg->pages[i];
+                pb = client_buf(cl, p->buf);
+                mb = client_buf(cl, p->meta_buf);
+                if (!pb || !mb || p->page_off % PAGE_SIZE || p->page_off >= pb->len ||
+                    pb->len - p->page_off < PAGE_SIZE || p->meta_off % 8 ||
+                    p->meta_off >= mb->len || mb->len - p->meta_off < sizeof(struct page_meta))
+                        return -EINVAL;
+                cl->reqs[i].page = pb->mem + p->page_off;
+                cl->reqs[i].meta = (struct page_meta *) (mb->mem + p->meta_off);
+                cl->reqs[i].cookie = cl;
+                pages[i] = (uintptr_t) cl->reqs[i].page;
+                metas[i] = (uintptr_t) cl->reqs[i].meta;
+        }
+
+        if (keys_overlap(pages, cl->msg->nr, PAGE_SIZE) ||
+            keys_overlap(metas, cl->msg->nr, sizeof(struct page_meta)))
+                return -EINVAL;
+        cl->nr = cl->msg->nr;
+        return 0;
+}
+
+/**
+ * client_read - take one message of a ready client
+ * @cl - client
+ *
+ * Map and unmap are answered at once, a verify request is left in
+ * @cl->nr for the round. Returns negative errno to drop the client.
+ */
+
+static int client_read(struct vd_client *cl) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { .iov_base = cl->msg, .iov_len = VD_VERIFY_SIZE(VD_MAX_BATCH) };
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control, .msg_controllen = sizeof(control) };
+        struct cmsghdr *cmsg;
+        struct vd_hdr hdr;
+        int fd = -1, ret;
+        ssize_t got;
+
+        got = recvmsg(cl->fd, &mh, MSG_CMSG_CLOEXEC);
+        if (got <= 0)
+                return got ? -errno : -ECONNRESET;
+        for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if ((size_t) got < sizeof(hdr)) {
+                ret = -EPROTO;
+                goto out;
+        }
+        hdr = cl->msg->hdr;
+
+        switch (hdr.type) {
+        case VD_MSG_MAP:
+                if ((size_t) got < sizeof(struct vd_map) || fd < 0)
+                        ret = -EINVAL;
+                else
+                        ret = client_map(cl, fd, ((struct vd_map *) cl->msg)->len);
+                ret = reply_send(cl, &hdr, ret, 0);
+                break;
+        case VD_MSG_UNMAP: {
+                uint32_t id = ((struct vd_unmap *) cl->msg)->id;
+                const struct vd_buf *b = client_buf(cl, id);
+
+                if ((size_t) got < sizeof(struct vd_unmap) || !b) {
+                        ret = reply_send(cl, &hdr, -EINVAL, 0);
+                        break;
+                }
+                munmap(b->mem, b->len);
+                memset(&cl->maps[id], 0, sizeof(cl->maps[id]));
+                ret = reply_send(cl, &hdr, 0, 0);
+                break;
+        }
+        case VD_MSG_VERIFY:
+                if ((size_t) got < sizeof(struct vd_verify) || cl->msg->nr > VD_MAX_BATCH ||
+                    (size_t) got < VD_VERIFY_SIZE(cl->msg->nr))
+                        ret = -EINVAL;
+                else
+                        ret = client_prepare(cl);
+                /* Nothing to hand to the round, which answers only clients with pages */
+                if (ret || !cl->nr)
+                        ret = reply_send(cl, &hdr, ret, 0);
+                break;
+        default:
+                ret = reply_send(cl, &hdr, -EOPNOTSUPP, 0);
+        }
+
+out:
+        if (fd >= 0)
+                close(fd);
+        return ret;
+}
+
+/* Run all requests of the round, submission and reaping interleaved */
+static void verifyd_round(struct verifyd *vd, size_t total) {
+        size_t submitted = 0, reaped = 0, n;
+
+        while (reaped < total) {
+                n = 0;
+                if (submitted < total)
+                        n = vsvc_submit(&vd->svc, vd->batch + submitted, total - submitted);
+                submitted += n;
+                /* Wait only when nothing else can be done */
+                reaped += vsvc_complete(&vd->svc, vd->reaped, total - reaped,
+                                        submitted == total || !n);
+        }
+}
+
+static int verifyd_accept(struct verifyd *vd) {
+        int fd, i;
+
+        fd = accept4(vd->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+        for (i = 0; i < VD_MAX_CLIENTS && vd->clients[i]; i++)
+                ;
+        if (i == VD_MAX_CLIENTS || !(vd->clients[i] = client_new(fd))) {
+                close(fd);
+                return -ENOSPC;
+        }
+        return 0;
+}
+
+static int verifyd_loop(struct verifyd *vd) {
+        struct pollfd pfd[VD_MAX_CLIENTS + 1];
+        struct vd_client *cl;
+        size_t total;
+        int i, n, ret;
+
+        while (!stop) {
+                pfd[0] = (struct pollfd) { .fd = vd->listen_fd, .events = POLLIN };
+                for (i = 0; i < VD_MAX_CLIENTS; i++)
+                        pfd[i + 1] = (struct pollfd) { .fd = vd->clients[i] ? vd->clients[i]->fd : -1,
+                                                       .events = POLLIN };
+                n = poll(pfd, VD_MAX_CLIENTS + 1, -1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+                if (pfd[0].revents & POLLIN) {
+                        ret = verifyd_accept(vd);
+                        if (ret)
+                                fprintf(stderr, "verifyd: accept: %s\n", strerror(-ret));
+                }
+
+                total = 0;
+                for (i = 0; i < VD_MAX_CLIENTS; i++) {
+                        cl = vd->clients[i];
+                        if (!cl || !pfd[i + 1].revents)
+                                continue;
+                        cl->nr = 0;
+                        if (client_read(cl)) {
+                                client_free(cl);
+                                vd->clients[i] = NULL;
+                                continue;
+                        }
+                        for (n = 0; n < (int) cl->nr; n++)
+                                vd->batch[total++] = &cl->reqs[n];
+                }
+                if (!total)
+                        continue;
+
+                verifyd_round(vd, total);
+
+                for (i = 0; i < VD_MAX_CLIENTS; i++) {
+                        cl = vd->clients[i];
+                        if (!cl || !cl->nr)
+                                continue;
+                        for (n = 0; n < (int) cl->nr; n++)
+                                cl->reply->status[n] = cl->reqs[n].status;
+                        if (reply_send(cl, &cl->msg->hdr, 0, cl->nr)) {
+                                client_free(cl);
+                                vd->clients[i] = NULL;
+                                continue;
+                        }
+                        cl->nr = 0;
+                }
+        }
+
+        return 0;
+}
+
+static int verifyd_listen(struct verifyd *vd) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+        if (strlen(vd->path) >= sizeof(addr.sun_path))
+                return -ENAMETOOLONG;
+        strcpy(addr.sun_path, vd->path);
+        unlink(vd->path);
+
+        vd->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (vd->listen_fd < 0)
+                return -errno;
+        if (bind(vd->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(vd->listen_fd, VD_MAX_CLIENTS)) {
+                close(vd->listen_fd);
+                return -errno;
+        }
+        return 0;
+}
+
+/* Build lazily initialized tables now, not on the first client request */
+static void verifyd_warm(void) {
+        static uint8_t page[PAGE_SIZE] __attribute__((aligned(64)));
+        struct page_meta meta = { 0 };
+
+        page[0] = 1;
+        page_meta_init(&meta, page);
+        page[0] = 0;
+        page_repair(&meta, page);
+        crc32c_fixed(0, page, PAGE_SIZE);
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [-s socket] [-t threads] [-d depth] [-p]\n"
+                "  -s  socket path (default " VD_DEFAULT_SOCKET ")\n"
+                "  -t  verifier threads (default online CPUs)\n"
+                "  -d  submission ring size, power of two (default 4096)\n"
+                "  -p  poll for work instead of sleeping\n",
+                prog);
+}
+
+int main(int argc, char **argv) {
+        static struct verifyd vd;
+        struct sigaction sa = { .sa_handler = on_signal };
+        unsigned threads = 0;
+        size_t depth = 4096;
+        int mode = VSVC_BLOCK;
+        int opt, ret, i;
+
+        vd.path = VD_DEFAULT_SOCKET;
+        while ((opt = getopt(argc, argv, "s:t:d:ph")) != -1) {
+                switch (opt) {
+                case 's':
+                        vd.path = optarg;
+                        break;
+                case 't':
+                        threads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'd':
+                        depth = strtoul(optarg, NULL, 0);
+                        break;
+                case 'p':
+                        mode = VSVC_POLL;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt == 'h' ? 0 : 1;
+                }
+        }
+        if (!depth || depth & (depth - 1)) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        vd.batch = calloc(VD_MAX_CLIENTS * VD_MAX_BATCH, sizeof(*vd.batch));
+        vd.reaped = calloc(VD_MAX_CLIENTS * VD_MAX_BATCH, sizeof(*vd.reaped));
+        if (!vd.batch || !vd.reaped)
+                return 1;
+
+        verifyd_warm();
+        ret = vsvc_init(&vd.svc, threads, depth, mode);
+        if (ret) {
+                fprintf(stderr, "verifyd: %s\n", strerror(-ret));
+                return 1;
+        }
+        ret = verifyd_listen(&vd);
+        if (ret) {
+                fprintf(stderr, "verifyd: %s: %s\n", vd.path, strerror(-ret));
+                vsvc_destroy(&vd.svc);
+                return 1;
+        }
+
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        printf("verifyd: %s, %u verifiers\n", vd.path, vd.svc.nr_threads);
+        fflush(stdout);
+
+        ret = verifyd_loop(&vd);
+        if (ret)
+                fprintf(stderr, "verifyd: %s\n", strerror(-ret));
+
+        for (i = 0; i < VD_MAX_CLIENTS; i++)
+                if (vd.clients[i])
+                        client_free(vd.clients[i]);
+        close(vd.listen_fd);
+        unlink(vd.path);
+        vsvc_destroy(&vd.svc);
+        free(vd.batch);
+        free(vd.reaped);
+        return ret ? 1 : 0;
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "vsvc.h"
+
+/* Requests a verifier takes from the ring at once */
+#define VSVC_BATCH 16
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+}
+
+static void event_wait(struct vsvc_event *ev, uint32_t seq) {
+        __atomic_add_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+        /* Push after our snapshot changed seq, then futex returns at once */
+        if (__atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST) == seq)
+                syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        __atomic_sub_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static void event_post(struct vsvc_event *ev, int nr) {
+        __atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST))
+                syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static void vsvc_process(struct vreq *req) {
+        req->status = page_verify(req->meta, req->page);
+        if (req->status == PAGE_BAD)
+                req->status = page_repair(req->meta, req->page);
+}
+
+static void *vsvc_worker(void *arg) {
+        struct vsvc *svc = arg;
+        void *reqs[VSVC_BATCH];
+        size_t i, n, pushed;
+        uint32_t seq;
+
+        while (!__atomic_load_n(&svc->stop, __ATOMIC_RELAXED)) {
+                seq = __atomic_load_n(&svc->sub_ev.seq, __ATOMIC_SEQ_CST);
+                n = ring_pop_batch(&svc->sub, reqs, VSVC_BATCH);
+                if (!n) {
+                        if (svc->mode == VSVC_POLL)
+                                cpu_relax();
+                        else
+                                event_wait(&svc->sub_ev, seq);
+                        continue;
+                }
+
+                for (i = 0; i < n; i++)
+                        vsvc_process(reqs[i]);
+
+                /*
+                 * Submission is held to the size of the completion ring, it
+                 * may look full only while a reaper is between taking its
+                 * slots and freeing them, wait for the next reap.
+                 */
+                for (pushed = 0; ; ) {
+                        seq = __atomic_load_n(&svc->reap_ev.seq, __ATOMIC_SEQ_CST);
+                        pushed += ring_push_batch(&svc->done, reqs + pushed, n - pushed);
+                        if (pushed == n)
+                                break;
+                        if (__atomic_load_n(&svc->stop, __ATOMIC_RELAXED))
+                                return NULL;
+                        if (svc->mode == VSVC_POLL)
+                                cpu_relax();
+                        else
+                                event_wait(&svc->reap_ev, seq);
+                }
+                if (svc->mode == VSVC_BLOCK)
+                        event_post(&svc->done_ev, INT_MAX);
+        }
+
+        return NULL;
+}
+
+/**
+ * vsvc_init - start verification service
+ * @svc - service
+ * @nr_threads - verifier threads, 0 for one per online CPU
+ * @depth - submission ring size, power of two
+ * @mode - VSVC_BLOCK or VSVC_POLL
+ */
+
+int vsvc_init(struct vsvc *svc, unsigned nr_threads, size_t depth, int mode) {
+        unsigned i;
+        int ret;
+
+        if (!nr_threads)
+                nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        memset(svc, 0, sizeof(*svc));
+        svc->mode = mode;
+        ret = ring_init(&svc->sub, depth);
+        if (ret)
+                return ret;
+        /* Room for everything submitted plus what verifiers hold */
+        ret = ring_init(&svc->done, depth * 2);
+        if (ret)
+                goto err;
+
+        svc->threads = calloc(nr_threads, sizeof(*svc->threads));
+        if (!svc->threads) {
+                ret = -ENOMEM;
+                goto err;
+        }
+        for (i = 0; i < nr_threads; i++) {
+                ret = -pthread_create(&svc->threads[i], NULL, vsvc_worker, svc);
+                if (ret) {
+                        vsvc_destroy(svc);
+                        return ret;
+                }
+                svc->nr_threads++;
+        }
+
+        return 0;
+
+err:
+        ring_free(&svc->sub);
+        ring_free(&svc->done);
+        return ret;
+}
+
+/**
+ * vsvc_submit - queue requests for verification
+ * @svc - service
+ * @reqs - requests, owned by the service until reaped
+ * @n - number of requests
+ *
+ * Never blocks. Returns number of requests queued, less than @n
+ * when submission ring is full or as many requests as the completion
+ * ring holds are not reaped yet.
+ */
+
+size_t vsvc_submit(struct vsvc *svc, struct vreq *const reqs[], size_t n) {
+        uint64_t cur = __atomic_load_n(&svc->inflight, __ATOMIC_RELAXED);
+        uint64_t cap = svc->done.mask + 1;
+        size_t take, pushed;
+
+        do {
+                if (cur >= cap)
+                        return 0;
+                take = n < cap - cur ? n : cap - cur;
+        } while (!__atomic_compare_exchange_n(&svc->inflight, &cur, cur + take, 1,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        pushed = ring_push_batch(&svc->sub, (void *const *) reqs, take);
+        if (pushed < take)
+                __atomic_sub_fetch(&svc->inflight, take - pushed, __ATOMIC_RELAXED);
+        if (pushed && svc->mode == VSVC_BLOCK)
+                event_post(&svc->sub_ev, pushed);
+
+        return pushed;
+}
+
+/**
+ * vsvc_complete - reap finished requests
+ * @svc - service
+ * @reqs - output
+ * @max - size of @reqs
+ * @wait - wait for at least one request, sleep or spin depending on mode
+ *
+ * Requests complete in any order. Returns number of requests reaped.
+ */
+
+size_t vsvc_complete(struct vsvc *svc, struct vreq *reqs[], size_t max, int wait) {
+        uint32_t seq;
+        size_t n;
+
+        for (;;) {
+                seq = __atomic_load_n(&svc->done_ev.seq, __ATOMIC_SEQ_CST);
+                n = ring_pop_batch(&svc->done, (void **) reqs, max);
+                if (n) {
+                        __atomic_sub_fetch(&svc->inflight, n, __ATOMIC_RELAXED);
+                        if (svc->mode == VSVC_BLOCK)
+                                event_post(&svc->reap_ev, INT_MAX);
+                        return n;
+                }
+                if (!wait)
+                        return 0;
+                if (svc->mode == VSVC_POLL)
+                        cpu_relax();
+                else
+                        event_wait(&svc->done_ev, seq);
+        }
+}
+
+/**
+ * vsvc_destroy - stop verifiers and free rings
+ * @svc - service
+ *
+ * Requests still queued are dropped, reap them first.
+ */
+
+void vsvc_destroy(struct vsvc *svc) {
+        unsigned i;
+
+        __atomic_store_n(&svc->stop, 1, __ATOMIC_RELAXED);
+        event_post(&svc->sub_ev, INT_MAX);
+        event_post(&svc->reap_ev, INT_MAX);
+        for (i = 0; i < svc->nr_threads; i++)
+                pthread_join(svc->threads[i], NULL);
+
+        free(svc->threads);
+        svc->threads = NULL;
+        svc->nr_threads = 0;
+        ring_free(&svc->sub);
+        ring_free(&svc->done);
+}
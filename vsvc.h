@@ -0,0 +1,62 @@
+#ifndef VSVC_H
+#define VSVC_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "ring.h"
+#include "verify.h"
+
+/* Idle verifiers and waiting callers sleep on a futex */
+#define VSVC_BLOCK 0
+/* Idle verifiers and waiting callers spin, lowest latency, burns CPU */
+#define VSVC_POLL 1
+
+/**
+ * struct vreq - one page verification request
+ * @page - PAGE_SIZE bytes, repaired in place when possible
+ * @meta - stored protection values of @page
+ * @status - on completion PAGE_OK, PAGE_REPAIRED or PAGE_BAD
+ * @cookie - untouched, for the caller
+ */
+struct vreq {
+        void *page;
+        struct page_meta *meta;
+        int status;
+        void *cookie;
+};
+
+/* Futex backed event counter, bumped on every push to its ring */
+struct vsvc_event {
+        uint32_t seq __attribute__((aligned(64)));
+        uint32_t waiters;
+};
+
+/**
+ * struct vsvc - pool of verifier threads fed by a lock-free ring
+ *
+ * Any number of threads submit to @sub and reap from @done. Requests
+ * submitted and not reaped yet are counted in @inflight and held to the
+ * size of @done, so a verifier always has room for its results.
+ */
+struct vsvc {
+        struct ring sub;
+        struct ring done;
+        struct vsvc_event sub_ev;
+        struct vsvc_event done_ev;
+        /* Bumped on every reap, verifiers short of room in @done sleep on it */
+        struct vsvc_event reap_ev;
+        uint64_t inflight;
+        pthread_t *threads;
+        unsigned nr_threads;
+        int mode;
+        int stop;
+};
+
+int vsvc_init(struct vsvc *svc, unsigned nr_threads, size_t depth, int mode);
+size_t vsvc_submit(struct vsvc *svc, struct vreq *const reqs[], size_t n);
+size_t vsvc_complete(struct vsvc *svc, struct vreq *reqs[], size_t max, int wait);
+void vsvc_destroy(struct vsvc *svc);
+
+#endif /* VSVC_H */